@@ -0,0 +1,388 @@
+//
+// Host benchmark of the firmware's image decode paths
+//
+//   decode_bench [-n runs] [-s] [-r rotation] [-w width -h height] file ...
+//
+// Each file is decoded into a stub 4bpp framebuffer by every decoder that
+// is built in and understands its format, the way main/epdiy-clock.c
+// drives them:
+//   jpegdec  JPEG_decodeEPD() with the JPEG_DECODE_* options of settings.h,
+//            jpegdec_scale() and jpegdec_crop()
+//   tjpgd    jd_prepare()/jd_decomp(), tjd_output() into epd_draw_pixel()
+//   pngle    pngle_feed(), on_draw_png() into epd_draw_pixel()
+// The draw callbacks and the scale and crop choice are the firmware's own
+// main/image_draw.c, built against the stand-ins in include/. The decode
+// sequences below are copies of the epdiy-clock.c functions they name and
+// have to follow changes there. tjpgd and pngle are only built when their
+// sources are found (Makefile).
+//
+// Reported per decoder: best time of `runs' decodes from RAM, source
+// megapixels per second, peak heap of one decode (malloc is wrapped at link
+// time) and a hash of the framebuffer, so a speedup that changes the output
+// shows up next to the numbers. -s decodes JPEGDEC on one thread.
+//
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "epdiy.h"
+#include "image_draw.h"
+
+/// heap accounting, see LDFLAGS in the Makefile
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+// keeps the block size in front of it, 16 bytes to keep malloc's alignment
+#define HEAP_HEADER 16
+
+static size_t heap_now, heap_peak;
+
+void *__wrap_malloc(size_t size) {
+    uint8_t *p = __real_malloc(size + HEAP_HEADER);
+    if (!p) {
+        return NULL;
+    }
+    *(size_t *)p = size;
+    size_t now = __atomic_add_fetch(&heap_now, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return p + HEAP_HEADER;
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    void *p = __wrap_malloc(count * size);
+    if (p) {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+void __wrap_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    uint8_t *p = (uint8_t *)ptr - HEAP_HEADER;
+    __atomic_sub_fetch(&heap_now, *(size_t *)p, __ATOMIC_RELAXED);
+    __real_free(p);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return __wrap_malloc(size);
+    }
+    size_t old = *(size_t *)((uint8_t *)ptr - HEAP_HEADER);
+    void *p = __wrap_malloc(size);
+    if (p) {
+        memcpy(p, ptr, old < size ? old : size);
+        __wrap_free(ptr);
+    }
+    return p;
+}
+
+/// epdiy shim
+
+static int panel_width = 1448, panel_height = 1072;
+static enum EpdRotation rotation = DISPLAY_ROTATION;
+uint8_t gamme_curve[256];
+
+int epd_width(void) { return panel_width; }
+int epd_height(void) { return panel_height; }
+int epd_rotated_display_width(void) { return (rotation & 1) ? panel_height : panel_width; }
+int epd_rotated_display_height(void) { return (rotation & 1) ? panel_width : panel_height; }
+
+// same rotation, clipping and nibble order as epdiy
+void epd_draw_pixel(int x, int y, uint8_t color, uint8_t *framebuffer) {
+    int t;
+    switch (rotation) {
+        case EPD_ROT_LANDSCAPE:
+            break;
+        case EPD_ROT_PORTRAIT:
+            t = x;
+            x = epd_width() - y - 1;
+            y = t;
+            break;
+        case EPD_ROT_INVERTED_LANDSCAPE:
+            x = epd_width() - x - 1;
+            y = epd_height() - y - 1;
+            break;
+        case EPD_ROT_INVERTED_PORTRAIT:
+            t = x;
+            x = y;
+            y = epd_height() - t - 1;
+            break;
+    }
+    if (x < 0 || x >= epd_width() || y < 0 || y >= epd_height()) {
+        return;
+    }
+    uint8_t *p = &framebuffer[y * epd_width() / 2 + x / 2];
+    if (x % 2) {
+        *p = (*p & 0x0f) | (color & 0xf0);
+    } else {
+        *p = (*p & 0xf0) | (color >> 4);
+    }
+}
+
+// generate_gamme(0.7) in main/epdiy-clock.c
+static void generate_gamme(double gamma_value) {
+    double gammaCorrection = 1.0 / gamma_value;
+    for (int gray_value = 0; gray_value < 256; gray_value++)
+        gamme_curve[gray_value] = round(255 * pow(gray_value / 255.0, gammaCorrection));
+}
+
+/// decoders, each returns 0 and the source size, or -1 if it rejects the file
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    int serial;
+} SOURCE;
+
+static int jpegdec_yield(JPEGDRAW *draw) {
+    return 1;
+}
+
+// draw_jpeg_jpegdec()
+static int decode_jpegdec(const SOURCE *src, uint8_t *fb, int *width, int *height) {
+    JPEGIMAGE *jpeg = malloc(sizeof(JPEGIMAGE));
+    int ret = -1;
+
+    if (!jpeg) {
+        return -1;
+    }
+    if (!JPEG_openRAM(jpeg, (uint8_t *)src->data, src->size, jpegdec_yield)) {
+        goto cleanup;
+    }
+    *width = JPEG_getWidth(jpeg);
+    *height = JPEG_getHeight(jpeg);
+    int w, h;
+    int scale = jpegdec_scale(jpeg, &w, &h);
+    if (scale < 0) {
+        JPEG_close(jpeg);
+        goto cleanup;
+    }
+    int options = (JPEG_DECODE_PARALLEL && !src->serial) ? JPEG_PARALLEL_DECODE : 0;
+    if (JPEG_DECODE_EXIF_ROTATE) {
+        options |= JPEG_AUTO_ROTATE;
+    }
+    options |= jpegdec_scale_option(scale);
+    int x = (epd_rotated_display_width() - (w >> scale)) / 2;
+    int y = (epd_rotated_display_height() - (h >> scale)) / 2;
+#if JPEG_DECODE_SMART_CROP
+    if ((w >> scale) > epd_rotated_display_width() || (h >> scale) > epd_rotated_display_height()) {
+        jpegdec_crop(jpeg, w, h, scale, &x, &y);
+        JPEG_close(jpeg);
+        if (!JPEG_openRAM(jpeg, (uint8_t *)src->data, src->size, jpegdec_yield)) {
+            goto cleanup;
+        }
+    }
+#endif
+    if (JPEG_decodeEPD(jpeg, fb, epd_width(), epd_height(), rotation, gamme_curve, x, y, options)) {
+        ret = 0;
+    }
+    JPEG_close(jpeg);
+cleanup:
+    free(jpeg);
+    return ret;
+}
+
+#ifdef HAVE_TJPGD
+static const SOURCE *tjpgd_source;
+static size_t feed_buffer_pos;
+
+// feed_buffer()
+static uint32_t feed_buffer(JDEC *jd, uint8_t *buff, uint32_t nd) {
+    uint32_t count = 0;
+
+    while (count < nd && feed_buffer_pos < tjpgd_source->size) {
+        if (buff != NULL) {
+            *buff++ = tjpgd_source->data[feed_buffer_pos];
+        }
+        count++;
+        feed_buffer_pos++;
+    }
+    return count;
+}
+
+// draw_jpeg() without JPEGDEC; the firmware's 3096 byte work area is
+// static, it is allocated here so that it counts
+static int decode_tjpgd(const SOURCE *src, uint8_t *fb, int *width, int *height) {
+    JDEC jd;
+    void *work = malloc(3096);
+    int ret = -1;
+
+    if (!work) {
+        return -1;
+    }
+    tjpgd_source = src;
+    feed_buffer_pos = 0;
+    if (jd_prepare(&jd, feed_buffer, work, 3096, fb) == JDR_OK) {
+        *width = jd.width;
+        *height = jd.height;
+        if (jd_decomp(&jd, tjd_output, 0) == JDR_OK) {
+            ret = 0;
+        }
+    }
+    free(work);
+    return ret;
+}
+#endif // HAVE_TJPGD
+
+#ifdef HAVE_PNGLE
+uint8_t render_pixel_skip;
+
+// draw_png(), with render_pixel_skip starting over for every image
+static int decode_pngle(const SOURCE *src, uint8_t *fb, int *width, int *height) {
+    pngle_t *pngle = pngle_new();
+    int ret = -1;
+
+    if (!pngle) {
+        return -1;
+    }
+    render_pixel_skip = 0xff;
+    pngle_set_user_data(pngle, fb);
+    pngle_set_draw_callback(pngle, on_draw_png);
+    if (pngle_feed(pngle, src->data, src->size) >= 0) {
+        *width = pngle_get_width(pngle);
+        *height = pngle_get_height(pngle);
+        ret = 0;
+    }
+    pngle_destroy(pngle);
+    return ret;
+}
+#endif // HAVE_PNGLE
+
+/// benchmark
+
+typedef int (*DECODER)(const SOURCE *src, uint8_t *fb, int *width, int *height);
+
+static const struct {
+    const char *name;
+    int png; // which format it takes
+    DECODER decode;
+} decoders[] = {
+    { "jpegdec", 0, decode_jpegdec },
+#ifdef HAVE_TJPGD
+    { "tjpgd", 0, decode_tjpgd },
+#endif
+#ifdef HAVE_PNGLE
+    { "pngle", 1, decode_pngle },
+#endif
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// FNV-1a
+static uint32_t hash(const uint8_t *p, size_t len) {
+    uint32_t h = 2166136261u;
+    while (len--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h;
+}
+
+static uint8_t *read_file(const char *filename, size_t *size) {
+    FILE *f = fopen(filename, "rb");
+    uint8_t *data = NULL;
+    long len;
+
+    if (!f) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(len);
+        if (data && fread(data, 1, len, f) != (size_t)len) {
+            free(data);
+            data = NULL;
+        }
+        *size = len;
+    }
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char **argv) {
+    int runs = 5, serial = 0, failed = 0, opt;
+
+    while ((opt = getopt(argc, argv, "n:sr:w:h:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 's': serial = 1; break;
+            case 'r': rotation = (enum EpdRotation)(atoi(optarg) & 3); break;
+            case 'w': panel_width = atoi(optarg) & ~1; break;
+            case 'h': panel_height = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n runs] [-s] [-r rotation] [-w width -h height] file ...\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc || runs < 1 || panel_width <= 0 || panel_height <= 0) {
+        fprintf(stderr, "usage: %s [-n runs] [-s] [-r rotation] [-w width -h height] file ...\n", argv[0]);
+        return 2;
+    }
+    generate_gamme(0.7);
+    size_t fb_size = (size_t)epd_width() / 2 * epd_height();
+    uint8_t *fb = malloc(fb_size);
+    if (!fb) {
+        return 1;
+    }
+
+    printf("%-24s %-8s %11s %9s %9s %9s  %s\n", "image", "decoder", "size", "ms", "MPix/s", "heap KiB", "fb hash");
+    for (int i = optind; i < argc; i++) {
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        SOURCE src = { .serial = serial };
+        uint8_t *data = read_file(argv[i], &src.size);
+        if (!data) {
+            printf("%-24.24s unreadable\n", name);
+            failed++;
+            continue;
+        }
+        src.data = data;
+        int png = src.size > 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0;
+        int tried = 0;
+        for (int d = 0; d < (int)(sizeof(decoders) / sizeof(decoders[0])); d++) {
+            if (decoders[d].png != png) {
+                continue;
+            }
+            tried++;
+            double best = 0;
+            size_t heap = 0;
+            int width = 0, height = 0, ret = 0;
+            for (int r = 0; r < runs && ret == 0; r++) {
+                memset(fb, 0xff, fb_size);
+                size_t base = heap_now;
+                heap_peak = heap_now;
+                double start = now_ms();
+                ret = decoders[d].decode(&src, fb, &width, &height);
+                double elapsed = now_ms() - start;
+                if (r == 0) {
+                    heap = heap_peak - base;
+                }
+                if (best == 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            if (ret != 0) {
+                printf("%-24.24s %-8s %5dx%-5d  rejected\n", name, decoders[d].name, width, height);
+                continue;
+            }
+            printf("%-24.24s %-8s %5dx%-5d %9.2f %9.1f %9.1f  %08x\n", name, decoders[d].name, width, height, best,
+                   (double)width * height / best / 1000.0, heap / 1024.0, hash(fb, fb_size));
+        }
+        if (!tried) {
+            printf("%-24.24s %-8s not built\n", name, png ? "pngle" : "jpeg");
+        }
+        free(data);
+    }
+    free(fb);
+    return failed != 0;
+}
@@ -0,0 +1,16 @@
+// Host stand-in for epdiy.h, the functions are decode_bench.c's shim
+#pragma once
+#include <stdint.h>
+
+enum EpdRotation {
+    EPD_ROT_LANDSCAPE = 0,
+    EPD_ROT_PORTRAIT = 1,
+    EPD_ROT_INVERTED_LANDSCAPE = 2,
+    EPD_ROT_INVERTED_PORTRAIT = 3,
+};
+
+int epd_width(void);
+int epd_height(void);
+int epd_rotated_display_width(void);
+int epd_rotated_display_height(void);
+void epd_draw_pixel(int x, int y, uint8_t color, uint8_t *framebuffer);
@@ -0,0 +1,2 @@
+// Host stand-in for FreeRTOS.h
+#pragma once
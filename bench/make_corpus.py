@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""Generate the decode benchmark corpus in bench/corpus.
+
+The images are synthetic but photo-like: smooth multi-octave shading,
+soft-edged shapes, some sharp detail and sensor-style grain, so the
+entropy and IDCT stages see realistic coefficient statistics. Output is
+deterministic for a given Pillow/libjpeg version; the committed files are
+the reference, rerun this only to change the set.
+
+    make_corpus.py [--out bench/corpus]
+"""
+import argparse
+import io
+import os
+
+import numpy as np
+from PIL import Image, ImageDraw, ImageFilter
+
+# EXIF orientation tag, value 6 = rotate 90 CW to display (phone held upright)
+EXIF_ORIENTATION = 0x0112
+
+
+def photo(width, height, seed, grain=5.0):
+    """RGB uint8 array of a made up scene."""
+    rng = np.random.default_rng(seed)
+    img = np.zeros((height, width, 3), dtype=np.float32)
+    # low frequency shading, a few octaves per channel
+    for octave, weight in ((4, 90), (12, 40), (40, 18), (160, 24), (480, 14)):
+        for c in range(3):
+            small = rng.random((octave * height // width + 2, octave + 2)).astype(np.float32)
+            layer = Image.fromarray((small * 255).astype(np.uint8)).resize((width, height), Image.BICUBIC)
+            img[..., c] += (np.asarray(layer, dtype=np.float32) / 255 - 0.5) * weight
+    img += rng.random(3).astype(np.float32) * 80 + 90
+    # shapes with soft and hard edges
+    canvas = Image.fromarray(np.clip(img, 0, 255).astype(np.uint8))
+    overlay = Image.new("RGBA", canvas.size)
+    draw = ImageDraw.Draw(overlay)
+    scale = width / 1448
+    for _ in range(40):
+        x, y = rng.random(2) * (width, height)
+        r = (20 + rng.random() * 160) * scale
+        fill = tuple(int(v) for v in rng.integers(0, 256, 3)) + (int(90 + rng.random() * 165),)
+        if rng.random() < 0.6:
+            draw.ellipse((x - r, y - r * 0.7, x + r, y + r * 0.7), fill=fill)
+        else:
+            draw.line((x, y, x + rng.normal() * r * 3, y + rng.normal() * r * 3), fill=fill,
+                      width=max(1, int(rng.random() * 8 * scale)))
+    soft = overlay.filter(ImageFilter.GaussianBlur(3 * scale))
+    canvas = Image.alpha_composite(canvas.convert("RGBA"), soft)
+    canvas = Image.alpha_composite(canvas, overlay.filter(ImageFilter.GaussianBlur(0.6)))
+    out = np.asarray(canvas.convert("RGB"), dtype=np.float32)
+    out += rng.normal(0, grain, out.shape).astype(np.float32)
+    return np.clip(out, 0, 255).astype(np.uint8)
+
+
+def save(path, image, **kwargs):
+    buf = io.BytesIO()
+    image.save(buf, **kwargs)
+    with open(path, "wb") as f:
+        f.write(buf.getvalue())
+    print("%-24s %5dx%-5d %8d bytes" % (os.path.basename(path), image.width, image.height,
+                                        len(buf.getvalue())))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--out", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "corpus"))
+    args = parser.parse_args()
+    os.makedirs(args.out, exist_ok=True)
+    out = lambda name: os.path.join(args.out, name)
+
+    # display sized, the common case for a 1448x1072 panel
+    display = Image.fromarray(photo(1448, 1072, 1))
+    save(out("baseline_420.jpg"), display, format="JPEG", quality=85, subsampling="4:2:0")
+    save(out("baseline_444.jpg"), display, format="JPEG", quality=90, subsampling="4:4:4")
+    save(out("baseline_gray.jpg"), display.convert("L"), format="JPEG", quality=85)
+    # restart markers every MCU row, JPEG_DECODE_PARALLEL splits these
+    save(out("restart_420.jpg"), display, format="JPEG", quality=85, subsampling="4:2:0",
+         restart_marker_rows=1)
+    save(out("progressive_420.jpg"), display, format="JPEG", quality=85, subsampling="4:2:0",
+         progressive=True)
+    # a phone photo: 12 MP, stored landscape, shown portrait by EXIF
+    phone = Image.fromarray(photo(4032, 3024, 2, grain=3.0))
+    exif = Image.Exif()
+    exif[EXIF_ORIENTATION] = 6
+    save(out("large_420_exif6.jpg"), phone, format="JPEG", quality=80, subsampling="4:2:0",
+         exif=exif.tobytes())
+    # PNG: an 8-bit gray screenshot-like image and an RGBA one with transparency
+    smooth = Image.fromarray(photo(1448, 1072, 1, grain=0.0))
+    save(out("gray.png"), smooth.convert("L"), format="PNG", optimize=True)
+    rgba = Image.fromarray(photo(800, 600, 3, grain=0.0)).convert("RGBA")
+    alpha = Image.new("L", rgba.size, 0)
+    ImageDraw.Draw(alpha).ellipse((40, 30, 760, 570), fill=255)
+    rgba.putalpha(alpha.filter(ImageFilter.GaussianBlur(12)))
+    save(out("rgba.png"), rgba, format="PNG", optimize=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -83,6 +83,21 @@ int JPEGDEC::getOrientation()
     return (int)_jpeg.ucOrientation;
 } /* getOrientation() */
 
+int JPEGDEC::getJPEGType()
+{
+    return (_jpeg.ucMode == 0xc2) ? JPEG_MODE_PROGRESSIVE : JPEG_MODE_BASELINE;
+} /* getJPEGType() */
+
+int JPEGDEC::getProgressiveSize(int iOptions)
+{
+    return JPEGCoeffLayout(&_jpeg, iOptions, NULL);
+} /* getProgressiveSize() */
+
+int JPEGDEC::getSaliency(uint8_t *pMap)
+{
+    return JPEGSaliency(&_jpeg, pMap);
+} /* getSaliency() */
+
 int JPEGDEC::getLastError()
 {
     return _jpeg.iError;
@@ -197,3 +212,24 @@ int JPEGDEC::decodeDither(uint8_t *pDither, int iOptions)
     _jpeg.pDitherBuffer = pDither;
     return DecodeJPEG(&_jpeg);
 }
+//
+// Decode straight into a 4bpp epdiy framebuffer
+// x, y place the image in display (rotated) coordinates; negative values
+// crop it, and only MCUs in the visible source rectangle get the IDCT.
+// JPEG_AUTO_ROTATE turns the image upright by its EXIF orientation
+//
+int JPEGDEC::decodeEPD(uint8_t *pFramebuffer, int iFBWidth, int iFBHeight, int iRotation, const uint8_t *pGamma, int x, int y, int iOptions)
+{
+    if (!JPEGSetEPD(&_jpeg, pFramebuffer, iFBWidth, iFBHeight, iRotation, pGamma))
+        return 0;
+    _jpeg.iXOffset = x;
+    _jpeg.iYOffset = y;
+    _jpeg.iOptions = iOptions;
+    if (_jpeg.ucMode == 0xc2 && !(iOptions & JPEG_EXIF_THUMBNAIL))
+        return JPEGDecodeProgressive(&_jpeg);
+#ifdef JPEG_PARALLEL
+    if (iOptions & JPEG_PARALLEL_DECODE)
+        return JPEGDecodeParallel(&_jpeg);
+#endif
+    return DecodeJPEG(&_jpeg);
+}
@@ -0,0 +1,203 @@
+//
+// Reduced size IDCT kernels against the full JPEGIDCT() per scale
+//
+//   idct_bench [-n blocks] [-r runs]
+//
+// Blocks are smooth random 8x8 patches with some edges and noise, forward
+// DCT'd and quantized with the IJG quality 75 luminance table. For the
+// scaled modes the reference is the float IDCT of the same coefficients,
+// box averaged to the output size; the baseline is JPEGIDCT() followed by
+// the same averaging, which is what the scaled writers did before.
+//
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../jpeg.c"
+
+// quality 75 luminance quantization in zigzag order, as the DQT segment stores it
+static const uint8_t ucQuant75[64] = {
+     8,  6,  6,  7,  6,  5,  8,  7,  7,  7,  9,  9,  8, 10, 12, 20,
+    13, 12, 11, 11, 12, 25, 18, 19, 15, 20, 29, 26, 31, 30, 29, 26,
+    28, 28, 32, 36, 46, 39, 32, 34, 44, 35, 28, 28, 40, 55, 41, 44,
+    48, 49, 52, 52, 52, 31, 39, 57, 61, 56, 50, 60, 46, 51, 52, 50
+};
+
+typedef struct {
+    int16_t sCoeff[64]; // natural order, quantized
+    int iACFlags;       // as JPEGDecodeMCU() reports them
+    float fPixels[64];  // float IDCT of the dequantized coefficients
+} BLOCK;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static float frand(void)
+{
+    return (float)rand() / RAND_MAX;
+}
+
+static float dct_c(int u)
+{
+    return u ? 1.0f : (float)M_SQRT1_2;
+}
+
+static void make_block(BLOCK *b, const uint16_t *quant)
+{
+    float pix[64], f;
+    float gx = (frand() - 0.5f) * 24, gy = (frand() - 0.5f) * 24, base = 40 + frand() * 176;
+    int edge = (rand() & 3) == 0, ex = rand() & 7, step = (int)((frand() - 0.5f) * 160);
+    int u, v, x, y, q;
+
+    for (y = 0; y < 8; y++)
+        for (x = 0; x < 8; x++) {
+            f = base + gx * (x - 3.5f) + gy * (y - 3.5f) + (frand() - 0.5f) * 12;
+            if (edge && x >= ex)
+                f += step;
+            pix[y * 8 + x] = (f < 0 ? 0 : f > 255 ? 255 : f) - 128;
+        }
+    b->iACFlags = 0;
+    for (v = 0; v < 8; v++)
+        for (u = 0; u < 8; u++) {
+            f = 0;
+            for (y = 0; y < 8; y++)
+                for (x = 0; x < 8; x++)
+                    f += pix[y * 8 + x] * cosf((2 * x + 1) * u * (float)M_PI / 16) * cosf((2 * y + 1) * v * (float)M_PI / 16);
+            f *= dct_c(u) * dct_c(v) / 4;
+            q = (int)lrintf(f / quant[v * 8 + u]);
+            b->sCoeff[v * 8 + u] = (int16_t)q;
+            if (q && (u | v)) {
+                b->iACFlags |= 1 << u;
+                if (v >= 4)
+                    b->iACFlags |= 1 << (u + 8);
+            }
+        }
+    for (y = 0; y < 8; y++)
+        for (x = 0; x < 8; x++) {
+            f = 0;
+            for (v = 0; v < 8; v++)
+                for (u = 0; u < 8; u++)
+                    f += dct_c(u) * dct_c(v) * b->sCoeff[v * 8 + u] * quant[v * 8 + u] *
+                         cosf((2 * x + 1) * u * (float)M_PI / 16) * cosf((2 * y + 1) * v * (float)M_PI / 16);
+            b->fPixels[y * 8 + x] = f / 4 + 128;
+        }
+}
+
+// output of an 8x8 JPEGIDCT() averaged down to size x size
+static void average(const uint8_t *src, uint8_t *dst, int size)
+{
+    int n = 8 / size, x, y, i, j, sum;
+
+    for (y = 0; y < size; y++)
+        for (x = 0; x < size; x++) {
+            sum = 0;
+            for (j = 0; j < n; j++)
+                for (i = 0; i < n; i++)
+                    sum += src[(y * n + j) * 8 + x * n + i];
+            dst[y * size + x] = (uint8_t)((sum + n * n / 2) / (n * n));
+        }
+}
+
+static void error(const BLOCK *b, const uint8_t *out, int size, double *sum, int *max)
+{
+    int n = 8 / size, x, y, i, j, e;
+    float ref;
+
+    for (y = 0; y < size; y++)
+        for (x = 0; x < size; x++) {
+            ref = 0;
+            for (j = 0; j < n; j++)
+                for (i = 0; i < n; i++)
+                    ref += b->fPixels[(y * n + j) * 8 + x * n + i];
+            ref /= n * n;
+            ref = ref < 0 ? 0 : ref > 255 ? 255 : ref;
+            e = abs(out[y * size + x] - (int)lrintf(ref));
+            *sum += e;
+            if (e > *max)
+                *max = e;
+        }
+}
+
+typedef void (*IDCT)(JPEGIMAGE *, int, int, int);
+
+// best blocks per second of `runs' passes, and the error of the result
+static double run(JPEGIMAGE *pJPEG, const BLOCK *blocks, int count, int runs, IDCT idct, int size,
+                  double *mean, int *max)
+{
+    double best = 0, start, elapsed, sum = 0;
+    uint8_t avg[16];
+    int i, r;
+
+    *max = 0;
+    for (r = 0; r < runs; r++) {
+        start = now_ms();
+        for (i = 0; i < count; i++) {
+            memcpy(pJPEG->sMCUs, blocks[i].sCoeff, sizeof(blocks[i].sCoeff));
+            (*idct)(pJPEG, 0, 0, blocks[i].iACFlags);
+            if (idct == JPEGIDCT && size < 8)
+                average((uint8_t *)pJPEG->sMCUs, avg, size);
+            if (r == 0)
+                error(&blocks[i], (idct == JPEGIDCT && size < 8) ? avg : (uint8_t *)pJPEG->sMCUs, size, &sum, max);
+        }
+        elapsed = now_ms() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+    *mean = sum / ((double)count * size * size);
+    return count / best * 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    static JPEGIMAGE jpeg;
+    static const struct { const char *name; int size; IDCT kernel; } scales[] = {
+        { "full",    8, JPEGIDCT },
+        { "half",    4, JPEGIDCT4x4 },
+        { "quarter", 2, JPEGIDCT2x2 },
+    };
+    int count = 20000, runs = 20, opt, i, max;
+    uint16_t quant[64];
+    double rate, mean;
+    BLOCK *blocks;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n': count = atoi(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n blocks] [-r runs]\n", argv[0]);
+                return 1;
+        }
+    }
+    for (i = 0; i < 64; i++) {
+        jpeg.sQuantTable[i] = ucQuant75[i];
+        quant[i] = ucQuant75[cZigZag[i]]; // natural order for the float transforms
+    }
+    jpeg.ucNumComponents = 1;
+    JPEGFixQuantD(&jpeg);
+    blocks = malloc(count * sizeof(BLOCK));
+    if (blocks == NULL)
+        return 1;
+    srand(1);
+    for (i = 0; i < count; i++)
+        make_block(&blocks[i], quant);
+
+    printf("%-8s %-12s %12s %10s %8s\n", "scale", "kernel", "blocks/s", "mean err", "max err");
+    for (i = 0; i < (int)(sizeof(scales) / sizeof(scales[0])); i++) {
+        rate = run(&jpeg, blocks, count, runs, JPEGIDCT, scales[i].size, &mean, &max);
+        printf("%-8s %-12s %12.0f %10.3f %8d\n", scales[i].name, scales[i].size < 8 ? "8x8+average" : "8x8",
+               rate, mean, max);
+        if (scales[i].kernel == JPEGIDCT)
+            continue;
+        rate = run(&jpeg, blocks, count, runs, scales[i].kernel, scales[i].size, &mean, &max);
+        printf("%-8s %-12s %12.0f %10.3f %8d\n", "", scales[i].size == 4 ? "4x4" : "2x2", rate, mean, max);
+    }
+    free(blocks);
+    return 0;
+}
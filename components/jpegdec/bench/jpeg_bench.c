@@ -0,0 +1,86 @@
+//
+// Serial vs JPEG_PARALLEL_DECODE decoding into a 4bpp EPD framebuffer
+//
+//   jpeg_bench [-r rotation] [-n runs] [-w width -h height] file.jpg ...
+//
+// Images need restart markers to split, for example
+//   cjpeg -restart 1 ...  or  Pillow's save(..., restart_marker_rows=1)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "JPEGDEC.h"
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// best of `runs' decodes centred on the display, 0 on error
+static double decode(const char *filename, uint8_t *fb, int width, int height, int rotation, int options, int runs)
+{
+    static JPEGIMAGE jpeg;
+    double best = 0;
+    int display_width = (rotation & 1) ? height : width;
+    int display_height = (rotation & 1) ? width : height;
+
+    for (int i = 0; i < runs; i++) {
+        memset(fb, 0xff, width / 2 * height);
+        if (!JPEG_openFile(&jpeg, filename, NULL)) {
+            fprintf(stderr, "%s: open failed (%d)\n", filename, JPEG_getLastError(&jpeg));
+            return 0;
+        }
+        int x = (display_width - JPEG_getWidth(&jpeg)) / 2;
+        int y = (display_height - JPEG_getHeight(&jpeg)) / 2;
+        double start = now_ms();
+        int ok = JPEG_decodeEPD(&jpeg, fb, width, height, rotation, NULL, x, y, options);
+        double elapsed = now_ms() - start;
+        JPEG_close(&jpeg);
+        if (!ok) {
+            fprintf(stderr, "%s: decode failed (%d)\n", filename, JPEG_getLastError(&jpeg));
+            return 0;
+        }
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int width = 1448, height = 1072, rotation = 0, runs = 10, opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "r:n:w:h:")) != -1) {
+        switch (opt) {
+            case 'r': rotation = atoi(optarg); break;
+            case 'n': runs = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'h': height = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-r rotation] [-n runs] [-w width -h height] file.jpg ...\n", argv[0]);
+                return 2;
+        }
+    }
+    uint8_t *serial = malloc(width / 2 * height);
+    uint8_t *parallel = malloc(width / 2 * height);
+    printf("%-32s %10s %10s %8s\n", "image", "serial ms", "2 workers", "speedup");
+    for (int i = optind; i < argc; i++) {
+        double t1 = decode(argv[i], serial, width, height, rotation, 0, runs);
+        double t2 = decode(argv[i], parallel, width, height, rotation, JPEG_PARALLEL_DECODE, runs);
+        if (t1 == 0 || t2 == 0) {
+            failed++;
+            continue;
+        }
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        int same = memcmp(serial, parallel, width / 2 * height) == 0;
+        printf("%-32.32s %10.2f %10.2f %7.2fx%s\n", name, t1, t2, t1 / t2, same ? "" : "  OUTPUT DIFFERS");
+        failed += !same;
+    }
+    free(serial);
+    free(parallel);
+    return failed != 0;
+}
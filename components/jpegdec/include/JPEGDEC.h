@@ -18,6 +18,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
 
 #ifndef PROGMEM
 #define memcpy_P memcpy
@@ -29,7 +32,8 @@
 // Copyright (c) 2020 BitBank Software, Inc.
 // 
 // Designed to decode baseline JPEG images (8 or 24-bpp)
-// using less than 22K of RAM
+// using less than 22K of RAM; progressive images decode to FOUR_BIT_EPD
+// only, with their luma coefficients in a separate (PSRAM) buffer
 
 
 /* Defines and variables */
@@ -44,13 +48,28 @@
 #define MAX_BUFFERED_PIXELS 2048
 
 // Decoder options
-#define JPEG_AUTO_ROTATE 1
+#define JPEG_AUTO_ROTATE 1 // FOUR_BIT_EPD only, apply the EXIF orientation
 #define JPEG_SCALE_HALF 2
 #define JPEG_SCALE_QUARTER 4
 #define JPEG_SCALE_EIGHTH 8
 #define JPEG_LE_PIXELS 16
 #define JPEG_EXIF_THUMBNAIL 32
 #define JPEG_LUMA_ONLY 64
+#define JPEG_PARALLEL_DECODE 128 // FOUR_BIT_EPD only, split at a restart marker
+
+// Frame types returned by getJPEGType()
+#define JPEG_MODE_BASELINE 0xc0
+#define JPEG_MODE_PROGRESSIVE 0xc2
+
+// Two workers for JPEG_PARALLEL_DECODE, one per core on dual core ESP32s;
+// host builds opt in with -DJPEG_PARALLEL and pthreads
+#if !defined(JPEG_PARALLEL) && defined(ESP_PLATFORM) && !defined(CONFIG_FREERTOS_UNICORE)
+#define JPEG_PARALLEL
+#endif
+
+// Build with -DJPEG_HUFF_PAIRS to decode up to two short AC coefficients per
+// table lookup from a 64-bit bit buffer; costs 4K per AC table
+#define HUFF_PAIR_BITS 10
 
 #define MCU0 (DCTSIZE * 0)
 #define MCU1 (DCTSIZE * 1)
@@ -67,6 +86,7 @@ enum {
     FOUR_BIT_DITHERED,
     TWO_BIT_DITHERED,
     ONE_BIT_DITHERED,
+    FOUR_BIT_EPD, // epdiy framebuffer, even x in the low nibble
     INVALID_PIXEL_TYPE
 };
 
@@ -81,7 +101,8 @@ enum {
     JPEG_INVALID_PARAMETER,
     JPEG_DECODE_ERROR,
     JPEG_UNSUPPORTED_FEATURE,
-    JPEG_INVALID_FILE
+    JPEG_INVALID_FILE,
+    JPEG_ERROR_MEMORY
 };
 
 typedef struct buffered_bits
@@ -181,12 +202,25 @@ typedef struct jpeg_image_tag
     JPEGFILE JPEGFile;
     BUFFERED_BITS bb;
     uint8_t *pDitherBuffer; // provided externally to do Floyd-Steinberg dithering
+    uint8_t *pFramebuffer; // FOUR_BIT_EPD destination, (iFBWidth/2) bytes per line
+    const uint8_t *pGamma; // optional 256 entry gray curve for FOUR_BIT_EPD
+    int iFBWidth, iFBHeight, iFBRotation; // unrotated panel size, EpdRotation
+    int iClipLeft, iClipTop, iClipRight, iClipBottom; // visible source area, offset by iXOffset/iYOffset
+    int iPanelX, iPanelY; // panel position of source pixel 0,0
+    int iRowDX, iRowDY, iColDX, iColDY; // panel steps along a source row and down a column
+    int iDeferRow; // row (source + iYOffset) kept in usPixels until the other worker is done, JPEG_NO_ROW for none
+    int iVLCStart; // file offset of the entropy coded data
+    int iRowStart, iRowEnd; // MCU rows to decode, 0 and 0 for all of them
+    void *pFileLock; // held around seek + read while workers share the file
     uint16_t usPixels[MAX_BUFFERED_PIXELS];
     int16_t sMCUs[DCTSIZE * MAX_MCU_COUNT]; // 4:2:0 needs 6 DCT blocks per MCU
     int16_t sQuantTable[DCTSIZE*4]; // quantization tables
     uint8_t ucFileBuf[JPEG_FILE_BUF_SIZE]; // holds temp data and pixel stack
     uint8_t ucHuffDC[DC_TABLE_SIZE * 2]; // up to 2 'short' tables
     uint16_t usHuffAC[HUFF11SIZE * 2];
+#ifdef JPEG_HUFF_PAIRS
+    uint32_t ulHuffPairs[(1 << HUFF_PAIR_BITS) * 2]; // len1, len2, run1, run2, value1, value2 per 10-bit code
+#endif
 } JPEGIMAGE;
 
 #ifdef __cplusplus
@@ -209,7 +243,11 @@ class JPEGDEC
     void close();
     int decode(int x, int y, int iOptions);
     int decodeDither(uint8_t *pDither, int iOptions);
+    int decodeEPD(uint8_t *pFramebuffer, int iFBWidth, int iFBHeight, int iRotation, const uint8_t *pGamma, int x, int y, int iOptions);
     int getOrientation();
+    int getJPEGType();
+    int getProgressiveSize(int iOptions);
+    int getSaliency(uint8_t *pMap);
     int getWidth();
     int getHeight();
     int getBpp();
@@ -232,9 +270,13 @@ int JPEG_getWidth(JPEGIMAGE *pJPEG);
 int JPEG_getHeight(JPEGIMAGE *pJPEG);
 int JPEG_decode(JPEGIMAGE *pJPEG, int x, int y, int iOptions);
 int JPEG_decodeDither(JPEGIMAGE *pJPEG, uint8_t *pDither, int iOptions);
+int JPEG_decodeEPD(JPEGIMAGE *pJPEG, uint8_t *pFramebuffer, int iFBWidth, int iFBHeight, int iRotation, const uint8_t *pGamma, int x, int y, int iOptions);
 void JPEG_close(JPEGIMAGE *pJPEG);
 int JPEG_getLastError(JPEGIMAGE *pJPEG);
 int JPEG_getOrientation(JPEGIMAGE *pJPEG);
+int JPEG_getJPEGType(JPEGIMAGE *pJPEG);
+int JPEG_getProgressiveSize(JPEGIMAGE *pJPEG, int iOptions);
+int JPEG_getSaliency(JPEGIMAGE *pJPEG, uint8_t *pMap);
 int JPEG_getBpp(JPEGIMAGE *pJPEG);
 int JPEG_getSubSample(JPEGIMAGE *pJPEG);
 int JPEG_hasThumb(JPEGIMAGE *pJPEG);
@@ -250,6 +292,7 @@ void JPEG_setMaxOutputSize(JPEGIMAGE *pJPEG, int iMaxMCUs);
 #define INTELLONG(p) ((*p) + (*(p+1)<<8) + (*(p+2)<<16) + (*(p+3)<<24))
 #define MOTOSHORT(p) (((*(p))<<8) + (*(p+1)))
 #define MOTOLONG(p) (((*p)<<24) + ((*(p+1))<<16) + ((*(p+2))<<8) + (*(p+3)))
+#define MOTOLONGLONG(p) (((uint64_t)(uint32_t)MOTOLONG(p) << 32) | (uint32_t)MOTOLONG(((p)+4)))
 
 // Must be a 32-bit target processor
 #define REGISTER_WIDTH 32
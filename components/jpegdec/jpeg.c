@@ -26,6 +26,25 @@
 #if defined(ARM_MATH_CM4) || defined(ARM_MATH_CM7)
 #define HAS_SIMD
 #endif
+// bodies expanded once per constant argument, see DecodeJPEG()
+#ifdef __GNUC__
+#define JPEG_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define JPEG_ALWAYS_INLINE inline
+#endif
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
+#ifdef JPEG_PARALLEL
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#else
+#include <pthread.h>
+#endif
+#endif
 
 // forward references
 static int JPEGInit(JPEGIMAGE *pJPEG);
@@ -38,6 +57,18 @@ static int32_t readFile(JPEGFILE *pFile, uint8_t *pBuf, int32_t iLen);
 static int32_t seekFile(JPEGFILE *pFile, int32_t iPosition);
 static void closeFile(void *handle);
 static void JPEGDither(JPEGIMAGE *pJPEG, int iWidth, int iHeight);
+static int JPEGSetEPD(JPEGIMAGE *pJPEG, uint8_t *pFramebuffer, int iFBWidth, int iFBHeight, int iRotation, const uint8_t *pGamma);
+typedef struct jpeg_coeffs_tag JPEGCOEFFS;
+static int JPEGCoeffLayout(JPEGIMAGE *pJPEG, int iOptions, JPEGCOEFFS *pCoeffs);
+static int JPEGDecodeProgressive(JPEGIMAGE *pJPEG);
+static int JPEGSaliency(JPEGIMAGE *pJPEG, uint8_t *pMap);
+// iDeferRow when there is none; rows are negative when the image is placed at a negative offset
+#define JPEG_NO_ROW (-0x7fffffff - 1)
+#ifdef JPEG_PARALLEL
+static void JPEGLock(void *pLock);
+static void JPEGUnlock(void *pLock);
+static int JPEGDecodeParallel(JPEGIMAGE *pJPEG);
+#endif
 /* JPEG tables */
 // zigzag ordering of DCT coefficients
 static const unsigned char cZigZag[64] = {0,1,5,6,14,15,27,28,
@@ -475,7 +506,7 @@ static const uint16_t usRangeTableB[] = {0x0000,0x0000,0x0000,0x0000,0x0000,0x00
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-#if defined (__MACH__) || defined( __LINUX__ ) || defined( __MCUXPRESSO )
+#if defined (__MACH__) || defined( __LINUX__ ) || defined( __MCUXPRESSO ) || (defined( ESP_PLATFORM ) && !defined( __cplusplus ))
 //
 // API for C
 //
@@ -539,6 +570,19 @@ int JPEG_getOrientation(JPEGIMAGE *pJPEG)
     return (int)pJPEG->ucOrientation;
 } /* JPEG_getOrientation() */
 
+int JPEG_getJPEGType(JPEGIMAGE *pJPEG)
+{
+    return (pJPEG->ucMode == 0xc2) ? JPEG_MODE_PROGRESSIVE : JPEG_MODE_BASELINE;
+} /* JPEG_getJPEGType() */
+//
+// Bytes of coefficient buffer a progressive image needs with these
+// (scale) options, 0 for baseline images
+//
+int JPEG_getProgressiveSize(JPEGIMAGE *pJPEG, int iOptions)
+{
+    return JPEGCoeffLayout(pJPEG, iOptions, NULL);
+} /* JPEG_getProgressiveSize() */
+
 int JPEG_getBpp(JPEGIMAGE *pJPEG)
 {
     return (int)pJPEG->ucBpp;
@@ -584,6 +628,42 @@ int JPEG_decodeDither(JPEGIMAGE *pJPEG, uint8_t *pDither, int iOptions)
     pJPEG->pDitherBuffer = pDither;
     return DecodeJPEG(pJPEG);
 } /* JPEG_decodeDither() */
+//
+// Decode straight into a 4bpp epdiy framebuffer
+// x, y place the image in display (rotated) coordinates; negative values
+// crop it, and only MCUs in the visible source rectangle get the IDCT.
+// JPEG_AUTO_ROTATE turns the image upright by its EXIF orientation
+//
+int JPEG_decodeEPD(JPEGIMAGE *pJPEG, uint8_t *pFramebuffer, int iFBWidth, int iFBHeight, int iRotation, const uint8_t *pGamma, int x, int y, int iOptions)
+{
+    if (!JPEGSetEPD(pJPEG, pFramebuffer, iFBWidth, iFBHeight, iRotation, pGamma))
+        return 0;
+    if (pJPEG->ucSubSample != 0 && pJPEG->ucSubSample != 0x11 && pJPEG->ucSubSample != 0x12 &&
+        pJPEG->ucSubSample != 0x21 && pJPEG->ucSubSample != 0x22) // leave it to another decoder
+    {
+        pJPEG->iError = JPEG_UNSUPPORTED_FEATURE;
+        return 0;
+    }
+    pJPEG->iXOffset = x;
+    pJPEG->iYOffset = y;
+    pJPEG->iOptions = iOptions;
+    if (pJPEG->ucMode == 0xc2 && !(iOptions & JPEG_EXIF_THUMBNAIL))
+        return JPEGDecodeProgressive(pJPEG);
+#ifdef JPEG_PARALLEL
+    if (iOptions & JPEG_PARALLEL_DECODE)
+        return JPEGDecodeParallel(pJPEG);
+#endif
+    return DecodeJPEG(pJPEG);
+} /* JPEG_decodeEPD() */
+//
+// Score the 8x8 luma blocks for choosing a crop, without any IDCT: one byte
+// each, ((width+7)/8) x ((height+7)/8) in the stored orientation. Open the
+// image again before decoding it
+//
+int JPEG_getSaliency(JPEGIMAGE *pJPEG, uint8_t *pMap)
+{
+    return JPEGSaliency(pJPEG, pMap);
+} /* JPEG_getSaliency() */
 
 void JPEG_close(JPEGIMAGE *pJPEG)
 {
@@ -631,7 +711,7 @@ static int32_t seekMem(JPEGFILE *pFile, int32_t iPosition)
     return iPosition;
 } /* seekMem() */
 
-#if defined (__MACH__) || defined( __LINUX__ ) || defined( __MCUXPRESSO )
+#if defined (__MACH__) || defined( __LINUX__ ) || defined( __MCUXPRESSO ) || (defined( ESP_PLATFORM ) && !defined( __cplusplus ))
 
 static void closeFile(void *handle)
 {
@@ -690,28 +770,27 @@ static int JPEGGetHuffTables(uint8_t *pBuf, int iLen, JPEGIMAGE *pJPEG)
         ucTable = pBuf[iOffset++]; // get table index
         if (ucTable & 0x10) // convert AC offset of 0x10 into offset of 4
             ucTable ^= 0x14;
+        if (ucTable > 7 || (ucTable & 3) > 1) // bogus, or one of the 2 of each kind we don't keep
+            return -1;
         pJPEG->ucHuffTableUsed |= (1 << ucTable); // mark this table as being defined
-        if (ucTable <= 7) // tables are 0-3, AC+DC
+        iTableOffset = ucTable * HUFF_TABLEN;
+        j = 0; // total bits
+        for (i=0; i<16; i++)
         {
-            iTableOffset = ucTable * HUFF_TABLEN;
-            j = 0; // total bits
-            for (i=0; i<16; i++)
-            {
-                j += pBuf[iOffset];
-                pHuffVals[iTableOffset+i] = pBuf[iOffset++];
-            }
-            iLen -= 17; // subtract length of bit lengths
-            if (j == 0 || j > 256 || j > iLen) // bogus bit lengths
-            {
-                return -1;
-            }
-            iTableOffset += 16;
-            for (i=0; i<j; i++)
-            {  // copy huffman table
-                pHuffVals[iTableOffset+i] = pBuf[iOffset++];
-            }
-            iLen -= j;
+            j += pBuf[iOffset];
+            pHuffVals[iTableOffset+i] = pBuf[iOffset++];
+        }
+        iLen -= 17; // subtract length of bit lengths
+        if (j == 0 || j > 256 || j > iLen) // bogus bit lengths
+        {
+            return -1;
         }
+        iTableOffset += 16;
+        for (i=0; i<j; i++)
+        {  // copy huffman table
+            pHuffVals[iTableOffset+i] = pBuf[iOffset++];
+        }
+        iLen -= j;
     }
     return 0;
 } /* JPEGGetHuffTables() */
@@ -767,7 +846,7 @@ static int JPEGMakeHuffTables_Slow(JPEGIMAGE *pJPEG, int bThumbnail)
                 while (iLen)
                 {
                     //               if (iBitNum > 6) // do long table
-                    if ((cc >> (iBitNum-5)) == 0x1f) // first 5 bits are 1 - use long table
+                    if (iBitNum >= 5 && (cc >> (iBitNum-5)) == 0x1f) // first 5 bits are 1 - use long table
                     {
                         count = iMaxLength - iBitNum;
                         codestart = cc << count;
@@ -855,7 +934,7 @@ static int JPEGMakeHuffTables_Slow(JPEGIMAGE *pJPEG, int bThumbnail)
                 iLen = *pBits++; // get number of codes for this bit length
                 while (iLen)
                 {
-                    if ((cc >> (iBitNum-4)) == 0xf) // first 4 bits are 1 - use long table
+                    if (iBitNum >= 4 && (cc >> (iBitNum-4)) == 0xf) // first 4 bits are 1 - use long table
                     {
                         count = 16 - iBitNum;
                         codestart = cc << count;
@@ -903,6 +982,62 @@ static int JPEGMakeHuffTables_Slow(JPEGIMAGE *pJPEG, int bThumbnail)
     return 0;
 } /* JPEGMakeHuffTables_Slow() */
 #endif // FUTURE
+#ifdef JPEG_HUFF_PAIRS
+//
+// Decode one AC symbol from the first iBits bits of a HUFF_PAIR_BITS code
+// returns the bits used by the code and its extra bits, 0 if it doesn't fit
+//
+static int JPEGPairSymbol(uint16_t *pShort, int iCode, int iBits, int *pRun, int *pValue)
+{
+    uint16_t usHuff;
+    int iLen, iSize, iValue;
+
+    if ((iCode >> (HUFF_PAIR_BITS - 6)) == 0x3f) // first 6 bits = 1, long table
+        return 0;
+    usHuff = pShort[iCode];
+    iLen = usHuff >> 8;
+    iSize = usHuff & 0xf;
+    if (usHuff == 0 || iSize > 7 || iLen + iSize > iBits) // value must fit a signed char
+        return 0;
+    iValue = (iCode >> (HUFF_PAIR_BITS - iLen - iSize)) & ((1 << iSize) - 1);
+    if (iSize && iValue < (1 << (iSize - 1))) // negative
+        iValue -= (1 << iSize) - 1;
+    *pRun = (usHuff >> 4) & 0xf;
+    *pValue = iValue;
+    return iLen + iSize;
+} /* JPEGPairSymbol() */
+//
+// Build the two symbol AC tables from the 10-bit ones
+// Each entry holds up to two symbols with their extra bits which fit in the
+// next HUFF_PAIR_BITS bits; a length of 0 means use the regular table.
+// EOB has run 0 and value 0, ZRL run 15 and value 0
+//
+static void JPEGMakePairTables(JPEGIMAGE *pJPEG)
+{
+    int iTable, iCode, iLen1, iLen2, iRun1, iRun2, iValue1, iValue2;
+    uint16_t *pShort;
+    uint32_t *pPairs;
+
+    for (iTable = 0; iTable < 2; iTable++)
+    {
+        if (!(pJPEG->ucHuffTableUsed & (1 << (iTable+4))))
+            continue;
+        pShort = &pJPEG->usHuffAC[iTable*HUFF11SIZE];
+        pPairs = &pJPEG->ulHuffPairs[iTable << HUFF_PAIR_BITS];
+        for (iCode = 0; iCode < (1 << HUFF_PAIR_BITS); iCode++)
+        {
+            iRun1 = iValue1 = iRun2 = iValue2 = iLen2 = 0;
+            iLen1 = JPEGPairSymbol(pShort, iCode, HUFF_PAIR_BITS, &iRun1, &iValue1);
+            if (iLen1 && (iRun1 | iValue1)) // not EOB, look for a second symbol
+                iLen2 = JPEGPairSymbol(pShort, (iCode << iLen1) & ((1 << HUFF_PAIR_BITS) - 1), HUFF_PAIR_BITS - iLen1, &iRun2, &iValue2);
+            if (iLen2 == 0)
+                iRun2 = iValue2 = 0;
+            pPairs[iCode] = iLen1 | (iLen2 << 4) | (iRun1 << 8) | (iRun2 << 12) |
+                            ((uint32_t)(uint8_t)iValue1 << 16) | ((uint32_t)(uint8_t)iValue2 << 24);
+        }
+    }
+} /* JPEGMakePairTables() */
+#endif // JPEG_HUFF_PAIRS
 //
 // Expand the Huffman tables for fast decoding
 // returns 1 for success, 0 for failure
@@ -956,7 +1091,7 @@ static int JPEGMakeHuffTables(JPEGIMAGE *pJPEG, int bThumbnail)
                 while (iLen)
                 {
                     //               if (iBitNum > 6) // do long table
-                    if ((cc >> (iBitNum-5)) == 0x1f) // first 5 bits are 1 - use long table
+                    if (iBitNum >= 5 && (cc >> (iBitNum-5)) == 0x1f) // first 5 bits are 1 - use long table
                     {
                         count = iMaxLength - iBitNum;
                         codestart = cc << count;
@@ -1038,7 +1173,7 @@ static int JPEGMakeHuffTables(JPEGIMAGE *pJPEG, int bThumbnail)
                 iLen = *pBits++; // get number of codes for this bit length
                 while (iLen)
                 {
-                    if ((cc >> (iBitNum-6)) == 0x3f) // first 6 bits are 1 - use long table
+                    if (iBitNum >= 6 && (cc >> (iBitNum-6)) == 0x3f) // first 6 bits are 1 - use long table
                     {
                         count = 16 - iBitNum;
                         codestart = cc << count;
@@ -1112,6 +1247,10 @@ static int JPEGMakeHuffTables(JPEGIMAGE *pJPEG, int bThumbnail)
             } // for each bit length
         } // if table defined
     }
+#ifdef JPEG_HUFF_PAIRS
+    if (!bThumbnail)
+        JPEGMakePairTables(pJPEG);
+#endif
     return 1;
 } /* JPEGMakeHuffTables() */
 
@@ -1184,7 +1323,7 @@ static int TIFFVALUE(unsigned char *p, int bMotorola)
     return i;
     
 } /* TIFFVALUE() */
-static void GetTIFFInfo(JPEGIMAGE *pPage, int bMotorola, int iOffset)
+static void GetTIFFInfo(JPEGIMAGE *pPage, int bMotorola, int iOffset, int iSize)
 {
     int iTag, iTagCount, i;
     uint8_t *cBuf = pPage->ucFileBuf;
@@ -1192,6 +1331,8 @@ static void GetTIFFInfo(JPEGIMAGE *pPage, int bMotorola, int iOffset)
     iTagCount = TIFFSHORT(&cBuf[iOffset], bMotorola);  /* Number of tags in this dir */
     if (iTagCount < 1 || iTagCount > 256) // invalid tag count
         return; /* Bad header info */
+    if (iOffset + 2 + iTagCount*12 > iSize) // the tags we have in the buffer
+        iTagCount = (iSize - iOffset - 2) / 12;
     /*--- Search the TIFF tags ---*/
     for (i=0; i<iTagCount; i++)
     {
@@ -1248,8 +1389,8 @@ static int JPEGGetSOS(JPEGIMAGE *pJPEG, int *iOff)
         }
         if (j == 4) // error, not found
             return 1;
-        if ((c & 0xf) > 3 || (c & 0xf0) > 0x30)
-            return 1; // bogus table numbers
+        if ((c & 0xf) > 1 || (c & 0xf0) > 0x10)
+            return 1; // bogus table numbers, or one of the 2 of each kind we don't keep
         pJPEG->JPCI[j].dc_tbl_no = c >> 4;
         pJPEG->JPCI[j].ac_tbl_no = c & 0xf;
         pJPEG->JPCI[j].component_needed = 1; // mark this component as being included in the scan
@@ -1318,7 +1459,7 @@ static void JPEGGetMoreData(JPEGIMAGE *pPage)
         return; // buffer is already full; no need to read more data
     if (pPage->iVLCOff != 0)
     {
-        memcpy(pPage->ucFileBuf, &pPage->ucFileBuf[pPage->iVLCOff], pPage->iVLCSize - pPage->iVLCOff);
+        memmove(pPage->ucFileBuf, &pPage->ucFileBuf[pPage->iVLCOff], pPage->iVLCSize - pPage->iVLCOff); // can overlap
         pPage->iVLCSize -= pPage->iVLCOff;
         pPage->iVLCOff = 0;
         pPage->bb.pBuf = pPage->ucFileBuf; // reset VLC source pointer too
@@ -1327,6 +1468,16 @@ static void JPEGGetMoreData(JPEGIMAGE *pPage)
     {
         int i;
         // Try to read enough to fill the buffer
+#ifdef JPEG_PARALLEL
+        if (pPage->pFileLock) // workers share the file, go back to our own position
+        {
+            JPEGLock(pPage->pFileLock);
+            (*pPage->pfnSeek)(&pPage->JPEGFile, pPage->JPEGFile.iPos);
+            i = (*pPage->pfnRead)(&pPage->JPEGFile, &pPage->ucFileBuf[pPage->iVLCSize], JPEG_FILE_BUF_SIZE - pPage->iVLCSize);
+            JPEGUnlock(pPage->pFileLock);
+        }
+        else
+#endif
         i = (*pPage->pfnRead)(&pPage->JPEGFile, &pPage->ucFileBuf[pPage->iVLCSize], JPEG_FILE_BUF_SIZE - pPage->iVLCSize); // max length we can read
         // Filter out the markers
         pPage->iVLCSize += JPEGFilter(&pPage->ucFileBuf[pPage->iVLCSize], &pPage->ucFileBuf[pPage->iVLCSize], i, &pPage->ucFF);
@@ -1365,12 +1516,12 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
     }
     iOffset = 2; /* Start at offset of first marker */
     usMarker = 0; /* Search for SOFx (start of frame) marker */
-    while (usMarker != 0xffda && iOffset < pPage->JPEGFile.iSize)
+    while (usMarker != 0xffda && iFilePos - iBytesRead + iOffset < pPage->JPEGFile.iSize)
     {
         if (iOffset >= JPEG_FILE_BUF_SIZE/2) // too close to the end, read more data
         {
             // Do we need to seek first?
-            if (iOffset >= JPEG_FILE_BUF_SIZE)
+            if (iOffset >= iBytesRead)
             {
                 iFilePos += (iOffset - iBytesRead);
                 iOffset = 0;
@@ -1397,10 +1548,16 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
             iOffset++;
             continue; // skip 1 byte and try to resync
         }
+        if ((usMarker <= 0xffc4 || usMarker == 0xffda || usMarker == 0xffdb || usMarker == 0xffdd) &&
+            (usLen < 2 || iOffset + usLen > iBytesRead)) // the segments we parse have to be in the buffer
+        {
+            pPage->iError = JPEG_DECODE_ERROR;
+            printf("Invalid marker length\n");
+            return 0;
+        }
         switch (usMarker)
         {
             case 0xffc1:
-            case 0xffc2:
             case 0xffc3:
                 printf("currently unsupported modes: %x\n", usMarker);
                 pPage->iError = JPEG_UNSUPPORTED_FEATURE;
@@ -1410,28 +1567,36 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
                 if (s[iOffset+2] == 'E' && s[iOffset+3] == 'x' && (s[iOffset+8] == 'M' || s[iOffset+8] == 'I')) // the EXIF data we want
                 {
                     int bMotorola, IFD, iTagCount;
+                    int iTIFFSize = iBytesRead - iOffset - 8; // the part of it in the buffer
                     pPage->iEXIF = iFilePos - iBytesRead + iOffset + 8; // start of TIFF file
                     // Get the orientation value (if present)
                     bMotorola = (s[iOffset+8] == 'M');
                     IFD = TIFFLONG(&s[iOffset+12], bMotorola);
-                    iTagCount = TIFFSHORT(&s[iOffset+16], bMotorola);
-                    GetTIFFInfo(pPage, bMotorola, IFD+iOffset+8);
+                    if (IFD < 8 || IFD > iTIFFSize - 2) // IFD offsets are file data, out of reach or negative as int
+                        break;
+                    iTagCount = TIFFSHORT(&s[IFD+iOffset+8], bMotorola);
+                    GetTIFFInfo(pPage, bMotorola, IFD+iOffset+8, iBytesRead);
                     // The second IFD defines the thumbnail (if present)
-                    if (iTagCount >= 1 && iTagCount < 32) // valid number of tags for EXIF data 'page'
+                    if (iTagCount >= 1 && iTagCount < 32 && IFD + (12 * iTagCount) + 6 <= iTIFFSize) // valid number of tags for EXIF data 'page'
                     {
                        // point to next IFD
                         IFD += (12 * iTagCount) + 2;
                         IFD = TIFFLONG(&s[IFD + iOffset + 8], bMotorola);
-                        if (IFD != 0) // Thumbnail present?
+                        if (IFD >= 8 && IFD <= iTIFFSize - 2) // Thumbnail present?
                         {
-                            pPage->ucHasThumb = 1;
-                            GetTIFFInfo(pPage, bMotorola, IFD+iOffset+8); // info for second 'page' of TIFF
-                            pPage->iThumbData += iOffset + 8; // absolute offset in the file
+                            pPage->iThumbData = 0;
+                            GetTIFFInfo(pPage, bMotorola, IFD+iOffset+8, iBytesRead); // info for second 'page' of TIFF
+                            if (pPage->iThumbData != 0) // JPEG compressed, the size tags are often missing
+                            {
+                                pPage->ucHasThumb = 1;
+                                pPage->iThumbData += pPage->iEXIF; // absolute offset in the file
+                            }
                         }
                     }
                 }
                 break;
             case 0xffc0: // SOFx - start of frame
+            case 0xffc2: // progressive, see JPEGDecodeProgressive()
                 pPage->ucMode = (uint8_t)usMarker;
                 pPage->ucBpp = s[iOffset+2]; // bits per sample
                 pPage->iHeight = MOTOSHORT(&s[iOffset+3]);
@@ -1439,9 +1604,24 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
                 pPage->ucNumComponents = s[iOffset+7];
                 pPage->ucBpp = pPage->ucBpp * pPage->ucNumComponents; /* Bpp = number of components * bits per sample */
                 if (pPage->ucNumComponents == 1)
+                {
                     pPage->ucSubSample = 0; // use this to differentiate from color 1:1
+                    pPage->JPCI[0].component_id = s[iOffset+8]; // progressive scans name it
+                }
                 else
                 {
+                    if (pPage->ucNumComponents > MAX_COMPS_IN_SCAN) // JPCI holds 4
+                    {
+                        pPage->iError = JPEG_DECODE_ERROR;
+                        printf("Too many color components\n");
+                        return 0;
+                    }
+                    if (usLen < 8 + pPage->ucNumComponents*3)
+                    {
+                        pPage->iError = JPEG_DECODE_ERROR;
+                        printf("Invalid frame header\n");
+                        return 0;
+                    }
                     usLen -= 8;
                     iOffset += 8;
 //                    pPage->ucSubSample = s[iOffset+9]; // subsampling option for the second color component
@@ -1456,6 +1636,12 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
 //                        pPage->JPCI[i].h_samp_factor = ucSamp >> 4;
 //                        pPage->JPCI[i].v_samp_factor = ucSamp & 0xf;
                         pPage->JPCI[i].quant_tbl_no = s[iOffset++]; // quantization table number
+                        if (pPage->JPCI[i].quant_tbl_no > 3) // sQuantTable has 4, indexed by this in every decode path
+                        {
+                            pPage->iError = JPEG_DECODE_ERROR;
+                            printf("Invalid quantization table number\n");
+                            return 0;
+                        }
                         usLen -= 3;
                     }
                 }
@@ -1488,6 +1674,12 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
                         printf("Invalid quantization table number\n");
                         return 0;
                     }
+                    if (usLen < ((ucTable & 0xf0) ? DCTSIZE*2 + 1 : DCTSIZE + 1)) // table runs past the segment
+                    {
+                        pPage->iError = JPEG_DECODE_ERROR;
+                        printf("Invalid quantization table length\n");
+                        return 0;
+                    }
                     iTableOffset = (ucTable & 0xf) * DCTSIZE;
                     if (ucTable & 0xf0) // if word precision
                     {
@@ -1516,7 +1708,12 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
         if (pPage->ucBpp != 8) // need to match up table IDs
         {
             iOffset -= usLen;
-            JPEGGetSOS(pPage, &iOffset); // get Start-Of-Scan info for decoding
+            if (JPEGGetSOS(pPage, &iOffset)) // get Start-Of-Scan info for decoding
+            {
+                pPage->iError = JPEG_DECODE_ERROR;
+                printf("Invalid scan header\n");
+                return 0;
+            }
         }
         if (!JPEGMakeHuffTables(pPage, 0)) //int bThumbnail) DEBUG
         {
@@ -1525,6 +1722,7 @@ static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb)
             return 0;
         }
         // Now the offset points to the start of compressed data
+        pPage->iVLCStart = iFilePos - iBytesRead + iOffset;
         i = JPEGFilter(&pPage->ucFileBuf[iOffset], pPage->ucFileBuf, iBytesRead-iOffset, &pPage->ucFF);
         pPage->iVLCOff = 0;
         pPage->iVLCSize = i;
@@ -1693,6 +1891,95 @@ static int JPEGDecodeMCU(JPEGIMAGE *pJPEG, int iMCU, int *iDCPredictor)
             pZig++;
         } // while
     }
+#ifdef JPEG_HUFF_PAIRS
+    else // 10-bit tables, up to two coefficients per lookup
+    {
+        uint32_t ulPair, *pPairs = &pJPEG->ulHuffPairs[pJPEG->ucACTable << HUFF_PAIR_BITS];
+        uint64_t ullBits;
+
+        // 64-bit window, refilled once it has less than 26 bits
+        // (the longest code and extra bits) left
+        pBuf += (ulBitOff >> 3);
+        ulBitOff &= 7;
+        ullBits = MOTOLONGLONG(pBuf);
+        while (pZig < pEnd)
+        {
+            if (ulBitOff > 64 - 26) // need to get more data
+            {
+                pBuf += (ulBitOff >> 3);
+                ulBitOff &= 7;
+                ullBits = MOTOLONGLONG(pBuf);
+            }
+            ulPair = pPairs[(uint32_t)(ullBits >> (64 - HUFF_PAIR_BITS - ulBitOff)) & ((1 << HUFF_PAIR_BITS) - 1)];
+            if (ulPair & 0xf) // first symbol fits the pair table
+            {
+                ulBitOff += (ulPair & 0xf);
+                if ((ulPair & 0xff0f00) == 0) // EOB
+                    break;
+                pZig += ((ulPair >> 8) & 0xf); // skip amount (RRRR)
+                cCoeff = (signed char)(ulPair >> 16);
+                if (pZig < pEnd2 && cCoeff)
+                {
+                    ucMaxACCol |= 1<<(*pZig & 7);
+                    if (*pZig >= 0x20)
+                        ucMaxACRow |= 1<<(*pZig & 7);
+                    pMCU[*pZig] = cCoeff;
+                }
+                pZig++;
+                if ((ulPair & 0xf0) && pZig < pEnd) // second symbol
+                {
+                    ulBitOff += ((ulPair >> 4) & 0xf);
+                    if ((ulPair & 0xff00f000) == 0) // EOB
+                        break;
+                    pZig += ((ulPair >> 12) & 0xf);
+                    cCoeff = (signed char)(ulPair >> 24);
+                    if (pZig < pEnd2 && cCoeff)
+                    {
+                        ucMaxACCol |= 1<<(*pZig & 7);
+                        if (*pZig >= 0x20)
+                            ucMaxACRow |= 1<<(*pZig & 7);
+                        pMCU[*pZig] = cCoeff;
+                    }
+                    pZig++;
+                }
+                continue;
+            }
+            // long code or large value, one symbol from the regular table
+            ulCode = (uint32_t)(ullBits >> (64 - 16 - ulBitOff)) & 0xffff;
+            if (ulCode >= 0xfc00) // first 6 bits = 1, use long table
+                ulCode = (ulCode & 0x7ff);
+            else
+                ulCode >>= 6;
+            usHuff = pFast[ulCode];
+            if (usHuff == 0) // invalid code
+                return -1;
+            ulBitOff += (usHuff >> 8); // add length
+            usHuff &= 0xff; // get code (RRRR/SSSS)
+            if (usHuff == 0) // no more AC components
+                break;
+            pZig += (usHuff >> 4);  // get the skip amount (RRRR)
+            usHuff &= 0xf; // get (SSSS) - extra length
+            if (usHuff > 10) // not baseline, and more than the 26 bits left in the window after a long code
+                return -1;
+            if (pZig < pEnd2 && usHuff)
+            {
+                ulCode = (uint32_t)(ullBits >> (64 - usHuff - ulBitOff)) & ((1 << usHuff) - 1);
+                if (ulCode < (1U << (usHuff - 1))) // negative
+                    ulCode -= (1 << usHuff) - 1;
+                ucMaxACCol |= 1<<(*pZig & 7);
+                if (*pZig >= 0x20)
+                    ucMaxACRow |= 1<<(*pZig & 7);
+                pMCU[*pZig] = (signed short)ulCode;
+            }
+            ulBitOff += usHuff; // add (SSSS) extra length
+            pZig++;
+        } // while
+        // back to the 32-bit window the rest of the decoder uses
+        pBuf += (ulBitOff >> 3);
+        ulBitOff &= 7;
+        ulBits = MOTOLONG(pBuf);
+    } // pair tables
+#else
     else // 10-bit "fast" tables used
     {
         while (pZig < pEnd)
@@ -1740,6 +2027,7 @@ static int JPEGDecodeMCU(JPEGIMAGE *pJPEG, int iMCU, int *iDCPredictor)
             pZig++;
         } // while
     } // 10-bit tables
+#endif // JPEG_HUFF_PAIRS
 mcu_done:
     pJPEG->bb.pBuf = pBuf;
     pJPEG->iVLCOff = (int)(pBuf - pJPEG->ucFileBuf);
@@ -1772,28 +2060,6 @@ static void JPEGIDCT(JPEGIMAGE *pJPEG, int iMCUOffset, int iQuantTable, int iACF
     // but the patent is invalidated by prior art:
     // http://netilium.org/~mad/dtj/DTJ/DTJK04/
     pQuant = &pJPEG->sQuantTable[iQuantTable * DCTSIZE];
-    if (pJPEG->iOptions & JPEG_SCALE_QUARTER) // special case
-    {
-        /* Column 0 */
-        tmp4 = pMCUSrc[0] * pQuant[0];
-        tmp5 = pMCUSrc[8] * pQuant[8];
-        tmp0 = tmp4 + tmp5;
-        tmp2 = tmp4 - tmp5;
-        /* Column 1 */
-        tmp4 = pMCUSrc[1] * pQuant[1];
-        tmp5 = pMCUSrc[9] * pQuant[9];
-        tmp1 = tmp4 + tmp5;
-        tmp3 = tmp4 - tmp5;
-        /* Pass 2: process 2 rows, store into output array. */
-        /* Row 0 */
-        pOutput = (unsigned char *)pMCUSrc; // store output pixels back into MCU
-        pOutput[0] = ucRangeTable[(((tmp0 + tmp1)>>5) & 0x3ff)];
-        pOutput[1] = ucRangeTable[(((tmp0 - tmp1)>>5) & 0x3ff)];
-        /* Row 1 */
-        pOutput[2] = ucRangeTable[(((tmp2 + tmp3)>>5) & 0x3ff)];
-        pOutput[3] = ucRangeTable[(((tmp2 - tmp3)>>5) & 0x3ff)];
-        return;
-    }
     // do columns first
     ucColMask = ucMaxACCol | 1; // column 0 must always be calculated
     for (iCol = 0; iCol < 8 && ucColMask; iCol++)
@@ -1994,6 +2260,117 @@ static void JPEGIDCT(JPEGIMAGE *pJPEG, int iMCUOffset, int iQuantTable, int iACF
         pOutput += 8;
     } // for each row
 } /* JPEGIDCT() */
+//
+// Reduced size inverse DCTs for the scaled modes
+// Each output pixel is the average of the 2x2 (or 4x4) pixels the full
+// IDCT would produce. With the AAN prescaled quantization tables that
+// average weighs coefficient u by cos((2k+1)u*pi/8) for 4 outputs, and
+// coefficient 8-u by the negative of it, so the high half folds into the
+// low half before a 4 point transform (8.8 fixed point weights).
+// Output pixels are stored contiguously, 4 (or 2) per row.
+//
+static void JPEGIDCT4x4(JPEGIMAGE *pJPEG, int iMCUOffset, int iQuantTable, int iACFlags)
+{
+    int i, j, tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+    int iCol[8], iWork[16];
+    int *pWork;
+    signed short *pQuant = &pJPEG->sQuantTable[iQuantTable * DCTSIZE];
+    int16_t *pMCUSrc = &pJPEG->sMCUs[iMCUOffset];
+    int bFoldCols = (iACFlags & 0xe0); // columns 5-7 have data
+    int bFoldRows = (iACFlags >> 8); // rows 4-7 have data
+    unsigned char *pOutput;
+    
+    for (i=0; i<4; i++)
+    {
+        for (j=0; j<8; j++) // fold the column pairs i, 8-i
+        {
+            iCol[j] = pMCUSrc[j*8+i] * pQuant[j*8+i];
+            if (bFoldCols && i)
+                iCol[j] -= pMCUSrc[j*8+8-i] * pQuant[j*8+8-i];
+            if (!bFoldRows && j == 3)
+                break;
+        }
+        tmp0 = iCol[0];
+        tmp1 = iCol[1];
+        tmp2 = iCol[2];
+        tmp3 = iCol[3];
+        if (bFoldRows)
+        {
+            tmp1 -= iCol[7];
+            tmp2 -= iCol[6];
+            tmp3 -= iCol[5];
+        }
+        tmp12 = (tmp2 * 181) >> 8; // cos(pi/4)
+        tmp10 = tmp0 + tmp12;
+        tmp11 = tmp0 - tmp12;
+        tmp12 = (tmp1 * 237 + tmp3 * 98) >> 8; // cos(pi/8), cos(3pi/8)
+        tmp13 = (tmp1 * 98 - tmp3 * 237) >> 8;
+        iWork[i] = tmp10 + tmp12;
+        iWork[i+4] = tmp11 + tmp13;
+        iWork[i+8] = tmp11 - tmp13;
+        iWork[i+12] = tmp10 - tmp12;
+    }
+    // rows, the coefficients were read so the output can go over them
+    pOutput = (unsigned char *)pMCUSrc;
+    pWork = iWork;
+    for (i=0; i<4; i++)
+    {
+        tmp12 = (pWork[2] * 181) >> 8;
+        tmp10 = pWork[0] + tmp12;
+        tmp11 = pWork[0] - tmp12;
+        tmp12 = (pWork[1] * 237 + pWork[3] * 98) >> 8;
+        tmp13 = (pWork[1] * 98 - pWork[3] * 237) >> 8;
+        pOutput[0] = ucRangeTable[(((tmp10 + tmp12)>>5) & 0x3ff)];
+        pOutput[1] = ucRangeTable[(((tmp11 + tmp13)>>5) & 0x3ff)];
+        pOutput[2] = ucRangeTable[(((tmp11 - tmp13)>>5) & 0x3ff)];
+        pOutput[3] = ucRangeTable[(((tmp10 - tmp12)>>5) & 0x3ff)];
+        pOutput += 4;
+        pWork += 4;
+    }
+} /* JPEGIDCT4x4() */
+//
+// Only coefficients 0, 1, 8 and 9 are stored in this mode; the 4 pixel
+// average weighs coefficient 1 by 0.65328
+//
+static void JPEGIDCT2x2(JPEGIMAGE *pJPEG, int iMCUOffset, int iQuantTable, int iACFlags)
+{
+    int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5;
+    signed short *pQuant = &pJPEG->sQuantTable[iQuantTable * DCTSIZE];
+    int16_t *pMCUSrc = &pJPEG->sMCUs[iMCUOffset];
+    unsigned char *pOutput;
+    
+    (void)iACFlags;
+    /* Column 0 */
+    tmp4 = pMCUSrc[0] * pQuant[0];
+    tmp5 = (pMCUSrc[8] * pQuant[8] * 167) >> 8;
+    tmp0 = tmp4 + tmp5;
+    tmp2 = tmp4 - tmp5;
+    /* Column 1 */
+    tmp4 = pMCUSrc[1] * pQuant[1];
+    tmp5 = (pMCUSrc[9] * pQuant[9] * 167) >> 8;
+    tmp1 = ((tmp4 + tmp5) * 167) >> 8;
+    tmp3 = ((tmp4 - tmp5) * 167) >> 8;
+    /* Rows */
+    pOutput = (unsigned char *)pMCUSrc; // store output pixels back into MCU
+    pOutput[0] = ucRangeTable[(((tmp0 + tmp1)>>5) & 0x3ff)];
+    pOutput[1] = ucRangeTable[(((tmp0 - tmp1)>>5) & 0x3ff)];
+    pOutput[2] = ucRangeTable[(((tmp2 + tmp3)>>5) & 0x3ff)];
+    pOutput[3] = ucRangeTable[(((tmp2 - tmp3)>>5) & 0x3ff)];
+} /* JPEGIDCT2x2() */
+//
+// The IDCT for an output block of iSize x iSize pixels. The decode loops
+// are expanded per size and pass it as a constant, so this folds to a
+// direct call of one kernel
+//
+static JPEG_ALWAYS_INLINE void JPEGIDCTSize(JPEGIMAGE *pJPEG, int iSize, int iMCUOffset, int iQuantTable, int iACFlags)
+{
+    if (iSize == 8)
+        JPEGIDCT(pJPEG, iMCUOffset, iQuantTable, iACFlags);
+    else if (iSize == 4)
+        JPEGIDCT4x4(pJPEG, iMCUOffset, iQuantTable, iACFlags);
+    else
+        JPEGIDCT2x2(pJPEG, iMCUOffset, iQuantTable, iACFlags);
+} /* JPEGIDCTSize() */
 static void JPEGPutMCU8BitGray(JPEGIMAGE *pJPEG, int x, int iPitch)
 {
     int i, j, xcount, ycount;
@@ -2265,6 +2642,232 @@ static void JPEGPutMCUGray(JPEGIMAGE *pJPEG, int x, int iPitch)
     }
 } /* JPEGPutMCUGray() */
 
+static int JPEGSetEPD(JPEGIMAGE *pJPEG, uint8_t *pFramebuffer, int iFBWidth, int iFBHeight, int iRotation, const uint8_t *pGamma)
+{
+    if (pFramebuffer == NULL || iFBWidth <= 0 || iFBHeight <= 0 || (iFBWidth & 1) || iRotation < 0 || iRotation > 3)
+    {
+        pJPEG->iError = JPEG_INVALID_PARAMETER;
+        return 0;
+    }
+    pJPEG->ucPixelType = FOUR_BIT_EPD;
+    pJPEG->pFramebuffer = pFramebuffer;
+    pJPEG->iFBWidth = iFBWidth;
+    pJPEG->iFBHeight = iFBHeight;
+    pJPEG->iFBRotation = iRotation;
+    pJPEG->pGamma = pGamma;
+    pJPEG->iDeferRow = JPEG_NO_ROW;
+    return 1;
+} /* JPEGSetEPD() */
+//
+// Panel position of a display (rotated) position, as epd_draw_pixel() maps it
+//
+static void JPEGPanelEPD(JPEGIMAGE *pJPEG, int x, int y, int *px, int *py)
+{
+    switch (pJPEG->iFBRotation)
+    {
+        case 1: // portrait
+            *px = pJPEG->iFBWidth - y - 1;
+            *py = x;
+            break;
+        case 2: // inverted landscape
+            *px = pJPEG->iFBWidth - x - 1;
+            *py = pJPEG->iFBHeight - y - 1;
+            break;
+        case 3: // inverted portrait
+            *px = y;
+            *py = pJPEG->iFBHeight - x - 1;
+            break;
+        default: // landscape
+            *px = x;
+            *py = y;
+            break;
+    }
+} /* JPEGPanelEPD() */
+//
+// Clip the (scaled) image placed at iXOffset/iYOffset to the rotated display
+// and set up the mapping from source pixels to the panel. With
+// JPEG_AUTO_ROTATE the EXIF orientation is folded into that mapping, so
+// x, y place the upright image. The clip rectangle stays in source order
+// (source position + iXOffset/iYOffset) because that is how the MCUs come.
+//
+static void JPEGClipEPD(JPEGIMAGE *pJPEG, int iScaleShift)
+{
+    // source x, y to upright x, y: ux = ox + sx*m[0] + sy*m[1], uy = oy + sx*m[2] + sy*m[3]
+    static const signed char cOrient[9][4] = {{1,0,0,1}, {1,0,0,1}, {-1,0,0,1}, {-1,0,0,-1},
+        {1,0,0,-1}, {0,1,1,0}, {0,-1,1,0}, {0,-1,-1,0}, {0,1,-1,0}};
+    const signed char *m;
+    int iDisplayWidth, iDisplayHeight, iWidth, iHeight, iUpWidth, iUpHeight;
+    int ox, oy, x0, y0, x1, y1, sx0, sy0, sx1, sy1, px, py;
+
+    if (pJPEG->iFBRotation & 1) // portrait
+    {
+        iDisplayWidth = pJPEG->iFBHeight;
+        iDisplayHeight = pJPEG->iFBWidth;
+    }
+    else
+    {
+        iDisplayWidth = pJPEG->iFBWidth;
+        iDisplayHeight = pJPEG->iFBHeight;
+    }
+    iWidth = pJPEG->iWidth >> iScaleShift;
+    iHeight = pJPEG->iHeight >> iScaleShift;
+    m = cOrient[0];
+    if ((pJPEG->iOptions & JPEG_AUTO_ROTATE) && pJPEG->ucOrientation <= 8)
+        m = cOrient[pJPEG->ucOrientation];
+    iUpWidth = m[0] ? iWidth : iHeight;
+    iUpHeight = m[0] ? iHeight : iWidth;
+    ox = (m[0] < 0 || m[1] < 0) ? iUpWidth - 1 : 0;
+    oy = (m[2] < 0 || m[3] < 0) ? iUpHeight - 1 : 0;
+    // panel position of source pixel 0,0 and the steps along a row and a column
+    JPEGPanelEPD(pJPEG, pJPEG->iXOffset + ox, pJPEG->iYOffset + oy, &pJPEG->iPanelX, &pJPEG->iPanelY);
+    JPEGPanelEPD(pJPEG, pJPEG->iXOffset + ox + m[0], pJPEG->iYOffset + oy + m[2], &px, &py);
+    pJPEG->iRowDX = px - pJPEG->iPanelX;
+    pJPEG->iRowDY = py - pJPEG->iPanelY;
+    JPEGPanelEPD(pJPEG, pJPEG->iXOffset + ox + m[1], pJPEG->iYOffset + oy + m[3], &px, &py);
+    pJPEG->iColDX = px - pJPEG->iPanelX;
+    pJPEG->iColDY = py - pJPEG->iPanelY;
+    // visible part of the upright image, then the same corners in the source
+    x0 = (pJPEG->iXOffset < 0) ? -pJPEG->iXOffset : 0;
+    y0 = (pJPEG->iYOffset < 0) ? -pJPEG->iYOffset : 0;
+    x1 = iDisplayWidth - pJPEG->iXOffset;
+    y1 = iDisplayHeight - pJPEG->iYOffset;
+    if (x1 > iUpWidth)
+        x1 = iUpWidth;
+    if (y1 > iUpHeight)
+        y1 = iUpHeight;
+    if (x1 <= x0 || y1 <= y0) // off the display
+    {
+        pJPEG->iClipLeft = pJPEG->iClipRight = pJPEG->iXOffset;
+        pJPEG->iClipTop = pJPEG->iClipBottom = pJPEG->iYOffset;
+        return;
+    }
+    x1--; y1--; // last visible pixel; the inverse of the orientation is its transpose
+    sx0 = (x0 - ox) * m[0] + (y0 - oy) * m[2];
+    sy0 = (x0 - ox) * m[1] + (y0 - oy) * m[3];
+    sx1 = (x1 - ox) * m[0] + (y1 - oy) * m[2];
+    sy1 = (x1 - ox) * m[1] + (y1 - oy) * m[3];
+    pJPEG->iClipLeft = pJPEG->iXOffset + ((sx0 < sx1) ? sx0 : sx1);
+    pJPEG->iClipRight = pJPEG->iXOffset + ((sx0 < sx1) ? sx1 : sx0) + 1;
+    pJPEG->iClipTop = pJPEG->iYOffset + ((sy0 < sy1) ? sy0 : sy1);
+    pJPEG->iClipBottom = pJPEG->iYOffset + ((sy0 < sy1) ? sy1 : sy0) + 1;
+} /* JPEGClipEPD() */
+//
+// Write a row of gray pixels to the framebuffer; x, y is the source position
+// plus iXOffset/iYOffset. Pixels land where JPEGClipEPD() mapped them:
+// rotated, even panel x in the low nibble, odd x in the high nibble
+//
+static void JPEGRowEPD(JPEGIMAGE *pJPEG, const uint8_t *pSrc, int iCount, int x, int y)
+{
+    int i, iSkip, iPitch, px, py, dx, dy;
+    const uint8_t *pGamma = pJPEG->pGamma;
+    uint8_t *d, uc0, uc1;
+    
+    if (y < pJPEG->iClipTop || y >= pJPEG->iClipBottom)
+        return;
+    if (x < pJPEG->iClipLeft)
+    {
+        iSkip = pJPEG->iClipLeft - x;
+        pSrc += iSkip;
+        iCount -= iSkip;
+        x = pJPEG->iClipLeft;
+    }
+    if (x + iCount > pJPEG->iClipRight)
+        iCount = pJPEG->iClipRight - x;
+    if (iCount <= 0)
+        return;
+    if (y == pJPEG->iDeferRow) // shares bytes with the other worker's band, keep the gray values
+    {
+        memcpy((uint8_t *)pJPEG->usPixels + (x - pJPEG->iClipLeft), pSrc, iCount);
+        return;
+    }
+    iPitch = pJPEG->iFBWidth / 2;
+    x -= pJPEG->iXOffset;
+    y -= pJPEG->iYOffset;
+    px = pJPEG->iPanelX + x * pJPEG->iRowDX + y * pJPEG->iColDX;
+    py = pJPEG->iPanelY + x * pJPEG->iRowDY + y * pJPEG->iColDY;
+    dx = pJPEG->iRowDX;
+    dy = pJPEG->iRowDY;
+    if (dx == 1) // the row runs along the panel row, pack pairs of pixels
+    {
+        d = &pJPEG->pFramebuffer[py * iPitch + (px >> 1)];
+        if (px & 1)
+        {
+            uc0 = pGamma ? pGamma[*pSrc++] : *pSrc++;
+            *d = (*d & 0x0f) | (uc0 & 0xf0);
+            d++;
+            iCount--;
+        }
+        for (i=0; i<iCount-1; i+=2)
+        {
+            uc0 = pGamma ? pGamma[pSrc[0]] : pSrc[0];
+            uc1 = pGamma ? pGamma[pSrc[1]] : pSrc[1];
+            *d++ = (uc0 >> 4) | (uc1 & 0xf0);
+            pSrc += 2;
+        }
+        if (iCount & 1)
+        {
+            uc0 = pGamma ? pGamma[*pSrc] : *pSrc;
+            *d = (*d & 0xf0) | (uc0 >> 4);
+        }
+        return;
+    }
+    for (i=0; i<iCount; i++)
+    {
+        uc0 = pGamma ? pGamma[*pSrc] : *pSrc;
+        pSrc++;
+        d = &pJPEG->pFramebuffer[py * iPitch + (px >> 1)];
+        if (px & 1)
+            *d = (*d & 0x0f) | (uc0 & 0xf0);
+        else
+            *d = (*d & 0xf0) | (uc0 >> 4);
+        px += dx;
+        py += dy;
+    }
+} /* JPEGRowEPD() */
+//
+// Write the luminance blocks of the current MCU to the framebuffer
+// x, y is the display position of the MCU
+//
+static void JPEGPutMCUEPD(JPEGIMAGE *pJPEG, int x, int y)
+{
+    int i, iBlock, iBlocks, iSize, bx, by;
+    uint8_t *pSrc = (uint8_t *)&pJPEG->sMCUs[0];
+    
+    iSize = 8; // output pixels per side of a block, stored contiguously
+    if (pJPEG->iOptions & JPEG_SCALE_HALF) // JPEGIDCT4x4()
+        iSize = 4;
+    else if (pJPEG->iOptions & JPEG_SCALE_QUARTER)
+        iSize = 2;
+    else if (pJPEG->iOptions & JPEG_SCALE_EIGHTH)
+        iSize = 1;
+    switch (pJPEG->ucSubSample)
+    {
+        case 0x21:
+        case 0x12:
+            iBlocks = 2;
+            break;
+        case 0x22:
+            iBlocks = 4;
+            break;
+        default: // single Y
+            iBlocks = 1;
+            break;
+    }
+    for (iBlock=0; iBlock<iBlocks; iBlock++)
+    {
+        // Y blocks are stored 128 bytes apart, left to right then top to bottom
+        bx = by = 0;
+        if (pJPEG->ucSubSample == 0x21 || (pJPEG->ucSubSample == 0x22 && (iBlock & 1)))
+            bx = (pJPEG->ucSubSample == 0x21) ? iBlock * iSize : iSize;
+        if (pJPEG->ucSubSample == 0x12)
+            by = iBlock * iSize;
+        else if (pJPEG->ucSubSample == 0x22)
+            by = (iBlock >> 1) * iSize;
+        for (i=0; i<iSize; i++)
+            JPEGRowEPD(pJPEG, &pSrc[iBlock * 128 + i * iSize], iSize, x + bx, y + by + i);
+    }
+} /* JPEGPutMCUEPD() */
+
 static void JPEGPixelLE(uint16_t *pDest, int iY, int iCb, int iCr)
 {
 //
@@ -3181,7 +3784,11 @@ uint8_t pixelmask=0, shift=0;
 // Decode the image
 // returns 0 for error, 1 for success
 //
-static int DecodeJPEG(JPEGIMAGE *pJPEG)
+//
+// The baseline decode loop for output blocks of iIDCTSize pixels a side,
+// only ever called with a constant size; see DecodeJPEG()
+//
+static JPEG_ALWAYS_INLINE int DecodeJPEGSize(JPEGIMAGE *pJPEG, const int iIDCTSize)
 {
     int cx, cy, x, y, mcuCX, mcuCY;
     int iLum0, iLum1, iLum2, iLum3, iCr, iCb;
@@ -3194,21 +3801,34 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
     unsigned char cDCTable0, cACTable0, cDCTable1, cACTable1, cDCTable2, cACTable2;
     JPEGDRAW jd;
     int iMaxFill = 16, iScaleShift = 0;
+    int bGray = (pJPEG->ucPixelType >= EIGHT_BIT_GRAYSCALE);
+    int bROI = (pJPEG->ucPixelType == FOUR_BIT_EPD), bRowVisible = 1, bSkip = 0;
 
     // Requested the Exif thumbnail
     if (pJPEG->iOptions & JPEG_EXIF_THUMBNAIL)
     {
-        if (pJPEG->iThumbData == 0 || pJPEG->iThumbWidth == 0) // doesn't exist
+        if (!pJPEG->ucHasThumb) // doesn't exist
         {
             pJPEG->iError = JPEG_INVALID_PARAMETER;
             return 0;
         }
         if (!JPEGParseInfo(pJPEG, 1)) // parse the embedded thumbnail file header
             return 0; // something went wrong
+        pJPEG->iThumbWidth = pJPEG->iWidth; // its own frame header is the reliable size
+        pJPEG->iThumbHeight = pJPEG->iHeight;
+    }
+    if (pJPEG->ucMode == 0xc2) // only JPEG_decodeEPD() takes progressive images
+    {
+        pJPEG->iError = JPEG_UNSUPPORTED_FEATURE;
+        return 0;
     }
     // Fast downscaling options
     if (pJPEG->iOptions & JPEG_SCALE_HALF)
+    {
         iScaleShift = 1;
+        if (pJPEG->ucPixelType == FOUR_BIT_EPD) // the other outputs average 8x8 blocks
+            iMaxFill = 4;
+    }
     else if (pJPEG->iOptions & JPEG_SCALE_QUARTER)
     {
         iScaleShift = 2;
@@ -3221,6 +3841,9 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
         bThumbnail = 1;
     }
     
+    if (pJPEG->ucPixelType == FOUR_BIT_EPD && pJPEG->iRowEnd == 0) // workers get their band from JPEGDecodeParallel
+        JPEGClipEPD(pJPEG, iScaleShift);
+    
     // reorder and fix the quantization table for decoding
     JPEGFixQuantD(pJPEG);
     pJPEG->bb.ulBits = MOTOLONG(&pJPEG->ucFileBuf[0]); // preload first 4 bytes
@@ -3269,10 +3892,9 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
             iCb = MCU5;
             mcuCX = mcuCY = 16;
             break;
-        default: // to suppress compiler warning
-            cx = cy = 0;
-            iCr = iCb = 0;
-            break;
+        default: // unsupported, would leave the MCU size at 0
+            pJPEG->iError = JPEG_UNSUPPORTED_FEATURE;
+            return 0;
     }
     // Scale down the MCUs by the requested amount
     mcuCX >>= iScaleShift;
@@ -3296,7 +3918,7 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
         iMCUCount = cx; // don't go wider than the image
     if (iMCUCount > pJPEG->iMaxMCUs) // did the user set an upper bound on how many pixels per JPEGDraw callback?
         iMCUCount = pJPEG->iMaxMCUs;
-    if (pJPEG->ucPixelType > EIGHT_BIT_GRAYSCALE) // dithered, override the max MCU count
+    if (pJPEG->ucPixelType > EIGHT_BIT_GRAYSCALE) // dithered or EPD, override the max MCU count
         iMCUCount = cx; // do the whole row
     jd.iBpp = 16;
     switch (pJPEG->ucPixelType)
@@ -3313,25 +3935,42 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
         case ONE_BIT_DITHERED:
             jd.iBpp = 1;
             break;
+        case FOUR_BIT_EPD:
+            jd.iBpp = 4;
+            break;
     }
-    if (pJPEG->ucPixelType > EIGHT_BIT_GRAYSCALE)
+    if (pJPEG->ucPixelType == FOUR_BIT_EPD) // already in the framebuffer
+        jd.pPixels = (uint16_t *)pJPEG->pFramebuffer;
+    else if (pJPEG->ucPixelType > EIGHT_BIT_GRAYSCALE)
         jd.pPixels = (uint16_t *)pJPEG->pDitherBuffer;
     else
         jd.pPixels = pJPEG->usPixels;
     jd.iHeight = mcuCY;
-    jd.y = pJPEG->iYOffset;
-    for (y = 0; y < cy && bContinue && iErr == 0; y++, jd.y += mcuCY)
+    if (pJPEG->iRowEnd) // one band of a parallel decode
+        cy = pJPEG->iRowEnd;
+    jd.y = pJPEG->iYOffset + pJPEG->iRowStart * mcuCY;
+    for (y = pJPEG->iRowStart; y < cy && bContinue && iErr == 0; y++, jd.y += mcuCY)
     {
+        if (bROI) // only the part of the image on the display is needed
+        {
+            if (jd.y >= pJPEG->iClipBottom)
+                break; // nothing visible below
+            bRowVisible = (jd.y + mcuCY > pJPEG->iClipTop);
+        }
         jd.x = pJPEG->iXOffset;
         xoff = 0; // start of new LCD output group
         iPitch = iMCUCount * mcuCX; // pixels per line of LCD buffer
         for (x = 0; x < cx && bContinue && iErr == 0; x++)
         {
+            // MCUs outside the ROI are only entropy decoded, to keep the
+            // bitstream position and the DC predictors
+            if (bROI)
+                bSkip = !bRowVisible || (jd.x + xoff + mcuCX <= pJPEG->iClipLeft) || (jd.x + xoff >= pJPEG->iClipRight);
             pJPEG->ucACTable = cACTable0;
             pJPEG->ucDCTable = cDCTable0;
             // do the first luminance component
             iErr = JPEGDecodeMCU(pJPEG, iLum0, &iDCPred0);
-            if (pJPEG->ucMaxACCol == 0 || bThumbnail) // no AC components, save some time
+            if (!bSkip && (pJPEG->ucMaxACCol == 0 || bThumbnail)) // no AC components, save some time
             {
                 pl = (uint32_t *)&pJPEG->sMCUs[iLum0];
                 c = ucRangeTable[((iDCPred0 * iQuant1) >> 5) & 0x3ff];
@@ -3340,15 +3979,15 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                 for (i = 0; i<iMaxFill; i++) // 8x8 bytes = 16 longs
                     pl[i] = l;
             }
-            else
+            else if (!bSkip)
             {
-                JPEGIDCT(pJPEG, iLum0, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
+                JPEGIDCTSize(pJPEG, iIDCTSize, iLum0, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
             }
             // do the second luminance component
             if (pJPEG->ucSubSample > 0x11) // subsampling
             {
                 iErr |= JPEGDecodeMCU(pJPEG, iLum1, &iDCPred0);
-                if (pJPEG->ucMaxACCol == 0 || bThumbnail) // no AC components, save some time
+                if (!bSkip && (pJPEG->ucMaxACCol == 0 || bThumbnail)) // no AC components, save some time
                 {
                     c = ucRangeTable[((iDCPred0 * iQuant1) >> 5) & 0x3ff];
                     l = c | ((uint32_t) c << 8) | ((uint32_t) c << 16) | ((uint32_t) c << 24);
@@ -3357,14 +3996,14 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                     for (i = 0; i<iMaxFill; i++) // 8x8 bytes = 16 longs
                         pl[i] = l;
                 }
-                else
+                else if (!bSkip)
                 {
-                    JPEGIDCT(pJPEG, iLum1, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
+                    JPEGIDCTSize(pJPEG, iIDCTSize, iLum1, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
                 }
                 if (pJPEG->ucSubSample == 0x22)
                 {
                     iErr |= JPEGDecodeMCU(pJPEG, iLum2, &iDCPred0);
-                    if (pJPEG->ucMaxACCol == 0 || bThumbnail) // no AC components, save some time
+                    if (!bSkip && (pJPEG->ucMaxACCol == 0 || bThumbnail)) // no AC components, save some time
                     {
                         c = ucRangeTable[((iDCPred0 * iQuant1) >> 5) & 0x3ff];
                         l = c | ((uint32_t) c << 8) | ((uint32_t) c << 16) | ((uint32_t) c << 24);
@@ -3373,12 +4012,12 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                         for (i = 0; i<iMaxFill; i++) // 8x8 bytes = 16 longs
                             pl[i] = l;
                     }
-                    else
+                    else if (!bSkip)
                     {
-                        JPEGIDCT(pJPEG, iLum2, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
+                        JPEGIDCTSize(pJPEG, iIDCTSize, iLum2, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
                     }
                     iErr |= JPEGDecodeMCU(pJPEG, iLum3, &iDCPred0);
-                    if (pJPEG->ucMaxACCol == 0 || bThumbnail) // no AC components, save some time
+                    if (!bSkip && (pJPEG->ucMaxACCol == 0 || bThumbnail)) // no AC components, save some time
                     {
                         c = ucRangeTable[((iDCPred0 * iQuant1) >> 5) & 0x3ff];
                         l = c | ((uint32_t) c << 8) | ((uint32_t) c << 16) | ((uint32_t) c << 24);
@@ -3387,9 +4026,9 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                         for (i = 0; i<iMaxFill; i++) // 8x8 bytes = 16 longs
                             pl[i] = l;
                     }
-                    else
+                    else if (!bSkip)
                     {
-                        JPEGIDCT(pJPEG, iLum3, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
+                        JPEGIDCTSize(pJPEG, iIDCTSize, iLum3, pJPEG->JPCI[0].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // first quantization table
                     }
                 } // if 2:2 subsampling
             } // if subsampling used
@@ -3399,7 +4038,7 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                 pJPEG->ucACTable = cACTable1;
                 pJPEG->ucDCTable = cDCTable1;
                 iErr |= JPEGDecodeMCU(pJPEG, iCr, &iDCPred1);
-                if (pJPEG->ucMaxACCol == 0 || bThumbnail) // no AC components, save some time
+                if (!bSkip && (pJPEG->ucMaxACCol == 0 || bThumbnail)) // no AC components, save some time
                 {
                     c = ucRangeTable[((iDCPred1 * iQuant2) >> 5) & 0x3ff];
                     l = c | ((uint32_t) c << 8) | ((uint32_t) c << 16) | ((uint32_t) c << 24);
@@ -3408,15 +4047,15 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                     for (i = 0; i<iMaxFill; i++) // 8x8 bytes = 16 longs
                         pl[i] = l;
                 }
-                else
+                else if (!bGray && !bSkip) // gray output uses only Y
                 {
-                    JPEGIDCT(pJPEG, iCr, pJPEG->JPCI[1].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // second quantization table
+                    JPEGIDCTSize(pJPEG, iIDCTSize, iCr, pJPEG->JPCI[1].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8))); // second quantization table
                 }
                 // second chroma
                 pJPEG->ucACTable = cACTable2;
                 pJPEG->ucDCTable = cDCTable2;
                 iErr |= JPEGDecodeMCU(pJPEG, iCb, &iDCPred2);
-                if (pJPEG->ucMaxACCol == 0 || bThumbnail) // no AC components, save some time
+                if (!bSkip && (pJPEG->ucMaxACCol == 0 || bThumbnail)) // no AC components, save some time
                 {
                     c = ucRangeTable[((iDCPred2 * iQuant3) >> 5) & 0x3ff];
                     l = c | ((uint32_t) c << 8) | ((uint32_t) c << 16) | ((uint32_t) c << 24);
@@ -3425,12 +4064,17 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
                     for (i = 0; i<iMaxFill; i++) // 8x8 bytes = 16 longs
                         pl[i] = l;
                 }
-                else
+                else if (!bGray && !bSkip) // gray output uses only Y
                 {
-                    JPEGIDCT(pJPEG, iCb, pJPEG->JPCI[2].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8)));
+                    JPEGIDCTSize(pJPEG, iIDCTSize, iCb, pJPEG->JPCI[2].quant_tbl_no, (pJPEG->ucMaxACCol | (pJPEG->ucMaxACRow << 8)));
                 }
             } // if color components present
-            if (pJPEG->ucPixelType >= EIGHT_BIT_GRAYSCALE)
+            if (pJPEG->ucPixelType == FOUR_BIT_EPD)
+            {
+                if (!bSkip)
+                    JPEGPutMCUEPD(pJPEG, jd.x + xoff, jd.y);
+            }
+            else if (pJPEG->ucPixelType >= EIGHT_BIT_GRAYSCALE)
             {
                 JPEGPutMCU8BitGray(pJPEG, xoff, iPitch);
             }
@@ -3460,12 +4104,13 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
             {
                 xoff = 0;
                 jd.iWidth = iPitch; // width of each LCD block group
-                if (pJPEG->ucPixelType > EIGHT_BIT_GRAYSCALE) // dither to 4/2/1 bits
+                if (pJPEG->ucPixelType > EIGHT_BIT_GRAYSCALE && pJPEG->ucPixelType != FOUR_BIT_EPD) // dither to 4/2/1 bits
                     JPEGDither(pJPEG, cx * mcuCX, mcuCY);
                 if (jd.y + mcuCY > (pJPEG->iHeight>>iScaleShift)) { // last row needs to be trimmed
                    jd.iHeight = (pJPEG->iHeight>>iScaleShift) - jd.y;
                 }
-                bContinue = (*pJPEG->pfnDraw)(&jd);
+                if (pJPEG->pfnDraw) // optional for FOUR_BIT_EPD
+                    bContinue = (*pJPEG->pfnDraw)(&jd);
                 jd.x += iPitch;
                 if ((cx - 1 - x) < iMCUCount) // change pitch for the last set of MCUs on this row
                     iPitch = (cx - 1 - x) * mcuCX;
@@ -3490,4 +4135,1027 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
     if (iErr != 0)
         pJPEG->iError = JPEG_DECODE_ERROR;
     return (iErr == 0);
+} /* DecodeJPEGSize() */
+//
+// Pick the reduced IDCT once per image: each call below is its own copy
+// of the decode loop, with no per block test of the scale
+//
+static int DecodeJPEG(JPEGIMAGE *pJPEG)
+{
+    if (pJPEG->iOptions & JPEG_SCALE_HALF)
+    {
+        if (pJPEG->ucPixelType == FOUR_BIT_EPD) // the other outputs average 8x8 blocks
+            return DecodeJPEGSize(pJPEG, 4);
+    }
+    else if (pJPEG->iOptions & JPEG_SCALE_QUARTER)
+        return DecodeJPEGSize(pJPEG, 2);
+    return DecodeJPEGSize(pJPEG, 8); // full size, or only the DC at 1/8
 } /* DecodeJPEG() */
+//
+// Progressive JPEG (SOF2), FOUR_BIT_EPD only
+// Each scan refines coefficients all over the image, so they are collected
+// in a buffer (PSRAM on the ESP32) before any IDCT. Only luma is kept:
+// chroma DC is decoded and dropped in the interleaved DC scans and the
+// chroma AC scans are stepped over. The scaled modes keep just what the
+// reduced IDCT reads (4x4, 2x2 or only the DC), plus a bit per coefficient
+// that has become nonzero, which the AC refinement scans need to parse.
+//
+struct jpeg_coeffs_tag
+{
+    int16_t *pCoeffs; // iStored per luma block, rows of iSize
+    uint64_t *pNonZero; // per luma block, bit n for zigzag position n; NULL for DC only
+    int iBlocksX, iBlocksY; // luma blocks, padded to whole MCUs
+    int iSize, iStored; // coefficients kept per side and per block
+    int iEOBRun; // blocks left in the current end-of-band run
+    signed char cStore[64]; // zigzag position -> index in the block, -1 when not kept
+};
+//
+// Set up the coefficient layout for these (scale) options, NULL to only size
+// it; returns the buffer size in bytes, 0 for baseline images
+//
+static int JPEGCoeffLayout(JPEGIMAGE *pJPEG, int iOptions, JPEGCOEFFS *pCoeffs)
+{
+    JPEGCOEFFS layout;
+    int i, u, v, iMCUX = 8, iMCUY = 8;
+    
+    if (pJPEG->ucMode != 0xc2)
+        return 0;
+    if (pCoeffs == NULL)
+        pCoeffs = &layout;
+    if (pJPEG->ucSubSample == 0x21 || pJPEG->ucSubSample == 0x22)
+        iMCUX = 16;
+    if (pJPEG->ucSubSample == 0x12 || pJPEG->ucSubSample == 0x22)
+        iMCUY = 16;
+    pCoeffs->iBlocksX = ((pJPEG->iWidth + iMCUX - 1) / iMCUX) * (iMCUX / 8);
+    pCoeffs->iBlocksY = ((pJPEG->iHeight + iMCUY - 1) / iMCUY) * (iMCUY / 8);
+    pCoeffs->iSize = 8;
+    if (iOptions & JPEG_SCALE_HALF)
+        pCoeffs->iSize = 4;
+    else if (iOptions & JPEG_SCALE_QUARTER)
+        pCoeffs->iSize = 2;
+    else if (iOptions & JPEG_SCALE_EIGHTH)
+        pCoeffs->iSize = 1;
+    pCoeffs->iStored = pCoeffs->iSize * pCoeffs->iSize;
+    for (i=0; i<DCTSIZE; i++)
+    {
+        u = cZigZag2[i] & 7;
+        v = cZigZag2[i] >> 3;
+        pCoeffs->cStore[i] = (u < pCoeffs->iSize && v < pCoeffs->iSize) ? (signed char)(v * pCoeffs->iSize + u) : -1;
+    }
+    return pCoeffs->iBlocksX * pCoeffs->iBlocksY * (pCoeffs->iStored * (int)sizeof(int16_t) +
+           ((pCoeffs->iStored > 1) ? (int)sizeof(uint64_t) : 0));
+} /* JPEGCoeffLayout() */
+//
+// Read iBits (1-16) from the VLC data
+//
+static uint32_t JPEGGetBits(BUFFERED_BITS *pBB, int iBits)
+{
+    uint32_t ulCode;
+    
+    if (pBB->ulBitOff > (REGISTER_WIDTH - 17)) // need to get more data
+    {
+        pBB->pBuf += (pBB->ulBitOff >> 3);
+        pBB->ulBitOff &= 7;
+        pBB->ulBits = MOTOLONG(pBB->pBuf);
+    }
+    ulCode = (pBB->ulBits << pBB->ulBitOff) >> (REGISTER_WIDTH - iBits);
+    pBB->ulBitOff += iBits;
+    return ulCode;
+} /* JPEGGetBits() */
+//
+// Signed value of iBits 'extra' bits
+//
+static int JPEGExtend(uint32_t ulCode, int iBits)
+{
+    if (ulCode < (1U << (iBits-1))) // negative
+        return (int)ulCode - ((1 << iBits) - 1);
+    return (int)ulCode;
+} /* JPEGExtend() */
+//
+// Next DC (SSSS) or AC (RRRRSSSS) symbol, -1 for an invalid code
+// Same table lookups as JPEGDecodeMCU()
+//
+static int JPEGGetSymbol(JPEGIMAGE *pJPEG, int iTable, int bAC)
+{
+    BUFFERED_BITS *pBB = &pJPEG->bb;
+    uint32_t ulCode, usHuff;
+    
+    if (pBB->ulBitOff > (REGISTER_WIDTH - 17)) // need to get more data
+    {
+        pBB->pBuf += (pBB->ulBitOff >> 3);
+        pBB->ulBitOff &= 7;
+        pBB->ulBits = MOTOLONG(pBB->pBuf);
+    }
+    if (bAC)
+    {
+        ulCode = (pBB->ulBits >> (REGISTER_WIDTH - 16 - pBB->ulBitOff)) & 0xffff;
+        if (ulCode >= 0xfc00) // first 6 bits = 1, use long table
+            ulCode = (ulCode & 0x7ff);
+        else
+            ulCode >>= 6;
+        usHuff = pJPEG->usHuffAC[iTable * HUFF11SIZE + ulCode];
+        if (usHuff == 0) // invalid code
+            return -1;
+        pBB->ulBitOff += (usHuff >> 8);
+        return (int)(usHuff & 0xff);
+    }
+    ulCode = (pBB->ulBits >> (REGISTER_WIDTH - 12 - pBB->ulBitOff)) & 0xfff;
+    if (ulCode >= 0xf80) // it's a long code
+        ulCode = (ulCode & 0xff);
+    else
+        ulCode >>= 6;
+    usHuff = pJPEG->ucHuffDC[iTable * DC_TABLE_SIZE + ulCode];
+    if (usHuff == 0) // invalid code
+        return -1;
+    pBB->ulBitOff += (usHuff >> 4);
+    return (int)(usHuff & 0xf);
+} /* JPEGGetSymbol() */
+//
+// Correction bit for a coefficient that is already nonzero
+//
+static void JPEGRefineCoeff(JPEGIMAGE *pJPEG, JPEGCOEFFS *pC, int16_t *pCoeffs, int k, int iBit)
+{
+    int16_t *p;
+    
+    if (JPEGGetBits(&pJPEG->bb, 1) && pC->cStore[k] >= 0)
+    {
+        p = &pCoeffs[pC->cStore[k]];
+        if ((*p & iBit) == 0) // not corrected yet
+            *p += (*p >= 0) ? iBit : -iBit;
+    }
+} /* JPEGRefineCoeff() */
+//
+// Decode one block of the current scan into luma block iBlock; chroma
+// (iBlock < 0) is only decoded to stay in step. Returns nonzero for bad data
+//
+static int JPEGDecodeBlockProg(JPEGIMAGE *pJPEG, JPEGCOEFFS *pC, int iBlock, int iComp, int *piDCPred)
+{
+    int k, r, s, iSymbol, iBit, iLow = pJPEG->cApproxBitsLow, iEnd = pJPEG->iScanEnd;
+    int16_t *pCoeffs = NULL;
+    uint64_t ullNonZero = 0, *pNonZero = &ullNonZero;
+    
+    if (iBlock >= 0)
+    {
+        pCoeffs = &pC->pCoeffs[iBlock * pC->iStored];
+        if (pC->pNonZero)
+            pNonZero = &pC->pNonZero[iBlock];
+    }
+    if (pJPEG->iScanStart == 0) // DC
+    {
+        if (pJPEG->cApproxBitsHigh == 0) // first scan
+        {
+            s = JPEGGetSymbol(pJPEG, pJPEG->JPCI[iComp].dc_tbl_no, 0);
+            if (s < 0)
+                return 1;
+            if (s)
+                *piDCPred += JPEGExtend(JPEGGetBits(&pJPEG->bb, s), s);
+            if (pCoeffs)
+                pCoeffs[0] = (int16_t)(*piDCPred * (1 << iLow));
+        }
+        else if (JPEGGetBits(&pJPEG->bb, 1) && pCoeffs) // next bit
+        {
+            pCoeffs[0] |= (int16_t)(1 << iLow);
+        }
+        return 0;
+    }
+    if (pJPEG->cApproxBitsHigh == 0) // first scan of this band
+    {
+        if (pC->iEOBRun)
+        {
+            pC->iEOBRun--;
+            return 0;
+        }
+        for (k = pJPEG->iScanStart; k <= iEnd; k++)
+        {
+            iSymbol = JPEGGetSymbol(pJPEG, pJPEG->JPCI[iComp].ac_tbl_no, 1);
+            if (iSymbol < 0)
+                return 1;
+            r = iSymbol >> 4;
+            s = iSymbol & 0xf;
+            if (s)
+            {
+                k += r;
+                if (k > iEnd)
+                    return 1;
+                iBit = JPEGExtend(JPEGGetBits(&pJPEG->bb, s), s) * (1 << iLow);
+                if (pC->cStore[k] >= 0)
+                    pCoeffs[pC->cStore[k]] = (int16_t)iBit;
+                *pNonZero |= (uint64_t)1 << k;
+            }
+            else if (r == 15) // 16 zeros
+            {
+                k += 15;
+            }
+            else // end of band in this block and the next 2^r-1+bits
+            {
+                pC->iEOBRun = (1 << r) - 1;
+                if (r)
+                    pC->iEOBRun += JPEGGetBits(&pJPEG->bb, r);
+                break;
+            }
+        }
+        return 0;
+    }
+    // refinement: a bit for every nonzero coefficient, new ones are +/-1 << iLow
+    iBit = 1 << iLow;
+    k = pJPEG->iScanStart;
+    if (pC->iEOBRun == 0)
+    {
+        for (; k <= iEnd; k++)
+        {
+            iSymbol = JPEGGetSymbol(pJPEG, pJPEG->JPCI[iComp].ac_tbl_no, 1);
+            if (iSymbol < 0)
+                return 1;
+            r = iSymbol >> 4;
+            s = iSymbol & 0xf;
+            if (s) // size is always 1
+            {
+                s = JPEGGetBits(&pJPEG->bb, 1) ? iBit : -iBit;
+            }
+            else if (r != 15) // end of band, the rest is refined below
+            {
+                pC->iEOBRun = 1 << r;
+                if (r)
+                    pC->iEOBRun += JPEGGetBits(&pJPEG->bb, r);
+                break;
+            }
+            // skip r zero coefficients, correcting the nonzero ones on the way
+            for (; k <= iEnd; k++)
+            {
+                if (*pNonZero & ((uint64_t)1 << k))
+                    JPEGRefineCoeff(pJPEG, pC, pCoeffs, k, iBit);
+                else if (--r < 0)
+                    break;
+            }
+            if (s)
+            {
+                if (k > iEnd)
+                    return 1;
+                if (pC->cStore[k] >= 0)
+                    pCoeffs[pC->cStore[k]] = (int16_t)s;
+                *pNonZero |= (uint64_t)1 << k;
+            }
+        }
+    }
+    if (pC->iEOBRun)
+    {
+        for (; k <= iEnd; k++)
+        {
+            if (*pNonZero & ((uint64_t)1 << k))
+                JPEGRefineCoeff(pJPEG, pC, pCoeffs, k, iBit);
+        }
+        pC->iEOBRun--;
+    }
+    return 0;
+} /* JPEGDecodeBlockProg() */
+//
+// Entropy decode the scan whose data starts at iDataStart
+// Returns nonzero for bad or missing data
+//
+static int JPEGDecodeScan(JPEGIMAGE *pJPEG, JPEGCOEFFS *pC, int iDataStart)
+{
+    int x, y, h, v, i, cx, cy, iH = 1, iV = 1, iErr = 0;
+    int iDCPred[MAX_COMPS_IN_SCAN];
+    
+    if (pJPEG->iScanStart > pJPEG->iScanEnd || pJPEG->iScanEnd > 63 || (pJPEG->iScanStart == 0 && pJPEG->iScanEnd != 0))
+        return 1;
+    if (!pJPEG->JPCI[0].component_needed || (pJPEG->iScanStart && pC->pNonZero == NULL))
+        return 0; // chroma only, or AC at 1/8 scale
+    for (i=0; i<pJPEG->ucNumComponents; i++)
+    {
+        if (pJPEG->JPCI[i].component_needed && (pJPEG->JPCI[i].dc_tbl_no > 1 || pJPEG->JPCI[i].ac_tbl_no > 1))
+            return 1; // only 2 tables of each kind are kept
+    }
+    (*pJPEG->pfnSeek)(&pJPEG->JPEGFile, iDataStart);
+    pJPEG->iVLCOff = pJPEG->iVLCSize = 0;
+    pJPEG->ucFF = 0;
+    JPEGGetMoreData(pJPEG);
+    pJPEG->bb.ulBits = MOTOLONG(&pJPEG->ucFileBuf[0]); // preload first 4 bytes
+    pJPEG->bb.pBuf = pJPEG->ucFileBuf;
+    pJPEG->bb.ulBitOff = 0;
+    pJPEG->iResCount = pJPEG->iResInterval;
+    pC->iEOBRun = 0;
+    memset(iDCPred, 0, sizeof(iDCPred));
+    if (pJPEG->ucComponentsInScan > 1) // interleaved (DC only), whole MCUs
+    {
+        if (pJPEG->ucSubSample == 0x21 || pJPEG->ucSubSample == 0x22)
+            iH = 2;
+        if (pJPEG->ucSubSample == 0x12 || pJPEG->ucSubSample == 0x22)
+            iV = 2;
+        cx = pC->iBlocksX / iH;
+        cy = pC->iBlocksY / iV;
+    }
+    else // luma alone, in blocks up to the image edge
+    {
+        cx = (pJPEG->iWidth + 7) >> 3;
+        cy = (pJPEG->iHeight + 7) >> 3;
+    }
+    for (y = 0; y < cy && iErr == 0; y++)
+    {
+        for (x = 0; x < cx && iErr == 0; x++)
+        {
+            if (pJPEG->ucComponentsInScan > 1)
+            {
+                for (v = 0; v < iV; v++)
+                    for (h = 0; h < iH; h++)
+                        iErr |= JPEGDecodeBlockProg(pJPEG, pC, (y * iV + v) * pC->iBlocksX + x * iH + h, 0, &iDCPred[0]);
+                for (i = 1; i < pJPEG->ucNumComponents; i++)
+                {
+                    if (pJPEG->JPCI[i].component_needed)
+                        iErr |= JPEGDecodeBlockProg(pJPEG, pC, -1, i, &iDCPred[i]);
+                }
+            }
+            else
+            {
+                iErr = JPEGDecodeBlockProg(pJPEG, pC, y * pC->iBlocksX + x, 0, &iDCPred[0]);
+            }
+            if (pJPEG->iResInterval)
+            {
+                if (--pJPEG->iResCount == 0)
+                {
+                    pJPEG->iResCount = pJPEG->iResInterval;
+                    memset(iDCPred, 0, sizeof(iDCPred)); // reset DC predictors
+                    pC->iEOBRun = 0;
+                    if (pJPEG->bb.ulBitOff & 7) // need to start at the next even byte
+                    {
+                        pJPEG->bb.ulBitOff += (8 - (pJPEG->bb.ulBitOff & 7));
+                    }
+                }
+            }
+            pJPEG->iVLCOff = (int)(pJPEG->bb.pBuf - pJPEG->ucFileBuf);
+            if (pJPEG->iVLCOff > pJPEG->iVLCSize) // truncated file
+                iErr = 1;
+            // DC scans can be dense with RSTn markers, so the filtered data
+            // may not reach the high water mark
+            else if (pJPEG->iVLCOff >= FILE_HIGHWATER || (pJPEG->iVLCSize - pJPEG->iVLCOff < JPEG_FILE_BUF_SIZE - FILE_HIGHWATER &&
+                     pJPEG->JPEGFile.iPos < pJPEG->JPEGFile.iSize))
+                JPEGGetMoreData(pJPEG); // need more 'filtered' VLC data
+        } // for x
+    } // for y
+    return iErr;
+} /* JPEGDecodeScan() */
+//
+// Find the next marker at or after *piPos, stepping over entropy coded data
+// (stuffed zeros, RSTn and fill bytes). Returns it with *piPos at its length
+// field, or 0 at the end of the file
+//
+static int JPEGNextMarker(JPEGIMAGE *pJPEG, int *piPos)
+{
+    uint8_t *s = pJPEG->ucFileBuf;
+    int i, iLen, iPos = *piPos, bFF = 0;
+    
+    (*pJPEG->pfnSeek)(&pJPEG->JPEGFile, iPos);
+    while ((iLen = (*pJPEG->pfnRead)(&pJPEG->JPEGFile, s, JPEG_FILE_BUF_SIZE)) > 0)
+    {
+        for (i=0; i<iLen; i++)
+        {
+            if (bFF && s[i] != 0 && s[i] != 0xff && (s[i] < 0xd0 || s[i] > 0xd7))
+            {
+                *piPos = iPos + i + 1;
+                return 0xff00 | s[i];
+            }
+            bFF = (s[i] == 0xff);
+        }
+        iPos += iLen;
+    }
+    return 0;
+} /* JPEGNextMarker() */
+//
+// IDCT the luma coefficients and write them MCU by MCU, the way
+// DecodeJPEG() does; only MCUs in the clip rectangle are transformed.
+// iSize is pC->iSize as a constant, see JPEGPutCoeffsEPD()
+//
+static JPEG_ALWAYS_INLINE void JPEGPutCoeffsEPDSize(JPEGIMAGE *pJPEG, JPEGCOEFFS *pC, int iScaleShift, const int iSize)
+{
+    int x, y, h, v, i, k, cx, cy, iH = 1, iV = 1, mcuCX, mcuCY, iMaxFill, iQuant, iACFlags, iMCU;
+    int bContinue = 1;
+    int16_t *pSrc, *pMCU;
+    uint32_t l, *pl;
+    uint8_t c;
+    JPEGDRAW jd;
+    
+    if (pJPEG->ucSubSample == 0x21 || pJPEG->ucSubSample == 0x22)
+        iH = 2;
+    if (pJPEG->ucSubSample == 0x12 || pJPEG->ucSubSample == 0x22)
+        iV = 2;
+    cx = pC->iBlocksX / iH;
+    cy = pC->iBlocksY / iV;
+    mcuCX = (8 * iH) >> iScaleShift;
+    mcuCY = (8 * iV) >> iScaleShift;
+    iMaxFill = (iSize == 8) ? 16 : (iSize == 4) ? 4 : 1; // longs of output pixels per block
+    iQuant = pJPEG->sQuantTable[pJPEG->JPCI[0].quant_tbl_no * DCTSIZE]; // DC quant value
+    jd.iBpp = 4;
+    jd.pPixels = (uint16_t *)pJPEG->pFramebuffer;
+    jd.x = pJPEG->iXOffset;
+    jd.iWidth = cx * mcuCX;
+    jd.iHeight = mcuCY;
+    jd.y = pJPEG->iYOffset;
+    for (y = 0; y < cy && bContinue; y++, jd.y += mcuCY)
+    {
+        if (jd.y >= pJPEG->iClipBottom)
+            break; // nothing visible below
+        for (x = 0; x < cx && jd.y + mcuCY > pJPEG->iClipTop; x++)
+        {
+            if (jd.x + x * mcuCX + mcuCX <= pJPEG->iClipLeft || jd.x + x * mcuCX >= pJPEG->iClipRight)
+                continue;
+            for (v = 0; v < iV; v++)
+            {
+                for (h = 0; h < iH; h++)
+                {
+                    iMCU = (v * iH + h) * DCTSIZE; // Y blocks left to right then top to bottom
+                    pMCU = &pJPEG->sMCUs[iMCU];
+                    pSrc = &pC->pCoeffs[((y * iV + v) * pC->iBlocksX + x * iH + h) * pC->iStored];
+                    iACFlags = 0;
+                    for (k=1; k<pC->iStored; k++)
+                    {
+                        if (pSrc[k])
+                        {
+                            iACFlags |= 1 << (k % iSize); // occupied columns
+                            if (k / iSize >= 4) // and those with data below row 3
+                                iACFlags |= 1 << (8 + k % iSize);
+                        }
+                    }
+                    if (iACFlags == 0) // no AC components, save some time
+                    {
+                        pl = (uint32_t *)pMCU;
+                        c = ucRangeTable[((pSrc[0] * iQuant) >> 5) & 0x3ff];
+                        l = c | ((uint32_t) c << 8) | ((uint32_t) c << 16) | ((uint32_t) c << 24);
+                        for (i = 0; i<iMaxFill; i++)
+                            pl[i] = l;
+                    }
+                    else
+                    {
+                        if (iSize == 8)
+                            memcpy(pMCU, pSrc, DCTSIZE * sizeof(int16_t));
+                        else
+                            for (k=0; k<pC->iStored; k++)
+                                pMCU[(k / iSize) * 8 + k % iSize] = pSrc[k];
+                        JPEGIDCTSize(pJPEG, iSize, iMCU, pJPEG->JPCI[0].quant_tbl_no, iACFlags);
+                    }
+                }
+            }
+            JPEGPutMCUEPD(pJPEG, jd.x + x * mcuCX, jd.y);
+        } // for x
+        if (jd.y + mcuCY > (pJPEG->iHeight>>iScaleShift)) // last row needs to be trimmed
+            jd.iHeight = (pJPEG->iHeight>>iScaleShift) - jd.y;
+        if (pJPEG->pfnDraw) // optional for FOUR_BIT_EPD
+            bContinue = (*pJPEG->pfnDraw)(&jd);
+    } // for y
+} /* JPEGPutCoeffsEPDSize() */
+//
+// One copy of the output loop per stored block size, like DecodeJPEG()
+//
+static void JPEGPutCoeffsEPD(JPEGIMAGE *pJPEG, JPEGCOEFFS *pC, int iScaleShift)
+{
+    switch (pC->iSize)
+    {
+        case 8:
+            JPEGPutCoeffsEPDSize(pJPEG, pC, iScaleShift, 8);
+            break;
+        case 4:
+            JPEGPutCoeffsEPDSize(pJPEG, pC, iScaleShift, 4);
+            break;
+        case 2:
+            JPEGPutCoeffsEPDSize(pJPEG, pC, iScaleShift, 2);
+            break;
+        default: // DC only, no IDCT
+            JPEGPutCoeffsEPDSize(pJPEG, pC, iScaleShift, 1);
+            break;
+    }
+} /* JPEGPutCoeffsEPD() */
+//
+// Coefficient buffers are far too big for internal RAM on the ESP32
+//
+static void *JPEGAllocBuffer(int iSize)
+{
+    void *pBuffer;
+#ifdef ESP_PLATFORM
+    pBuffer = heap_caps_malloc(iSize, MALLOC_CAP_SPIRAM);
+    if (pBuffer == NULL) // no PSRAM
+        pBuffer = malloc(iSize);
+#else
+    pBuffer = malloc(iSize);
+#endif
+    return pBuffer;
+} /* JPEGAllocBuffer() */
+//
+// Walk the markers of a progressive image from the start of the file,
+// decoding every scan into a coefficient buffer laid out for these (scale)
+// options. Returns the buffer for the caller to free, NULL on errors
+//
+static void *JPEGReadProgressive(JPEGIMAGE *pJPEG, JPEGCOEFFS *pC, int iOptions)
+{
+    int i, iSize, iLen, iPos, iMarker, iErr = JPEG_SUCCESS;
+    uint8_t *s = pJPEG->ucFileBuf;
+    void *pBuffer;
+    
+    if ((pJPEG->ucNumComponents != 1 && pJPEG->ucNumComponents != 3) ||
+        (pJPEG->ucSubSample != 0 && pJPEG->ucSubSample != 0x11 && pJPEG->ucSubSample != 0x12 &&
+         pJPEG->ucSubSample != 0x21 && pJPEG->ucSubSample != 0x22))
+    {
+        pJPEG->iError = JPEG_UNSUPPORTED_FEATURE;
+        return NULL;
+    }
+    iSize = JPEGCoeffLayout(pJPEG, iOptions, pC);
+    pBuffer = JPEGAllocBuffer(iSize);
+    if (pBuffer == NULL)
+    {
+        pJPEG->iError = JPEG_ERROR_MEMORY;
+        return NULL;
+    }
+    memset(pBuffer, 0, iSize);
+    pC->pNonZero = NULL;
+    pC->pCoeffs = (int16_t *)pBuffer;
+    if (pC->iStored > 1) // the AC scans are decoded
+    {
+        pC->pNonZero = (uint64_t *)pBuffer;
+        pC->pCoeffs = (int16_t *)&pC->pNonZero[pC->iBlocksX * pC->iBlocksY];
+    }
+    iPos = 2; // after SOI
+    while (iErr == JPEG_SUCCESS && (iMarker = JPEGNextMarker(pJPEG, &iPos)) != 0 && iMarker != 0xffd9)
+    {
+        (*pJPEG->pfnSeek)(&pJPEG->JPEGFile, iPos);
+        if ((*pJPEG->pfnRead)(&pJPEG->JPEGFile, s, JPEG_FILE_BUF_SIZE) < 2)
+            break;
+        iLen = MOTOSHORT(s); // marker length
+        if (iLen < 2 || (iLen > JPEG_FILE_BUF_SIZE && (iMarker == 0xffc4 || iMarker == 0xffda)))
+        {
+            iErr = JPEG_DECODE_ERROR;
+            break;
+        }
+        switch (iMarker)
+        {
+            case 0xffc4: /* M_DHT */ // tables for the scans that follow
+                if (JPEGGetHuffTables(&s[2], iLen - 2, pJPEG) != 0)
+                    iErr = JPEG_DECODE_ERROR;
+                else if (!JPEGMakeHuffTables(pJPEG, 0))
+                    iErr = JPEG_UNSUPPORTED_FEATURE;
+                break;
+            case 0xffdd: // Restart Interval
+                if (iLen == 4)
+                    pJPEG->iResInterval = MOTOSHORT(&s[2]);
+                break;
+            case 0xffda: // SOS
+                i = 0;
+                if (JPEGGetSOS(pJPEG, &i) != 0 || JPEGDecodeScan(pJPEG, pC, iPos + iLen) != 0)
+                    iErr = JPEG_DECODE_ERROR;
+                break;
+        }
+        iPos += iLen; // the next marker, or the entropy coded data of a scan
+    }
+    pJPEG->iError = iErr;
+    if (iErr != JPEG_SUCCESS)
+    {
+        free(pBuffer);
+        return NULL;
+    }
+    return pBuffer;
+} /* JPEGReadProgressive() */
+//
+// Decode a progressive image into the FOUR_BIT_EPD framebuffer: collect
+// the coefficients, then write the image through JPEGPutMCUEPD()
+//
+static int JPEGDecodeProgressive(JPEGIMAGE *pJPEG)
+{
+    JPEGCOEFFS coeffs;
+    int iScaleShift = 0;
+    void *pBuffer;
+    
+    if (pJPEG->ucPixelType != FOUR_BIT_EPD)
+    {
+        pJPEG->iError = JPEG_UNSUPPORTED_FEATURE;
+        return 0;
+    }
+    if (pJPEG->iOptions & JPEG_SCALE_HALF)
+        iScaleShift = 1;
+    else if (pJPEG->iOptions & JPEG_SCALE_QUARTER)
+        iScaleShift = 2;
+    else if (pJPEG->iOptions & JPEG_SCALE_EIGHTH)
+        iScaleShift = 3;
+    pBuffer = JPEGReadProgressive(pJPEG, &coeffs, pJPEG->iOptions);
+    if (pBuffer == NULL)
+        return 0;
+    JPEGClipEPD(pJPEG, iScaleShift);
+    JPEGFixQuantD(pJPEG); // DQT must come before the frame header, no need to look for more
+    JPEGPutCoeffsEPD(pJPEG, &coeffs, iScaleShift);
+    free(pBuffer);
+    return 1;
+} /* JPEGDecodeProgressive() */
+//
+// Crop saliency
+// One byte per 8x8 luma block from the entropy decoded coefficients alone,
+// no IDCT: the two lowest AC terms give the texture of the block and its
+// DC against the neighbouring blocks gives the contrast of larger edges.
+// Quantization values are read in zigzag order, JPEGFixQuantD() has not
+// run on this handle
+//
+static void JPEGSaliencyBlock(uint8_t *pLevel, uint8_t *pMap, int iBlock, int iDC, int iAC01, int iAC10, const int16_t *pQuant)
+{
+    int i;
+    
+    i = ((iDC * pQuant[0]) >> 3) + 128; // mean of the block
+    pLevel[iBlock] = (uint8_t)((i < 0) ? 0 : (i > 255) ? 255 : i);
+    i = (abs(iAC01 * pQuant[1]) + abs(iAC10 * pQuant[2])) >> 2; // about the swing of the first cosines
+    pMap[iBlock] = (uint8_t)((i > 255) ? 255 : i);
+} /* JPEGSaliencyBlock() */
+//
+// Entropy decode a baseline image the way DecodeJPEG() does and score its
+// luma blocks; only the first coefficients are stored (JPEG_SCALE_QUARTER)
+//
+static int JPEGSaliencyBaseline(JPEGIMAGE *pJPEG, uint8_t *pLevel, uint8_t *pMap, int iMapW, int iMapH)
+{
+    int x, y, h, v, cx, cy, iH = 1, iV = 1, iErr = 0;
+    int iDCPred0 = 0, iDCPred1 = 0, iDCPred2 = 0;
+    const int16_t *pQuant = &pJPEG->sQuantTable[pJPEG->JPCI[0].quant_tbl_no * DCTSIZE];
+    int16_t *pMCU = &pJPEG->sMCUs[MCU0];
+    
+    pJPEG->iOptions = JPEG_SCALE_QUARTER;
+    pJPEG->bb.ulBits = MOTOLONG(&pJPEG->ucFileBuf[0]); // preload first 4 bytes
+    pJPEG->bb.pBuf = pJPEG->ucFileBuf;
+    pJPEG->bb.ulBitOff = 0;
+    if (pJPEG->ucSubSample == 0x21 || pJPEG->ucSubSample == 0x22)
+        iH = 2;
+    if (pJPEG->ucSubSample == 0x12 || pJPEG->ucSubSample == 0x22)
+        iV = 2;
+    cx = (pJPEG->iWidth + 8 * iH - 1) / (8 * iH); // number of MCU blocks
+    cy = (pJPEG->iHeight + 8 * iV - 1) / (8 * iV);
+    pJPEG->iResCount = pJPEG->iResInterval;
+    for (y = 0; y < cy && iErr == 0; y++)
+    {
+        for (x = 0; x < cx && iErr == 0; x++)
+        {
+            pJPEG->ucACTable = pJPEG->JPCI[0].ac_tbl_no;
+            pJPEG->ucDCTable = pJPEG->JPCI[0].dc_tbl_no;
+            for (v = 0; v < iV; v++)
+            {
+                for (h = 0; h < iH; h++)
+                {
+                    iErr |= JPEGDecodeMCU(pJPEG, MCU0, &iDCPred0);
+                    if (x * iH + h < iMapW && y * iV + v < iMapH) // not padding
+                        JPEGSaliencyBlock(pLevel, pMap, (y * iV + v) * iMapW + x * iH + h, pMCU[0], pMCU[1], pMCU[8], pQuant);
+                }
+            }
+            if (pJPEG->ucNumComponents == 3) // chroma only keeps the bitstream in step
+            {
+                pJPEG->ucACTable = pJPEG->JPCI[1].ac_tbl_no;
+                pJPEG->ucDCTable = pJPEG->JPCI[1].dc_tbl_no;
+                iErr |= JPEGDecodeMCU(pJPEG, MCU1, &iDCPred1);
+                pJPEG->ucACTable = pJPEG->JPCI[2].ac_tbl_no;
+                pJPEG->ucDCTable = pJPEG->JPCI[2].dc_tbl_no;
+                iErr |= JPEGDecodeMCU(pJPEG, MCU1, &iDCPred2);
+            }
+            if (pJPEG->iResInterval)
+            {
+                if (--pJPEG->iResCount == 0)
+                {
+                    pJPEG->iResCount = pJPEG->iResInterval;
+                    iDCPred0 = iDCPred1 = iDCPred2 = 0; // reset DC predictors
+                    if (pJPEG->bb.ulBitOff & 7) // need to start at the next even byte
+                    {
+                        pJPEG->bb.ulBitOff += (8 - (pJPEG->bb.ulBitOff & 7));
+                    }
+                }
+            }
+            if (pJPEG->iVLCOff >= FILE_HIGHWATER)
+                JPEGGetMoreData(pJPEG); // need more 'filtered' VLC data
+        } // for x
+    } // for y
+    return (iErr == 0);
+} /* JPEGSaliencyBaseline() */
+//
+// Fill pMap with the saliency of each luma block, progressive images from
+// their 1/4 scale coefficient buffer
+//
+static int JPEGSaliency(JPEGIMAGE *pJPEG, uint8_t *pMap)
+{
+    JPEGCOEFFS coeffs;
+    int x, y, i, c, l, iMapW, iMapH, bOK = 1;
+    const int16_t *pSrc, *pQuant = &pJPEG->sQuantTable[pJPEG->JPCI[0].quant_tbl_no * DCTSIZE];
+    uint8_t *pLevel;
+    void *pBuffer;
+    
+    if ((pJPEG->ucNumComponents != 1 && pJPEG->ucNumComponents != 3) ||
+        (pJPEG->ucSubSample != 0 && pJPEG->ucSubSample != 0x11 && pJPEG->ucSubSample != 0x12 &&
+         pJPEG->ucSubSample != 0x21 && pJPEG->ucSubSample != 0x22))
+    {
+        pJPEG->iError = JPEG_UNSUPPORTED_FEATURE;
+        return 0;
+    }
+    iMapW = (pJPEG->iWidth + 7) >> 3;
+    iMapH = (pJPEG->iHeight + 7) >> 3;
+    pLevel = (uint8_t *)JPEGAllocBuffer(iMapW * iMapH);
+    if (pLevel == NULL)
+    {
+        pJPEG->iError = JPEG_ERROR_MEMORY;
+        return 0;
+    }
+    if (pJPEG->ucMode == 0xc2)
+    {
+        pBuffer = JPEGReadProgressive(pJPEG, &coeffs, JPEG_SCALE_QUARTER);
+        bOK = (pBuffer != NULL);
+        for (y = 0; y < iMapH && bOK; y++)
+        {
+            for (x = 0; x < iMapW; x++)
+            {
+                pSrc = &coeffs.pCoeffs[(y * coeffs.iBlocksX + x) * coeffs.iStored]; // 2x2, DC first
+                JPEGSaliencyBlock(pLevel, pMap, y * iMapW + x, pSrc[0], pSrc[1], pSrc[2], pQuant);
+            }
+        }
+        free(pBuffer);
+    }
+    else
+    {
+        bOK = JPEGSaliencyBaseline(pJPEG, pLevel, pMap, iMapW, iMapH);
+        pJPEG->iError = bOK ? JPEG_SUCCESS : JPEG_DECODE_ERROR;
+    }
+    for (y = 0; y < iMapH && bOK; y++)
+    {
+        for (x = 0; x < iMapW; x++)
+        {
+            i = y * iMapW + x;
+            l = pLevel[i];
+            c = 0;
+            if (x > 0)
+                c += abs(l - pLevel[i - 1]);
+            if (x < iMapW - 1)
+                c += abs(l - pLevel[i + 1]);
+            if (y > 0)
+                c += abs(l - pLevel[i - iMapW]);
+            if (y < iMapH - 1)
+                c += abs(l - pLevel[i + iMapW]);
+            c = pMap[i] + (c >> 1);
+            pMap[i] = (uint8_t)((c > 255) ? 255 : c);
+        }
+    }
+    free(pLevel);
+    return bOK;
+} /* JPEGSaliency() */
+
+#ifdef JPEG_PARALLEL
+//
+// Two-worker decoding for images with restart markers
+// The entropy coded data after an RSTn marker decodes on its own (DC
+// predictors start from 0 again), so the MCU rows after the marker that
+// starts the row closest to the middle go to a second worker with its own
+// copy of the decoder state. Each worker writes its own band of the
+// framebuffer.
+//
+typedef struct jpeg_worker_tag
+{
+    JPEGIMAGE *pJPEG;
+    int iResult;
+#ifdef ESP_PLATFORM
+    SemaphoreHandle_t done;
+#else
+    pthread_t thread;
+#endif
+} JPEGWORKER;
+
+#ifdef ESP_PLATFORM
+#define JPEG_WORKER_STACK 4096
+
+static void *JPEGLockCreate(void)
+{
+    return (void *)xSemaphoreCreateMutex();
+}
+static void JPEGLockDelete(void *pLock)
+{
+    vSemaphoreDelete((SemaphoreHandle_t)pLock);
+}
+static void JPEGLock(void *pLock)
+{
+    xSemaphoreTake((SemaphoreHandle_t)pLock, portMAX_DELAY);
+}
+static void JPEGUnlock(void *pLock)
+{
+    xSemaphoreGive((SemaphoreHandle_t)pLock);
+}
+static JPEGIMAGE *JPEGAllocImage(void)
+{
+    // Huffman tables and MCUs are faster in internal RAM
+    JPEGIMAGE *pJPEG = (JPEGIMAGE *)heap_caps_malloc(sizeof(JPEGIMAGE), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (pJPEG == NULL)
+        pJPEG = (JPEGIMAGE *)malloc(sizeof(JPEGIMAGE));
+    return pJPEG;
+}
+static void JPEGWorkerTask(void *pArg)
+{
+    JPEGWORKER *pWorker = (JPEGWORKER *)pArg;
+    pWorker->iResult = DecodeJPEG(pWorker->pJPEG);
+    xSemaphoreGive(pWorker->done);
+    vTaskDelete(NULL);
+}
+// runs the worker on the other core
+static int JPEGWorkerStart(JPEGWORKER *pWorker)
+{
+    pWorker->done = xSemaphoreCreateBinary();
+    if (pWorker->done == NULL)
+        return 0;
+    if (xTaskCreatePinnedToCore(JPEGWorkerTask, "jpeg_worker", JPEG_WORKER_STACK, pWorker,
+                                uxTaskPriorityGet(NULL), NULL, !xPortGetCoreID()) != pdPASS)
+    {
+        vSemaphoreDelete(pWorker->done);
+        return 0;
+    }
+    return 1;
+}
+static void JPEGWorkerJoin(JPEGWORKER *pWorker)
+{
+    xSemaphoreTake(pWorker->done, portMAX_DELAY);
+    vSemaphoreDelete(pWorker->done);
+}
+#else // pthreads
+static void *JPEGLockCreate(void)
+{
+    pthread_mutex_t *pMutex = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+    if (pMutex && pthread_mutex_init(pMutex, NULL) != 0)
+    {
+        free(pMutex);
+        pMutex = NULL;
+    }
+    return pMutex;
+}
+static void JPEGLockDelete(void *pLock)
+{
+    pthread_mutex_destroy((pthread_mutex_t *)pLock);
+    free(pLock);
+}
+static void JPEGLock(void *pLock)
+{
+    pthread_mutex_lock((pthread_mutex_t *)pLock);
+}
+static void JPEGUnlock(void *pLock)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)pLock);
+}
+static JPEGIMAGE *JPEGAllocImage(void)
+{
+    return (JPEGIMAGE *)malloc(sizeof(JPEGIMAGE));
+}
+static void *JPEGWorkerThread(void *pArg)
+{
+    JPEGWORKER *pWorker = (JPEGWORKER *)pArg;
+    pWorker->iResult = DecodeJPEG(pWorker->pJPEG);
+    return NULL;
+}
+static int JPEGWorkerStart(JPEGWORKER *pWorker)
+{
+    return pthread_create(&pWorker->thread, NULL, JPEGWorkerThread, pWorker) == 0;
+}
+static void JPEGWorkerJoin(JPEGWORKER *pWorker)
+{
+    pthread_join(pWorker->thread, NULL);
+}
+#endif // ESP_PLATFORM
+//
+// Pick the MCU row to split rows [0, cy) at and find the file offset of its
+// data. Returns the row, or 0 when no restart marker starts a row
+//
+static int JPEGFindSplit(JPEGIMAGE *pJPEG, int cx, int cy, int *piOffset)
+{
+    int i, iLen, iPos, iRow, iBest, iMarker, iTarget;
+    uint8_t *pBuf = (uint8_t *)pJPEG->usPixels; // unused by FOUR_BIT_EPD
+    uint8_t bFF;
+    JPEGFILE file;
+
+    iBest = 0;
+    for (iRow=1; iRow<cy; iRow++)
+    {
+        if (((iRow * cx) % pJPEG->iResInterval) == 0 && (iBest == 0 || abs(iRow*2 - cy) < abs(iBest*2 - cy)))
+            iBest = iRow;
+    }
+    if (iBest == 0)
+        return 0;
+    // count the RSTn markers in the raw data, with our own file position
+    iTarget = (iBest * cx) / pJPEG->iResInterval;
+    iMarker = 0;
+    bFF = 0;
+    file = pJPEG->JPEGFile;
+    iPos = pJPEG->iVLCStart;
+    (*pJPEG->pfnSeek)(&file, iPos);
+    while (iMarker < iTarget && (iLen = (*pJPEG->pfnRead)(&file, pBuf, sizeof(pJPEG->usPixels))) > 0)
+    {
+        for (i=0; i<iLen && iMarker < iTarget; i++)
+        {
+            if (bFF)
+            {
+                bFF = (pBuf[i] == 0xff); // fill bytes before a marker
+                if (pBuf[i] >= 0xd0 && pBuf[i] <= 0xd7 && ++iMarker == iTarget)
+                    *piOffset = iPos + i + 1;
+            }
+            else if (pBuf[i] == 0xff)
+                bFF = 1;
+        }
+        iPos += iLen;
+    }
+    (*pJPEG->pfnSeek)(&pJPEG->JPEGFile, pJPEG->JPEGFile.iPos); // shared handles
+    return (iMarker == iTarget) ? iBest : 0;
+} /* JPEGFindSplit() */
+
+static int JPEGDecodeParallel(JPEGIMAGE *pJPEG)
+{
+    int cx, cy, mcuCX, mcuCY, iShift, iRow, iRowEnd, iOffset = 0, iSplitY, iDeferRow, iPanelX, bOK;
+    void *pLock;
+    JPEGIMAGE *pSecond;
+    JPEGWORKER worker;
+
+    if (pJPEG->ucPixelType != FOUR_BIT_EPD || pJPEG->iResInterval == 0 || (pJPEG->iOptions & JPEG_EXIF_THUMBNAIL))
+        return DecodeJPEG(pJPEG);
+    switch (pJPEG->ucSubSample)
+    {
+        case 0x12:
+            mcuCX = 8; mcuCY = 16;
+            break;
+        case 0x21:
+            mcuCX = 16; mcuCY = 8;
+            break;
+        case 0x22:
+            mcuCX = mcuCY = 16;
+            break;
+        default:
+            mcuCX = mcuCY = 8;
+            break;
+    }
+    iShift = 0;
+    if (pJPEG->iOptions & JPEG_SCALE_HALF)
+        iShift = 1;
+    else if (pJPEG->iOptions & JPEG_SCALE_QUARTER)
+        iShift = 2;
+    else if (pJPEG->iOptions & JPEG_SCALE_EIGHTH)
+        iShift = 3;
+    cx = (pJPEG->iWidth + mcuCX - 1) / mcuCX;
+    cy = (pJPEG->iHeight + mcuCY - 1) / mcuCY;
+    JPEGClipEPD(pJPEG, iShift);
+    // decoding stops after the last row on the display, split what is left
+    iRowEnd = (pJPEG->iClipBottom - pJPEG->iYOffset + (mcuCY >> iShift) - 1) / (mcuCY >> iShift);
+    if (iRowEnd > cy)
+        iRowEnd = cy;
+    iRow = JPEGFindSplit(pJPEG, cx, iRowEnd, &iOffset);
+    if (iRow == 0)
+        return DecodeJPEG(pJPEG);
+    iSplitY = pJPEG->iYOffset + iRow * (mcuCY >> iShift);
+    // When a source row is a panel column the rows either side of the split
+    // can share bytes, so the first worker's last row waits
+    iDeferRow = JPEG_NO_ROW;
+    iPanelX = pJPEG->iPanelX + (iSplitY - 1 - pJPEG->iYOffset) * pJPEG->iColDX;
+    if (pJPEG->iColDX < 0)
+        iPanelX--; // the lower x of the two rows
+    if (pJPEG->iRowDX == 0 && (iPanelX & 1) == 0 && iSplitY > pJPEG->iClipTop && iSplitY < pJPEG->iClipBottom)
+    {
+        if (pJPEG->iClipRight - pJPEG->iClipLeft > (int)sizeof(pJPEG->usPixels))
+            return DecodeJPEG(pJPEG);
+        iDeferRow = iSplitY - 1;
+    }
+    pSecond = JPEGAllocImage();
+    if (pSecond == NULL)
+        return DecodeJPEG(pJPEG);
+    pLock = JPEGLockCreate();
+    if (pLock == NULL)
+    {
+        free(pSecond);
+        return DecodeJPEG(pJPEG);
+    }
+    memcpy(pSecond, pJPEG, sizeof(JPEGIMAGE));
+    pJPEG->pFileLock = pSecond->pFileLock = pLock;
+    pJPEG->iRowStart = 0;
+    pJPEG->iRowEnd = iRow;
+    pJPEG->iDeferRow = iDeferRow;
+    if (pJPEG->iClipBottom > iSplitY)
+        pJPEG->iClipBottom = iSplitY;
+    pSecond->iRowStart = iRow;
+    pSecond->iRowEnd = cy;
+    if (pSecond->iClipTop < iSplitY)
+        pSecond->iClipTop = iSplitY;
+    // the second worker starts right after the RSTn marker
+    pSecond->JPEGFile.iPos = iOffset;
+    pSecond->iVLCOff = pSecond->iVLCSize = 0;
+    pSecond->ucFF = 0;
+    JPEGGetMoreData(pSecond);
+    worker.pJPEG = pSecond;
+    if (JPEGWorkerStart(&worker))
+    {
+        bOK = DecodeJPEG(pJPEG);
+        JPEGWorkerJoin(&worker);
+        bOK = bOK && worker.iResult;
+        if (pSecond->iError != JPEG_SUCCESS)
+            pJPEG->iError = pSecond->iError;
+    }
+    else // no second worker, decode the rest here
+    {
+        bOK = DecodeJPEG(pJPEG);
+        bOK = DecodeJPEG(pSecond) && bOK;
+        if (pSecond->iError != JPEG_SUCCESS)
+            pJPEG->iError = pSecond->iError;
+    }
+    if (iDeferRow != JPEG_NO_ROW) // both bands are done, write the shared row
+    {
+        pJPEG->iDeferRow = JPEG_NO_ROW;
+        JPEGRowEPD(pJPEG, (uint8_t *)pJPEG->usPixels, pJPEG->iClipRight - pJPEG->iClipLeft, pJPEG->iClipLeft, iDeferRow);
+    }
+    pJPEG->pFileLock = NULL;
+    pJPEG->iRowStart = pJPEG->iRowEnd = 0;
+    JPEGLockDelete(pLock);
+    free(pSecond);
+    return bOK;
+} /* JPEGDecodeParallel() */
+#endif // JPEG_PARALLEL
@@ -0,0 +1,221 @@
+#include "clock_render.h"
+#include "font_cache.h"
+#include <sys/param.h>
+
+const static char *TAG = "clock_render";
+
+static bool rect_empty(EpdRect r) {
+    return r.width <= 0 || r.height <= 0;
+}
+
+static bool rect_intersects(EpdRect a, EpdRect b) {
+    return !rect_empty(a) && !rect_empty(b) &&
+        a.x < b.x + b.width && b.x < a.x + a.width &&
+        a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+static EpdRect rect_union(EpdRect a, EpdRect b) {
+    if (rect_empty(a)) return b;
+    if (rect_empty(b)) return a;
+    int x0 = MIN(a.x, b.x), y0 = MIN(a.y, b.y);
+    int x1 = MAX(a.x + a.width, b.x + b.width), y1 = MAX(a.y + a.height, b.y + b.height);
+    return (EpdRect){.x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0};
+}
+
+// same mapping epd_draw_pixel applies for the current rotation
+static void rotate_point(int *x, int *y) {
+    int tmp;
+    switch (epd_get_rotation()) {
+        case EPD_ROT_LANDSCAPE:
+            break;
+        case EPD_ROT_INVERTED_LANDSCAPE:
+            *x = epd_width() - *x - 1;
+            *y = epd_height() - *y - 1;
+            break;
+        case EPD_ROT_PORTRAIT:
+            tmp = *x;
+            *x = epd_width() - *y - 1;
+            *y = tmp;
+            break;
+        case EPD_ROT_INVERTED_PORTRAIT:
+            tmp = *x;
+            *x = *y;
+            *y = epd_height() - tmp - 1;
+            break;
+    }
+}
+
+// copy pixels [x0, x1) of a 4bpp row, even x in the low nibble
+static void copy_row(uint8_t *dst, const uint8_t *src, int x0, int x1) {
+    if (x0 & 1) {
+        dst[x0 / 2] = (dst[x0 / 2] & 0x0F) | (src[x0 / 2] & 0xF0);
+        x0++;
+    }
+    if (x1 & 1) {
+        x1--;
+        dst[x1 / 2] = (dst[x1 / 2] & 0xF0) | (src[x1 / 2] & 0x0F);
+    }
+    if (x1 > x0) {
+        memcpy(dst + x0 / 2, src + x0 / 2, (x1 - x0) / 2);
+    }
+}
+
+// restore a rotated-coordinate rectangle of `fb' from `bg'
+static void restore_rect(uint8_t *fb, const uint8_t *bg, EpdRect area) {
+    int x0 = MAX(area.x, 0), y0 = MAX(area.y, 0);
+    int x1 = MIN(area.x + area.width, epd_rotated_display_width()) - 1;
+    int y1 = MIN(area.y + area.height, epd_rotated_display_height()) - 1;
+    if (x1 < x0 || y1 < y0) {
+        return;
+    }
+    rotate_point(&x0, &y0);
+    rotate_point(&x1, &y1);
+    int pitch = epd_width() / 2;
+    for (int y = MIN(y0, y1); y <= MAX(y0, y1); y++) {
+        copy_row(fb + y * pitch, bg + y * pitch, MIN(x0, x1), MAX(x0, x1) + 1);
+    }
+}
+
+// digits get cells of equal width so a tick does not shift its neighbours
+static int layout(clock_renderer *r, const EpdFont *font, const char *text, clock_cell *cells) {
+    int count = 0;
+    int width = 0;
+    for (const char *c = text; *c && count < CLOCK_TEXT_MAX; c++) {
+        const EpdGlyph *glyph = epd_get_glyph(font, (uint8_t)*c);
+        if (!glyph) {
+            ESP_LOGW(TAG, "No glyph for '%c'", *c);
+            continue;
+        }
+        int advance = glyph->advance_x;
+        int pen_x = width;
+        if (*c >= '0' && *c <= '9' && r->digit_advance > advance) {
+            pen_x += (r->digit_advance - advance) / 2;
+            advance = r->digit_advance;
+        }
+        cells[count].c = *c;
+        cells[count].pen_x = pen_x;
+        cells[count].rect = (EpdRect){
+            .x = pen_x + glyph->left,
+            .y = r->y - glyph->top,
+            .width = glyph->width,
+            .height = glyph->height,
+        };
+        width += advance;
+        count++;
+    }
+    for (int i = 0; i < count; i++) {
+        cells[i].pen_x += r->x - width / 2;
+        cells[i].rect.x += r->x - width / 2;
+    }
+    return count;
+}
+
+static void draw_cell(clock_renderer *r, const EpdFont *font, const clock_cell *cell, uint8_t *fb, uint8_t *bg) {
+    char str[2] = {cell->c, 0};
+    int x = cell->pen_x;
+    int y = r->y;
+    EpdFontProperties props = r->props;
+    props.bg = bg;
+    epd_write_string(font, str, &x, &y, fb, &props);
+}
+
+void clock_render_init(clock_renderer *r, const EpdFont *font, EpdFontProperties props, int x, int y) {
+    r->font = font;
+    r->props = props;
+    // cells are placed here, the renderer itself draws left aligned
+    r->props.flags &= ~(EPD_DRAW_ALIGN_CENTER | EPD_DRAW_ALIGN_RIGHT);
+    r->x = x;
+    r->y = y;
+    r->digit_advance = 0;
+    for (char c = '0'; c <= '9'; c++) {
+        const EpdGlyph *glyph = epd_get_glyph(font, c);
+        if (glyph && glyph->advance_x > r->digit_advance) {
+            r->digit_advance = glyph->advance_x;
+        }
+    }
+    clock_render_reset(r);
+}
+
+void clock_render_reset(clock_renderer *r) {
+    r->count = -1;
+}
+
+int clock_render_draw(clock_renderer *r, const char *text, uint8_t *fb, uint8_t *bg, EpdRect *dirty, int max_dirty) {
+    const EpdFont *font = font_cache_get(r->font, text);
+    clock_cell cells[CLOCK_TEXT_MAX];
+    int count = layout(r, font, text, cells);
+    bool changed[CLOCK_TEXT_MAX] = {false};
+    bool stale[CLOCK_TEXT_MAX] = {false};
+    EpdRect restored[CLOCK_TEXT_MAX * 2];
+    int restored_count = 0;
+
+    // a cell is unchanged when the same glyph sits at the same pen position
+    for (int i = 0; i < count; i++) {
+        changed[i] = true;
+        for (int j = 0; j < r->count; j++) {
+            if (cells[i].c == r->cells[j].c && cells[i].pen_x == r->cells[j].pen_x) {
+                changed[i] = false;
+                break;
+            }
+        }
+    }
+    for (int j = 0; j < r->count; j++) {
+        stale[j] = true;
+        for (int i = 0; i < count; i++) {
+            if (!changed[i] && cells[i].c == r->cells[j].c && cells[i].pen_x == r->cells[j].pen_x) {
+                stale[j] = false;
+                break;
+            }
+        }
+        if (stale[j] && !rect_empty(r->cells[j].rect)) {
+            restored[restored_count++] = r->cells[j].rect;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (changed[i] && !rect_empty(cells[i].rect)) {
+            restored[restored_count++] = cells[i].rect;
+        }
+    }
+    // nothing drawn yet means `fb' already shows the background
+    if (r->count >= 0) {
+        for (int k = 0; k < restored_count; k++) {
+            restore_rect(fb, bg, restored[k]);
+        }
+    }
+    // redraw changed cells and unchanged neighbours clipped by a restore
+    int redrawn = 0;
+    for (int i = 0; i < count; i++) {
+        bool draw = changed[i];
+        for (int k = 0; !draw && k < restored_count; k++) {
+            draw = rect_intersects(cells[i].rect, restored[k]);
+        }
+        if (draw) {
+            draw_cell(r, font, &cells[i], fb, bg);
+            redrawn++;
+        }
+    }
+    memcpy(r->cells, cells, sizeof(cells[0]) * count);
+    r->count = count;
+
+    int dirty_count = 0;
+    for (int k = 0; k < restored_count && dirty && max_dirty > 0; k++) {
+        // old and new glyph of the same cell overlap, report them as one
+        int merged = -1;
+        for (int d = 0; d < dirty_count && merged < 0; d++) {
+            if (rect_intersects(dirty[d], restored[k])) {
+                merged = d;
+            }
+        }
+        if (merged < 0 && dirty_count == max_dirty) {
+            // out of slots, fold into the last one
+            merged = max_dirty - 1;
+        }
+        if (merged >= 0) {
+            dirty[merged] = rect_union(dirty[merged], restored[k]);
+        } else {
+            dirty[dirty_count++] = restored[k];
+        }
+    }
+    ESP_LOGI(TAG, "Draw \"%s\": %d of %d glyphs, %d dirty areas", text, redrawn, count, dirty_count);
+    return dirty_count;
+}
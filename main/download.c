@@ -0,0 +1,302 @@
+#include "download.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "flash_writer.h"
+#include "settings.h"
+#include "time_sync.h"
+
+static const char *TAG = "download";
+
+download_resume resume = {0};
+date_check date_sync = {0};
+
+void download_resume_reset(void) {
+    memset(&resume, 0, sizeof(resume));
+}
+
+bool download_resuming(void) {
+    return resume.received > 0 && resume.range_validator[0] && resume.url[0];
+}
+
+static void date_check_header(const char *value, int64_t sent_us) {
+    time_t date;
+    if (!sent_us || http_date_parse(value, &date) != ESP_OK) {
+        return;
+    }
+    int64_t rtt_us = esp_timer_get_time() - sent_us;
+    // keep the sample with the shortest round trip
+    if (rtt_us > TIME_DATE_MAX_RTT_MS * 1000LL || (date_sync.valid && rtt_us >= date_sync.rtt_us)) {
+        return;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    // `Date' is truncated to the second and stamped about half a round trip ago
+    int64_t server_us = date * 1000000LL + 500000LL + rtt_us / 2;
+    date_sync.offset_us = server_us - ((int64_t)tv.tv_sec * 1000000LL + tv.tv_usec);
+    date_sync.rtt_us = rtt_us;
+    date_sync.valid = true;
+}
+
+esp_err_t download_request_format(char *buf, size_t len, const char *url, bool resuming,
+                                  const char *revalidate, const char *headers) {
+    const char *authority = strstr(url, "://");
+    authority = authority ? authority + 3 : url;
+    int n = snprintf(buf, len,
+                     "GET %s HTTP/1.1\r\n"
+                     "Host: %.*s\r\n"
+                     "User-Agent: esp-idf/1.0 esp32\r\n"
+                     // a conversion proxy may answer with a frame for this display
+                     "Accept: " NATIVE_FRAME_CONTENT_TYPE ", image/*;q=0.8\r\n"
+                     "%s",
+                     http_url_path(url), (int)strcspn(authority, "/?#"), authority, headers);
+    if (resuming) {
+        // full body instead of a range if the resource changed meanwhile
+        n += snprintf(buf + MIN(n, len), len - MIN(n, len),
+                      "Range: bytes=%" PRIu32 "-\r\n"
+                      "If-Range: %s\r\n",
+                      resume.received, resume.range_validator);
+        ESP_LOGI(TAG, "Resuming %s from %" PRIu32 " bytes", url, resume.received);
+    } else if (revalidate) {
+        // same quoting rules as `If-Range'
+        bool etag = revalidate[0] == '"' || strncmp(revalidate, "W/", 2) == 0;
+        n += snprintf(buf + MIN(n, len), len - MIN(n, len), "%s: %s\r\n",
+                      etag ? "If-None-Match" : "If-Modified-Since", revalidate);
+    }
+    // the response ends with the connection, nothing else is sent on it
+    n += snprintf(buf + MIN(n, len), len - MIN(n, len), "Connection: close\r\n\r\n");
+    if (n >= len) {
+        ESP_LOGE(TAG, "Request for %s longer than %d bytes", url, len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+void download_response_init(download_response *r, const char *url, const char *file) {
+    memset(r, 0, sizeof(*r));
+    r->url = url;
+    r->file = file;
+    http_stream_init(&r->stream, download_on_header, download_on_body, r);
+    resume.pending[0] = 0;
+    resume.pending_range[0] = 0;
+    resume.range_start = 0;
+    resume.pending_native = false;
+}
+
+esp_err_t download_on_header(void *ctx, const char *key, const char *value) {
+    download_response *r = ctx;
+    ESP_LOGI(TAG, "%s: %s", key, value);
+    // validators to revalidate with, ETag preferred
+    if (strcasecmp(key, "ETag") == 0 ||
+        (strcasecmp(key, "Last-Modified") == 0 && resume.pending[0] != '"' &&
+         strncmp(resume.pending, "W/", 2) != 0)) {
+        strlcpy(resume.pending, value, sizeof(resume.pending));
+    }
+    // and to resume with, `If-Range' takes no weak ETag (RFC 9110 13.1.5)
+    if ((strcasecmp(key, "ETag") == 0 && value[0] == '"') ||
+        (strcasecmp(key, "Last-Modified") == 0 && resume.pending_range[0] != '"')) {
+        strlcpy(resume.pending_range, value, sizeof(resume.pending_range));
+    }
+    if (strcasecmp(key, "Date") == 0) {
+        date_check_header(value, r->stream.sent_us);
+    }
+    if (strcasecmp(key, "Content-Type") == 0) {
+        resume.pending_native = strncasecmp(value, NATIVE_FRAME_CONTENT_TYPE,
+                                            strlen(NATIVE_FRAME_CONTENT_TYPE)) == 0;
+    }
+    if (strcasecmp(key, "Content-Range") == 0) {
+        // bytes <start>-<end>/<total>
+        unsigned long start = 0, end = 0, total = 0;
+        if (sscanf(value, "bytes %lu-%lu/%lu", &start, &end, &total) >= 2) {
+            resume.range_start = start;
+            resume.total = total;
+        }
+    }
+    if (strcasecmp(key, "Location") == 0) {
+        strlcpy(r->location, value, sizeof(r->location));
+    }
+    return ESP_OK;
+}
+
+// First body bytes of the response, decides where they go
+static void download_open(download_response *r) {
+    int status = r->stream.status;
+    const char *mode = "wb";
+    if (status == 206 && resume.received > 0 && resume.range_start == resume.received) {
+        // server honoured `Range', append to what we have
+        mode = "ab";
+    } else if (status == 200) {
+        resume.received = 0;
+        resume.total = r->stream.content_length > 0 ? r->stream.content_length : 0;
+        resume.native = resume.pending_native;
+        resume.header_len = 0;
+    } else {
+        // redirect or error bodies are not the image
+        ESP_LOGW(TAG, "Ignoring body of status %d", status);
+        if (status == 206) {
+            // not the range we asked for, start over next time
+            download_resume_reset();
+        }
+        r->skip_body = true;
+        return;
+    }
+    if (status == 200) {
+        strlcpy(resume.validator, resume.pending, sizeof(resume.validator));
+        strlcpy(resume.range_validator, resume.pending_range, sizeof(resume.range_validator));
+    }
+    strlcpy(resume.url, r->url, sizeof(resume.url));
+    r->time_start = esp_timer_get_time();
+    r->opened = true;
+    ESP_LOGI(TAG, "Opening file %s for writing (%s) at %" PRIu32, r->file, mode, resume.received);
+    if (flash_writer_open(r->file, mode) != ESP_OK) {
+        ESP_LOGE(__func__, "Failed to open file for writing");
+        r->failed = true;
+    }
+}
+
+esp_err_t download_on_body(void *ctx, const uint8_t *body, size_t body_len) {
+    download_response *r = ctx;
+    if (!r->opened && !r->skip_body) {
+        download_open(r);
+    }
+    if (r->skip_body) {
+        return ESP_OK;
+    }
+    if (++r->on_data_cnt % 10 == 0 && r->stream.content_length > 0) {
+        ESP_LOGI(TAG, "%" PRIu32 " len:%d %d%%", r->on_data_cnt, body_len,
+                 (int)(r->stream.received * 100 / r->stream.content_length));
+    }
+    if (resume.native && resume.header_len < sizeof(resume.header) && !r->failed) {
+        // the frame header is checked, the zlib stream after it is the stored image
+        size_t n = MIN(body_len, sizeof(resume.header) - resume.header_len);
+        memcpy((uint8_t*)&resume.header + resume.header_len, body, n);
+        resume.header_len += n;
+        resume.received += n;
+        body += n;
+        body_len -= n;
+        if (resume.header_len == sizeof(resume.header) && fb_frame_header_check(&resume.header) != ESP_OK) {
+            r->failed = true;
+        }
+    }
+    // Queue received data for the flash writer task
+    if (!r->failed && body_len) {
+        if (flash_writer_write(body, body_len) != ESP_OK) {
+            ESP_LOGE(__func__, "Writing %d bytes failed", body_len);
+            r->failed = true;
+        } else {
+            resume.received += body_len;
+        }
+    }
+    // the rest of the body is still read, the connection ends with it
+    return ESP_OK;
+}
+
+esp_err_t download_response_finish(download_response *r, esp_err_t err) {
+    if (r->opened && flash_writer_is_open()) {
+        // wait for the ring to drain
+        if (flash_writer_close() != ESP_OK) {
+            r->failed = true;
+        }
+    }
+    if (r->failed) {
+        ESP_LOGE(__func__, "Download failed, deleting file");
+        unlink(r->file);
+        download_resume_reset();
+        return ESP_FAIL;
+    }
+    if (err != ESP_OK) {
+        // what was written is kept for the next attempt to resume
+        return err;
+    }
+    if (r->stream.status == 304) {
+        return ESP_OK;
+    }
+    if (!r->opened) {
+        ESP_LOGE(__func__, "No image in the response, status %d", r->stream.status);
+        return ESP_FAIL;
+    }
+    if (resume.total && resume.received != resume.total) {
+        ESP_LOGW(TAG, "Body incomplete, %" PRIu32 " of %" PRIu32 " bytes", resume.received, resume.total);
+        return ESP_FAIL;
+    }
+    int64_t time_download = (esp_timer_get_time() - r->time_start) / 1000;
+    if (time_download) {
+        ESP_LOGI(TAG, "%" PRIu32 "KiB in %lld ms, %.3lfKiB/s", resume.received / 1024, time_download,
+                 (double)resume.received * 1000 / 1024 / time_download);
+    }
+    ESP_LOGI(TAG, "Download finished");
+    return ESP_OK;
+}
+
+esp_err_t download_redirect_url(const char *url, const char *location, char *out, size_t len) {
+    size_t n;
+    if (strstr(location, "://")) {
+        n = snprintf(out, len, "%s", location);
+    } else if (location[0] == '/') {
+        // same scheme and host
+        const char *authority = strstr(url, "://");
+        authority = authority ? authority + 3 : url;
+        int prefix = authority - url + strcspn(authority, "/?#");
+        n = snprintf(out, len, "%.*s%s", prefix, url, location);
+    } else {
+        ESP_LOGE(TAG, "Unsupported redirect to %s", location);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (n >= len) {
+        ESP_LOGE(TAG, "Redirect URL longer than %d bytes", len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t download_fetch(download_transport transport, char *url, size_t url_len, const char *file,
+                         const char *revalidate, const char *headers, int *status) {
+    bool resuming = download_resuming();
+    char *request = malloc(HTTP_RECEIVE_BUFFER_SIZE);
+    download_response *response = malloc(sizeof(download_response));
+    if (!request || !response) {
+        free(request);
+        free(response);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err;
+    int redirects = 0;
+    while (true) {
+        // each response starts afresh, a redirect's body is not the image
+        download_response_init(response, url, file);
+        err = download_request_format(request, HTTP_RECEIVE_BUFFER_SIZE, url, resuming, revalidate, headers);
+        if (err != ESP_OK) {
+            break;
+        }
+        err = transport(url, request, &response->stream);
+        int code = response->stream.status;
+        if (err != ESP_OK || code < 300 || code > 399 || code == 304 || !response->location[0]) {
+            break;
+        }
+        if (++redirects > HTTP_MAX_REDIRECTS) {
+            ESP_LOGE(__func__, "More than %d redirects", HTTP_MAX_REDIRECTS);
+            err = ESP_FAIL;
+            break;
+        }
+        char next[sizeof(resume.url)];
+        err = download_redirect_url(url, response->location, next, sizeof(next));
+        if (err != ESP_OK) {
+            break;
+        }
+        strlcpy(url, next, url_len);
+        ESP_LOGI(TAG, "Redirecting to %s", url);
+    }
+    err = download_response_finish(response, err);
+    *status = response->stream.status;
+    free(response);
+    free(request);
+    return err;
+}
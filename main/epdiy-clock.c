@@ -14,9 +14,15 @@
 #include "time_sync.h"
 #include "compress.h"
 #include "request.h"
+#include "download.h"
 #include "joysticks.h"
+#include "clock_render.h"
+#include "image_draw.h"
+#include "flash_writer.h"
+#include "freertos/queue.h"
 #include <math.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 /// global variables
@@ -36,7 +42,7 @@ uint8_t* bg_img = NULL;           // background image
 static uint32_t feed_buffer_pos = 0;
 
 // opened files
-FILE *fp_downloading = NULL;
+const char *downloading_file = NULL;
 FILE *fp_reading = NULL;
 
 extern const uint8_t server_cert_pem_start[] asm("_binary_server_cert_pem_start");
@@ -53,10 +59,21 @@ uint8_t render_pixel_skip = 0xff;
 // static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
 
 // time
-int64_t time_download_start;
-int64_t time_download;
 int64_t time_decomp;
-int64_t time_render;
+int64_t time_render;  // text rendering, accumulated over the wake
+
+// areas changed by `display_time', the whole screen is updated when empty
+EpdRect dirty_areas[CLOCK_DIRTY_MAX];
+int dirty_area_count = 0;
+// clock text on hl.front_fb, drawn over the clean image in bg_img
+static clock_renderer time_clock;
+static char bg_img_name[32] = "";
+// first pass after power on or reset, not a wake from sleep
+static bool first_run = true;
+// woken by the button, someone is looking at the panel
+static bool button_wake = false;
+// the panel shows a thumbnail preview, which hl.back_fb holds
+static bool preview_shown = false;
 
 static const char* jd_errors[] = {
     "Succeeded",
@@ -246,7 +263,19 @@ esp_err_t shuffle_images(void) {
     return ret;
 }
 
-esp_err_t random_unlink_image(void) {
+// Whether `name', an entry of storage_base_path, is one of the `paths'
+static bool image_listed(const char *name, const char *const *paths, int count) {
+    int prefix_len = strlen(storage_base_path) + 1;
+    for (int i = 0; i < count; i++) {
+        if (strlen(paths[i]) > prefix_len && strcmp(paths[i] + prefix_len, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Unlink a random image, but neither the current one nor any of `keep'
+esp_err_t random_unlink_image(const char *const *keep, int keep_count) {
     // list all img-*, then randomly unlink one
     DIR *d;
     struct dirent *dir;
@@ -255,11 +284,16 @@ esp_err_t random_unlink_image(void) {
         ESP_LOGE(__func__, "unable to load path %s", storage_base_path);
         return ESP_FAIL;
     }
+    char current[32] = "";
+    size_t current_len = sizeof(current);
+    nvs_read_str(key_current_image, current, &current_len);
+    const char *current_path = current;
     char *filenames[16] = {0};
     char **p = filenames;
-    while ((dir = readdir(d)) != NULL) {
+    while ((dir = readdir(d)) != NULL && p < filenames + 15) {
         ESP_LOGD(TAG, "%s", dir->d_name);
-        if (strncmp(dir->d_name, "img-", 4) == 0) {
+        if (strncmp(dir->d_name, "img-", 4) == 0 && !image_listed(dir->d_name, keep, keep_count) &&
+            !image_listed(dir->d_name, &current_path, 1)) {
             // found an image
             ESP_LOGD(TAG, "Found image %s", dir->d_name);
             *p = (char*)malloc(strlen(dir->d_name) + 1);
@@ -296,7 +330,8 @@ esp_err_t random_unlink_image(void) {
     return ret;
 }
 
-int count_image(void) {
+// Images in storage, without `skip' such as conversions still being written
+int count_image_except(const char *const *skip, int skip_count) {
     // count all img-*
     DIR *d;
     struct dirent *dir;
@@ -308,15 +343,20 @@ int count_image(void) {
     int cnt = 0;
     while ((dir = readdir(d)) != NULL) {
         ESP_LOGD(TAG, "%s", dir->d_name);
-        if (strncmp(dir->d_name, "img-", 4) == 0) {
+        if (strncmp(dir->d_name, "img-", 4) == 0 && !image_listed(dir->d_name, skip, skip_count)) {
             // found an image
             ESP_LOGD(TAG, "Found image %s", dir->d_name);
             cnt++;
         }
     }
+    closedir(d);
     return cnt;
 }
 
+int count_image(void) {
+    return count_image_except(NULL, 0);
+}
+
 esp_err_t unlink_current_image(void) {
     nvs_handle_t nvs_handle;
     esp_err_t err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle);
@@ -362,51 +402,6 @@ void do_epd_init() {
     esp_init_done = true;
 }
 
-/* User defined call-back function to output decoded RGB bitmap in decoded_image buffer */
-static uint32_t tjd_output(
-    JDEC* jd,     /* Decompressor object of current session */
-    void* bitmap, /* Bitmap data to be output */
-    JRECT* rect   /* Rectangular region to output */
-) {
-    vTaskDelay(0);
-
-    uint32_t w = rect->right - rect->left + 1;
-    uint32_t h = rect->bottom - rect->top + 1;
-    uint32_t image_width = jd->width;
-    uint32_t image_height = jd->height;
-    uint8_t* bitmap_ptr = (uint8_t*)bitmap;
-
-    // Write to display
-    int padding_x = (epd_rotated_display_width() - image_width) / 2;
-    int padding_y = (epd_rotated_display_height() - image_height) / 2;
-    
-    for (uint32_t i = 0; i < w * h; i++) {
-        uint8_t r = *(bitmap_ptr++);
-        uint8_t g = *(bitmap_ptr++);
-        uint8_t b = *(bitmap_ptr++);
-
-        // Calculate weighted grayscale
-        // uint32_t val = ((r * 30 + g * 59 + b * 11) / 100); // original formula
-        uint32_t val = (r * 38 + g * 75 + b * 15) >> 7;  // @vroland recommended formula
-
-        int xx = rect->left + i % w;
-        if (xx < 0 || xx >= image_width) {
-            continue;
-        }
-        int yy = rect->top + i / w;
-        if (yy < 0 || yy >= image_height) {
-            continue;
-        }
-
-        /* Optimization note: If we manage to apply here the epd_draw_pixel directly
-           then it will be no need to keep a huge raw buffer (But will loose dither) */
-        // decoded_image[yy * image_width + xx] = gamme_curve[val];
-        epd_draw_pixel(xx + padding_x, yy + padding_y, gamme_curve[val], jd->device);
-    }
-
-    return 1;
-}
-
 static uint32_t feed_buffer(
     JDEC* jd,
     uint8_t* buff,  // Pointer to the read buffer (NULL:skip)
@@ -425,7 +420,180 @@ static uint32_t feed_buffer(
     return count;
 }
 
+#if JPEG_DECODE_JPEGDEC
+static int jpegdec_yield(JPEGDRAW *draw) {
+    vTaskDelay(0);
+    return 1;
+}
+
+// ~25 KiB of tables and buffers, faster in internal RAM
+static JPEGIMAGE *jpegdec_alloc(void) {
+    JPEGIMAGE *jpeg = heap_caps_malloc(sizeof(JPEGIMAGE), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!jpeg) {
+        jpeg = heap_caps_malloc(sizeof(JPEGIMAGE), MALLOC_CAP_SPIRAM);
+    }
+    if (!jpeg) {
+        ESP_LOGE(__func__, "Failed to allocate JPEGDEC state");
+    }
+    return jpeg;
+}
+
+static int jpegdec_open(JPEGIMAGE *jpeg, const char *filename, uint8_t *buf, size_t size) {
+    return filename ? JPEG_openFile(jpeg, filename, jpegdec_yield) : JPEG_openRAM(jpeg, buf, size, jpegdec_yield);
+}
+
+// JPEGDEC from `filename', or `buf' when NULL, straight into the framebuffer
+static esp_err_t draw_jpeg_jpegdec(const char *filename, uint8_t *buf, size_t size, uint8_t *current_fb) {
+    JPEGIMAGE *jpeg = jpegdec_alloc();
+    if (!jpeg) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = ESP_FAIL;
+    uint32_t decode_start = esp_timer_get_time();
+    if (!jpegdec_open(jpeg, filename, buf, size)) {
+        ESP_LOGW(__func__, "JPEGDEC open failed: %d", JPEG_getLastError(jpeg));
+        goto cleanup;
+    }
+    int width, height;
+    int scale = jpegdec_scale(jpeg, &width, &height);
+    if (scale < 0) {
+        goto cleanup;
+    }
+    int options = JPEG_DECODE_PARALLEL ? JPEG_PARALLEL_DECODE : 0;
+    if (JPEG_DECODE_EXIF_ROTATE) {
+        // the decoder writes every MCU at its upright position, no second pass
+        options |= JPEG_AUTO_ROTATE;
+    }
+    if (scale) {
+        options |= jpegdec_scale_option(scale);
+        ESP_LOGI(__func__, "decoding at 1/%d scale", 1 << scale);
+    }
+    // centred like tjd_output
+    int x = (epd_rotated_display_width() - (width >> scale)) / 2;
+    int y = (epd_rotated_display_height() - (height >> scale)) / 2;
+    int64_t time_crop = -1;
+#if JPEG_DECODE_SMART_CROP
+    if ((width >> scale) > epd_rotated_display_width() || (height >> scale) > epd_rotated_display_height()) {
+        int64_t crop_start = esp_timer_get_time();
+        if (jpegdec_crop(jpeg, width, height, scale, &x, &y) != ESP_OK) {
+            ESP_LOGW(__func__, "no saliency, cropping at the centre");
+        }
+        // the saliency pass read through the entropy coded data, the ROI
+        // decode of the chosen window starts over
+        JPEG_close(jpeg);
+        if (!jpegdec_open(jpeg, filename, buf, size)) {
+            ESP_LOGW(__func__, "JPEGDEC reopen failed: %d", JPEG_getLastError(jpeg));
+            goto cleanup;
+        }
+        time_crop = (esp_timer_get_time() - crop_start) / 1000;
+    }
+#endif
+    if (!JPEG_decodeEPD(jpeg, current_fb, epd_width(), epd_height(), epd_get_rotation(), gamme_curve, x, y, options)) {
+        ESP_LOGW(__func__, "JPEGDEC decode failed: %d", JPEG_getLastError(jpeg));
+        goto cleanup;
+    }
+    time_decomp = (esp_timer_get_time() - decode_start) / 1000;
+    ESP_LOGI("JPG", "width: %d height: %d", width, height);
+    ESP_LOGI("decode", "%" PRIu32 " ms . image decompression (JPEGDEC)", time_decomp);
+    if (time_crop >= 0) {
+        ESP_LOGI("decode", "%lld ms . crop saliency pass, part of the above", time_crop);
+    }
+    ret = ESP_OK;
+cleanup:
+    if (jpeg->JPEGFile.fHandle) {
+        JPEG_close(jpeg);
+    }
+    free(jpeg);
+    return ret;
+}
+
+#if THUMB_PREVIEW
+// EXIF thumbnails are 160x120 by the spec, some cameras store larger ones
+#define THUMB_MAX 320
+static uint8_t *thumb_gray; // THUMB_MAX x THUMB_MAX, 8-bit gray
+
+static int thumb_draw(JPEGDRAW *draw) {
+    const uint8_t *src = (const uint8_t *)draw->pPixels;
+    int w = draw->iWidth;
+    if (draw->x + w > THUMB_MAX) {
+        w = THUMB_MAX - draw->x;
+    }
+    for (int y = 0; y < draw->iHeight && draw->y + y < THUMB_MAX && w > 0; y++) {
+        memcpy(&thumb_gray[(draw->y + y) * THUMB_MAX + draw->x], &src[y * draw->iWidth], w);
+    }
+    return 1;
+}
+
+// The EXIF thumbnail of `filename' stretched over the area draw_jpeg_jpegdec()
+// will fill, a few ms of decoding instead of the full image's seconds.
+// Overhanging images are cropped at the centre, jpegdec_crop() may pan the
+// full image from there
+static esp_err_t draw_jpeg_thumbnail(const char *filename, uint8_t *current_fb) {
+    JPEGIMAGE *jpeg = jpegdec_alloc();
+    if (!jpeg) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = ESP_FAIL;
+    int64_t preview_start = esp_timer_get_time();
+    if (!JPEG_openFile(jpeg, filename, thumb_draw)) {
+        goto cleanup;
+    }
+    if (!JPEG_hasThumb(jpeg)) {
+        ESP_LOGI(__func__, "%s has no EXIF thumbnail", filename);
+        goto cleanup;
+    }
+    thumb_gray = heap_caps_malloc(THUMB_MAX * THUMB_MAX, MALLOC_CAP_SPIRAM);
+    if (!thumb_gray) {
+        goto cleanup;
+    }
+    int width, height;
+    int scale = jpegdec_scale(jpeg, &width, &height);
+    int orientation = JPEG_DECODE_EXIF_ROTATE ? JPEG_getOrientation(jpeg) : 1;
+    JPEG_setPixelType(jpeg, EIGHT_BIT_GRAYSCALE);
+    if (scale < 0 || !JPEG_decode(jpeg, 0, 0, JPEG_EXIF_THUMBNAIL)) {
+        ESP_LOGW(__func__, "EXIF thumbnail decode failed: %d", JPEG_getLastError(jpeg));
+        goto cleanup;
+    }
+    int tw = JPEG_getThumbWidth(jpeg);
+    int th = JPEG_getThumbHeight(jpeg);
+    if (tw > THUMB_MAX || th > THUMB_MAX) {
+        ESP_LOGW(__func__, "EXIF thumbnail %dx%d too large", tw, th);
+        goto cleanup;
+    }
+    int uw = orientation >= 5 ? th : tw;
+    int uh = orientation >= 5 ? tw : th;
+    int dw = width >> scale;
+    int dh = height >> scale;
+    int x0 = (epd_rotated_display_width() - dw) / 2;
+    int y0 = (epd_rotated_display_height() - dh) / 2;
+    memset(current_fb, 0xFF, epd_width() / 2 * epd_height());
+    for (int v = y0 < 0 ? -y0 : 0; v < dh && y0 + v < epd_rotated_display_height(); v++) {
+        for (int u = x0 < 0 ? -x0 : 0; u < dw && x0 + u < epd_rotated_display_width(); u++) {
+            int sx, sy;
+            exif_stored_pixel(orientation, u * uw / dw, v * uh / dh, tw, th, &sx, &sy);
+            epd_draw_pixel(x0 + u, y0 + v, gamme_curve[thumb_gray[sy * THUMB_MAX + sx]], current_fb);
+        }
+    }
+    ESP_LOGI("decode", "%lld ms . EXIF thumbnail %dx%d preview", (esp_timer_get_time() - preview_start) / 1000, tw, th);
+    ret = ESP_OK;
+cleanup:
+    if (jpeg->JPEGFile.fHandle) {
+        JPEG_close(jpeg);
+    }
+    free(jpeg);
+    free(thumb_gray);
+    thumb_gray = NULL;
+    return ret;
+}
+#endif
+#endif
+
 int draw_jpeg(uint8_t* source_buf, uint8_t *current_fb) {
+#if JPEG_DECODE_JPEGDEC
+    if (draw_jpeg_jpegdec(NULL, source_buf, data_len_total, current_fb) == ESP_OK) {
+        return 0;
+    }
+#endif
     feed_buffer_pos = 0;
     rc = jd_prepare(&jd, feed_buffer, tjpgd_work, sizeof(tjpgd_work), current_fb);
     if (rc != JDR_OK) {
@@ -474,6 +642,11 @@ static uint32_t feed_buffer_file(
 }
 
 esp_err_t draw_jpeg_file(const char *filename, uint8_t *current_fb) {
+#if JPEG_DECODE_JPEGDEC
+    if (draw_jpeg_jpegdec(filename, NULL, 0, current_fb) == ESP_OK) {
+        return ESP_OK;
+    }
+#endif
     fp_reading = fopen(filename, "rb");
     if (!fp_reading) {
         ESP_LOGE(__func__, "Failed to open file %s for reading", filename);
@@ -521,74 +694,6 @@ esp_err_t draw_compressed_file(const char *filename, uint8_t *current_fb) {
     return fb_load_compressed_file(filename, current_fb);
 }
 
-void on_draw_png(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint8_t rgba[4]) {
-    uint32_t r = rgba[0]; // 0 - 255
-    uint32_t g = rgba[1]; // 0 - 255
-    uint32_t b = rgba[2]; // 0 - 255
-    uint32_t a = rgba[3]; // 0: fully transparent, 255: fully opaque
-
-    uint32_t image_width = pngle_get_width(pngle);
-    uint32_t image_height = pngle_get_height(pngle);
-    int epd_width = epd_rotated_display_width();
-    int epd_height = epd_rotated_display_height();
-
-    if (render_pixel_skip == 0xff) {
-        render_pixel_skip = 0;
-        if (image_width > epd_width * 2 || image_height > epd_height * 2) {
-            render_pixel_skip = 2;
-        }
-        return;
-    }
-    if (render_pixel_skip) {
-        image_width = image_width / render_pixel_skip;
-        image_height = image_height / render_pixel_skip;
-    }
-
-    int padding_x = (epd_width - image_width) / 2;
-    int padding_y = (epd_height - image_height) / 2;
-
-    // if (a == 0) {
-    //     // skip transparent pixels
-    //     return;
-    // }
-
-    uint32_t val = (r * 38 + g * 75 + b * 15) >> 7;  // @vroland recommended formula
-    // use alpha in white background
-    val = (a == 0) ? 255 : val;
-    // val = (val * 256 / (256 - a)) & 0xff;
-    uint8_t color = gamme_curve[val];
-
-    // print info
-    // static int cnt = 0;
-    // if (cnt % 100 == 0)
-    //     ESP_LOGI("PNG", "x: %d y: %d w: %d h: %d r: %d g: %d b: %d a: %d val: %d px: %d py: %d color: %x", 
-    //     x, y, w, h, r, g, b, a, val, padding_x, padding_y, color);
-    // cnt++;
-
-    if (render_pixel_skip == 0) {
-        for (uint32_t yy = 0; yy < h; yy++) {
-            for (uint32_t xx = 0; xx < w; xx++) {
-                epd_draw_pixel(xx + x + padding_x, 
-                    yy + y + padding_y, 
-                    color, pngle_get_user_data(pngle));
-            }
-        }
-    } else {
-        for (uint32_t yy = 0; yy < h; yy++) {
-            for (uint32_t xx = 0; xx < w; xx++) {
-                int xxx = xx + x;
-                int yyy = yy + y;
-                if (xxx % render_pixel_skip != 0 || yyy % render_pixel_skip != 0) {
-                    continue;
-                }
-                epd_draw_pixel(xxx / render_pixel_skip + padding_x, 
-                    yyy / render_pixel_skip + padding_y, 
-                    color, pngle_get_user_data(pngle));
-            }
-        }
-    }
-}
-
 int draw_png(uint8_t* source_buf, size_t size, uint8_t *current_fb) {
     int r = 0;
     uint32_t decode_start = esp_timer_get_time();
@@ -642,6 +747,22 @@ esp_err_t draw_png_file(const char *filename, uint8_t *current_fb) {
     return ESP_OK;
 }
 
+// SOI marker, a JPEG that failed to decode is no PNG either
+static bool is_jpeg(const uint8_t *data, size_t size) {
+    return size >= 2 && data[0] == 0xFF && data[1] == 0xD8;
+}
+
+static bool is_jpeg_file(const char *filename) {
+    uint8_t soi[2];
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+    size_t n = fread(soi, 1, sizeof(soi), fp);
+    fclose(fp);
+    return is_jpeg(soi, n);
+}
+
 esp_err_t display_source_buf() {
     if (!source_buf) {
         ESP_LOGW(TAG, "source_buf is NULL");
@@ -650,6 +771,10 @@ esp_err_t display_source_buf() {
     epd_fullclear(&hl, TEMPERATURE);
     ESP_LOGI(TAG, "%" PRIu32 " bytes read from %s", data_len_total, IMG_URL);
     int r = draw_jpeg(source_buf, fb);
+    if (r == ESP_FAIL && is_jpeg(source_buf, data_len_total)) {
+        ESP_LOGE(__func__, "draw as jpg failed");
+        return ESP_FAIL;
+    }
     if (r == ESP_FAIL) {
         ESP_LOGE(__func__, "draw as jpg failed, try to draw as png");
         r = draw_png(source_buf, data_len_total, fb);
@@ -675,12 +800,14 @@ esp_err_t convert_image_to_compress(const char *from, const char *to, uint8_t *c
     memset(m_fb, 0xFF, fb_size);
     // draw image to fb
     int r = draw_jpeg_file(from, m_fb);
-    if (r == ESP_FAIL) {
+    if (r == ESP_FAIL && !is_jpeg_file(from)) {
         ESP_LOGE(__func__, "draw as jpg failed, try to draw as png");
         r = draw_png_file(from, m_fb);
+        if (r == ESP_FAIL) {
+            ESP_LOGE(__func__, "draw as png failed");
+        }
     }
     if (r == ESP_FAIL) {
-        ESP_LOGE(__func__, "draw as png failed");
         if (m_fb) {
             free(m_fb);
         }
@@ -694,297 +821,385 @@ esp_err_t convert_image_to_compress(const char *from, const char *to, uint8_t *c
     return r;
 }
 
-// Download and write data to `filename_temp_image'
-esp_err_t _http_event_handler(esp_http_client_event_t* evt) {
-    static uint32_t data_recv = 0;
-    static uint32_t on_data_cnt = 0;
-    static bool download_err = false;
-    switch (evt->event_id) {
-        case HTTP_EVENT_ERROR:
-            ESP_LOGE(__func__, "HTTP_EVENT_ERROR");
-            break;
-        case HTTP_EVENT_ON_CONNECTED:
-            ESP_LOGI(TAG, "HTTP_EVENT_ON_CONNECTED");
-            data_recv = 0;
-            on_data_cnt = 0;
-            download_err = false;
-            break;
-        case HTTP_EVENT_HEADER_SENT:
-            ESP_LOGI(TAG, "HTTP_EVENT_HEADER_SENT");
-            break;
-        case HTTP_EVENT_ON_HEADER:
-// #if DEBUG_VERBOSE
-            ESP_LOGI(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-// #endif
-            if (strncmp(evt->header_key, "Content-Length", 14) == 0) {
-                // Should be big enough to hold the JPEG file size
-                data_len_total = atol(evt->header_value);
-                if (data_len_total) {
-                    // ESP_LOGI("epdiy", "Allocating content buffer of length %X (%dKiB)", data_len_total, data_len_total / 1024);
-                    // source_buf = (uint8_t*)heap_caps_malloc(data_len_total, MALLOC_CAP_SPIRAM);
-                    // // source_buf = (uint8_t*)heap_caps_malloc(data_len_total, MALLOC_CAP_INTERNAL);
-                    // if (source_buf == NULL) {
-                    //     ESP_LOGE("main", "Initial alloc source_buf failed!");
-                    // }
-                    // printf("Free heap after buffers allocation: %X\n", xPortGetFreeHeapSize());
-                } else {
-                    ESP_LOGI("main", "Content-Length header is 0, maybe a redirect");
-                }
-            }
-            // get redirect url
-            if (strncmp(evt->header_key, "Location", 8) == 0) {
-                strncpy(downloading_url, evt->header_value, sizeof(downloading_url) - 1);
-                ESP_LOGI(TAG, "Redirecting to %s", downloading_url);
-            }
-            break;
-        case HTTP_EVENT_REDIRECT:
-            ESP_LOGI(TAG, "HTTP_EVENT_REDIRECT");
-            break;
-        case HTTP_EVENT_ON_DATA:
-            ++on_data_cnt;
-// #if DEBUG_VERBOSE
-            if (on_data_cnt % 10 == 0 && data_len_total) {
-                ESP_LOGI(TAG, "%d len:%d %d%%", on_data_cnt, evt->data_len, data_recv * 100 / data_len_total);
-            }
-// #endif
-            // should be allocated after the Content-Length header was received.
-            // assert(source_buf != NULL);
-
-            if (!fp_downloading) {
-                time_download_start = esp_timer_get_time();
-                fp_downloading = fopen(filename_temp_image, "wb");
-                ESP_LOGI(TAG, "Opening file %s for writing", filename_temp_image);
-                if (!fp_downloading) {
-                    ESP_LOGE(__func__, "Failed to open file for writing");
-                    download_err = true;
-                }
-            }
-            // Append received data into source_buf
-            // memcpy(&source_buf[data_recv], evt->data, evt->data_len);
-            // Write received data into file
-            if (!fp_downloading) {
-                ESP_LOGE(__func__, "fp_downloading is NULL when writing data");
-            } else {
-                unsigned long written_bytes = fwrite(evt->data, 1, evt->data_len, fp_downloading);
-                if (written_bytes != evt->data_len) {
-                    ESP_LOGE(__func__, "fwrite failed! expected %d, got %d", evt->data_len, written_bytes);
-                    download_err = true;
-                }
-            }
-            data_recv += evt->data_len;
-
-            // Optional hexa dump
-            // ESP_LOG_BUFFER_HEX(TAG, output_buffer, evt->data_len);
-            break;
-
-        case HTTP_EVENT_ON_FINISH:
-            // Do not draw if it's a redirect (302)
-            ESP_LOGI(TAG, "HTTP_EVENT_ON_FINISH, status_code=%d", esp_http_client_get_status_code(evt->client));
-            if (esp_http_client_get_status_code(evt->client) == 200) {
-                if (source_buf) {
-                    esp_err_t r = display_source_buf();
-                    if (r != ESP_OK) {
-                        ESP_LOGE(__func__, "display_source_buf failed");
-                        // return r;
-                    }
-                }
-            }
-            break;
+// Validators of the last full response from a source URL, kept in NVS
+typedef struct source_cache_t {
+    char validator[64];  // ETag or Last-Modified, see `download_resume'
+    char image[32];      // converted image of that response
+    uint32_t bytes;      // body length
+    uint32_t fetch_ms;   // download and conversion time
+} source_cache;
+
+// NVS key for `url', keys are limited to 15 characters
+static void source_cache_key(const char *url, char *key, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = url; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    snprintf(key, len, "%s%08" PRIx32, key_source_cache_prefix, hash);
+}
 
-        case HTTP_EVENT_DISCONNECTED:
-            ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
-            // close file
-            esp_err_t *dl_ret = (esp_err_t*)evt->user_data;
-            if (fp_downloading) {
-                fclose(fp_downloading);
-                time_download = (esp_timer_get_time() - time_download_start) / 1000;
-                if (time_download && data_len_total && !download_err) {
-                    ESP_LOGI("download", "%" PRIu32 "KiB in %" PRIu32 " ms, %.3lfKiB/s", 
-                        data_len_total / 1024, time_download, (double)data_len_total * 1000 / 1024 / time_download);
-                }
-                *dl_ret = ESP_OK;
-                fp_downloading = NULL;
-                if (download_err) {
-                    ESP_LOGE(__func__, "Download failed, deleting file");
-                    unlink(filename_temp_image);
-                } else {
-                    ESP_LOGI(TAG, "Download finished");
-                }
-            } else {
-                ESP_LOGI(TAG, "fp_downloading is NULL when disconnecting");
-            }
-            ESP_LOGI(TAG, "Disconnected");
-            break;
-        default:
-            ESP_LOGI(TAG, "HTTP_EVENT_ fallback caught event %d", evt->event_id);
+esp_err_t source_cache_load(const char *url, source_cache *cache) {
+    char key[16];
+    source_cache_key(url, key, sizeof(key));
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(nvs_namespace, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    size_t len = sizeof(*cache);
+    err = nvs_get_blob(nvs_handle, key, cache, &len);
+    nvs_close(nvs_handle);
+    if (err == ESP_OK && len != sizeof(*cache)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    // the image may have been deleted to make room since
+    struct stat st;
+    if (!cache->validator[0] || stat(cache->image, &st) != 0) {
+        return ESP_ERR_NOT_FOUND;
     }
     return ESP_OK;
 }
 
-static const char HOWSMYSSL_REQUEST[] = "GET " IMG_URL " HTTP/1.1\r\n"
-                             "Host: " IMG_HOST "\r\n"
-                             "User-Agent: esp-idf/1.0 esp32\r\n"
-                             "\r\n";
+esp_err_t source_cache_store(const char *url, const source_cache *cache) {
+    char key[16];
+    source_cache_key(url, key, sizeof(key));
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(__func__, "Error (%s) opening NVS handle!", esp_err_to_name(err));
+        return err;
+    }
+    if (cache) {
+        err = nvs_set_blob(nvs_handle, key, cache, sizeof(*cache));
+    } else {
+        err = nvs_erase_key(nvs_handle, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(__func__, "Failed to write %s to NVS: 0x%x", key, err);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
 
-static esp_err_t https_get_request_using_cacert_buf(void)
-{
-    ESP_LOGI(TAG, "https_request using cacert_buf");
+static esp_err_t image_transport(const char *url, const char *request, http_stream *stream) {
     esp_tls_cfg_t cfg = {
-        .cacert_buf = (const unsigned char *) server_cert_pem_start,
+        .timeout_ms = HTTP_RECEIVE_TIMEOUT_MS,
+#if VALIDATE_SSL_CERTIFICATE
+        .cacert_buf = server_cert_pem_start,
         .cacert_bytes = server_cert_pem_end - server_cert_pem_start,
+#endif
     };
-    return https_get_request(cfg, IMG_URL, HOWSMYSSL_REQUEST, (char**)&source_buf, &data_len_total);
+    return https_request_stream(cfg, url, request, stream);
 }
 
-static esp_err_t https_get_request_using_global_ca_store(void)
-{
-    esp_err_t esp_ret = ESP_FAIL;
-    ESP_LOGI(TAG, "https_request using global ca_store");
-    esp_ret = esp_tls_set_global_ca_store(server_cert_pem_start, server_cert_pem_end - server_cert_pem_start);
-    if (esp_ret != ESP_OK) {
-        ESP_LOGE(__func__, "Error in setting the global ca store: [%02X] (%s),could not complete the https_request using global_ca_store", esp_ret, esp_err_to_name(esp_ret));
-        return esp_ret;
+// Handles http request
+// `cache' adds conditional headers, `not_modified' is set on 304 and nothing is written
+static esp_err_t http_request(const source_cache *cache, bool *not_modified) {
+    // continue a partial body from the URL it came from, if it can be validated
+    bool resuming = download_resuming();
+    strlcpy(downloading_url, resuming ? resume.url : IMG_URL, sizeof(downloading_url));
+    if (!resuming && cache) {
+        ESP_LOGI(TAG, "Revalidating %s with %s", cache->image, cache->validator);
+    }
+    *not_modified = false;
+
+    char display[96];
+    sprintf(display, "X-EPD-Width: %d\r\nX-EPD-Height: %d\r\nX-EPD-Rotation: %d\r\n",
+            epd_rotated_display_width(), epd_rotated_display_height(), epd_get_rotation());
+    int status = 0;
+    esp_err_t err = download_fetch(image_transport, downloading_url, sizeof(downloading_url), downloading_file,
+                                   cache ? cache->validator : NULL, display, &status);
+    if (err == ESP_OK && status == 304) {
+        *not_modified = !resuming && cache;
+        if (!*not_modified) {
+            ESP_LOGE(__func__, "Unexpected 304");
+            err = ESP_FAIL;
+        }
     }
-    esp_tls_cfg_t cfg = {
-        .use_global_ca_store = true,
-    };
-    esp_ret = https_get_request(cfg, IMG_URL, HOWSMYSSL_REQUEST, (char**)&source_buf, &data_len_total);
-    esp_tls_free_global_ca_store();
-    return esp_ret;
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "IMAGE URL: %s\nHTTP GET Status = %d, %" PRIu32 " bytes", downloading_url, status,
+                 resume.received);
+        data_len_total = resume.received;
+    } else {
+        ESP_LOGE(__func__, "HTTP GET request failed: %s", esp_err_to_name(err));
+    }
+    return err;
 }
 
-static esp_err_t https_request(void) {
-    esp_err_t r = ESP_FAIL;
-    printf("SSL CERT:\n%s\n\n", (char*)server_cert_pem_start);
-    ESP_LOGI(TAG, "Minimum free heap size: %" PRIu32 " bytes", esp_get_minimum_free_heap_size());
-    // r = https_get_request_using_cacert_buf();
-    r = https_get_request_using_global_ca_store();
-    if (r != ESP_OK) {
-        ESP_LOGE(__func__, "https_get_request failed");
-        return r;
-    }
-    if (!source_buf) {
-        ESP_LOGE(__func__, "source_buf is NULL");
-        return ESP_FAIL;
-    }
-    r = display_source_buf();
-    if (r != ESP_OK) {
-        ESP_LOGE(__func__, "display_source_buf failed");
-        return r;
+
+
+// Conversion of one downloaded image, run by `convert_task'
+typedef struct convert_job_t {
+    char from[32];
+    char to[32];
+    char validator[64];
+    uint32_t bytes;
+    int64_t fetch_start;
+    bool native;  // pre-rendered frame, stored without conversion
+    bool preview; // the panel refreshes from fb meanwhile, convert in a buffer of its own
+    esp_err_t result;
+} convert_job;
+
+static QueueHandle_t convert_jobs = NULL;
+static QueueHandle_t convert_done = NULL;
+
+static esp_err_t convert_job_run(const convert_job *job) {
+    if (job->native) {
+        // already the compressed framebuffer
+        ESP_LOGI(TAG, "Storing frame %s as %s", job->from, job->to);
+        if (rename(job->from, job->to) != 0) {
+            ESP_LOGE(__func__, "Failed to rename %s to %s", job->from, job->to);
+            return ESP_FAIL;
+        }
+    } else {
+        ESP_LOGI(TAG, "Converting %s to %s", job->from, job->to);
+        esp_err_t r = convert_image_to_compress(job->from, job->to, job->preview ? NULL : fb);
+        if (r != ESP_OK) {
+            ESP_LOGE(__func__, "convert_image_to_compress failed");
+            unlink(job->to);
+            return ESP_FAIL;
+        }
     }
+    ESP_LOGI("download", "%s displayable %lld ms after download start (%s)", job->to,
+             (esp_timer_get_time() - job->fetch_start) / 1000, job->native ? "frame" : "converted");
+    // revalidate this response next time, unless it has no validator
+    source_cache fetched = {0};
+    strlcpy(fetched.validator, job->validator, sizeof(fetched.validator));
+    strlcpy(fetched.image, job->to, sizeof(fetched.image));
+    fetched.bytes = job->bytes;
+    fetched.fetch_ms = (esp_timer_get_time() - job->fetch_start) / 1000;
+    source_cache_store(IMG_URL, fetched.validator[0] ? &fetched : NULL);
     return ESP_OK;
 }
 
-// Handles http request
-static esp_err_t http_request(void) {
-    /**
-     * NOTE: All the configuration parameters for http_client must be specified
-     * either in URL or as host and path parameters.
-     * FIX: Uncommenting cert_pem restarts even if providing the right certificate
-     */
-    esp_http_client_config_t config = {
-        .url = IMG_URL,
-        .event_handler = _http_event_handler,
-        .buffer_size = HTTP_RECEIVE_BUFFER_SIZE,
-        .disable_auto_redirect = false,
-        .timeout_ms = HTTP_RECEIVE_TIMEOUT_MS,
-#if VALIDATE_SSL_CERTIFICATE
-        .cert_pem = (char*)server_cert_pem_start
-#endif
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-
-#if DEBUG_VERBOSE
-    printf("Free heap before HTTP download: %X\n", xPortGetFreeHeapSize());
-    if (esp_http_client_get_transport_type(client) == HTTP_TRANSPORT_OVER_SSL && config.cert_pem) {
-        printf("SSL CERT:\n%s\n\n", (char*)server_cert_pem_start);
+// Converts images on the second core while the next one downloads
+static void convert_task(void *arg) {
+    convert_job job;
+    while (xQueueReceive(convert_jobs, &job, portMAX_DELAY) == pdTRUE) {
+        job.result = convert_job_run(&job);
+        xQueueSend(convert_done, &job, portMAX_DELAY);
     }
-#endif
-
-    esp_err_t dl_ret = ESP_OK;
-    // set user_data as dl_ret
-    esp_http_client_set_user_data(client, &dl_ret);
+}
 
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK) {
-        err = dl_ret;
+static esp_err_t convert_task_start(void) {
+    if (convert_jobs) {
+        return ESP_OK;
+    }
+    convert_jobs = xQueueCreate(1, sizeof(convert_job));
+    convert_done = xQueueCreate(PREFETCH_IMAGES, sizeof(convert_job));
+    if (!convert_jobs || !convert_done ||
+        xTaskCreatePinnedToCore(convert_task, "convert", 1024 * 8, NULL, 5, NULL, 1) != pdPASS) {
+        ESP_LOGE(__func__, "Failed to start conversion task");
+        if (convert_jobs) {
+            vQueueDelete(convert_jobs);
+            convert_jobs = NULL;
+        }
+        if (convert_done) {
+            vQueueDelete(convert_done);
+            convert_done = NULL;
+        }
+        return ESP_FAIL;
     }
-    if (err == ESP_OK) {
-        // esp_http_client_get_content_length returns a uint64_t in esp-idf v5, so it needs a %lld
-        // format specifier
-        ESP_LOGI(
-            TAG, "IMAGE URL: %s\nHTTP GET Status = %d, content_length = %d", downloading_url,
-            esp_http_client_get_status_code(client), (int)esp_http_client_get_content_length(client)
-        );
-        data_len_total = esp_http_client_get_content_length(client);
+    return ESP_OK;
+}
+
+// Queues `job', or converts it right away without the conversion task
+static void convert_submit(convert_job *job) {
+    if (convert_jobs) {
+        xQueueSend(convert_jobs, job, portMAX_DELAY);
     } else {
-        ESP_LOGE(__func__, "HTTP GET request failed: %s", esp_err_to_name(err));
+        job->result = convert_job_run(job);
     }
-
-    esp_http_client_cleanup(client);
-    return err;
 }
 
+// Waits up to `wait' for the oldest queued job, the first converted image becomes current
+static bool convert_collect(convert_job *job, bool *linked, TickType_t wait) {
+    if (convert_jobs && xQueueReceive(convert_done, job, wait) != pdTRUE) {
+        return false;
+    }
+    if (job->result == ESP_OK && !*linked) {
+        ESP_LOGI(TAG, "Image converted, linking to %s", key_current_image);
+        *linked = link_current_image_file(job->to) == ESP_OK;
+    }
+    return true;
+}
 
+// Images to fetch in one Wi-Fi session, more while the catalog is filling up
+static int prefetch_batch_size(void) {
+    if (button_wake) {
+        // someone is waiting for the next image, the rest can come on a timer wake
+        return 1;
+    }
+    int room = IMAGE_CATALOG_MAX - count_image();
+    if (room > PREFETCH_IMAGES) {
+        return PREFETCH_IMAGES;
+    }
+    return room > 1 ? room : 1;
+}
 
-esp_err_t download_image() {
-    wifi_start_sta();
-    // handle http request
-    // esp_err_t r = http_request();
-    // esp_err_t r = https_request();
+// Download into `to_file', retrying and resuming on failure
+static esp_err_t download_to(const char *to_file, const source_cache *cache, bool *not_modified) {
+    downloading_file = to_file;
+    download_resume_reset();
     esp_err_t r;
     int retry = HTTP_RECEIVE_RETRY;
     do {
         retry--;
-        r = http_request();
+        r = http_request(cache, not_modified);
         if (r != ESP_OK) {
             ESP_LOGW(__func__, "http_post failed, retrying, retry: %d", retry);
-            if (retry == 0) {
-                break;
-            }
             // fetch_and_store_time_in_nvs(NULL);
             print_time();
-        } else {
-            // unix_timestamp as filename
-            time_t now;
-            time(&now);
-            char filename_img[32];
-            sprintf(filename_img, "%s/img-%lld", storage_base_path, now);
-            while (count_image() >= 10) {
-                ESP_LOGI(TAG, "Too many images, randomly delete one");
-                esp_err_t ret = random_unlink_image();
-                if (ret != ESP_OK) {
-                    break;
-                }
-            }
-            ESP_LOGI(TAG, "Converting %s to %s", filename_temp_image, filename_img);
-            esp_err_t ret = convert_image_to_compress(filename_temp_image, filename_img, fb);
-            if (ret != ESP_OK) {
-                ESP_LOGE(__func__, "convert_image_to_compress failed");
-                r = ESP_FAIL;
+        }
+    } while (r != ESP_OK && retry > 0);
+    return r;
+}
+
+#if TIME_SYNC_FROM_DATE
+// do_sync_time() left the sync to the image download's `Date' header
+static bool sync_deferred = false;
+static void date_check_apply(void);
+#endif
+void do_sync_time(void);
+
+esp_err_t download_image() {
+    if (wifi_start_sta() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    memset(&date_sync, 0, sizeof(date_sync));
+    // handle http request
+    // esp_err_t r = http_request();
+    // esp_err_t r = https_request();
+    int batch = prefetch_batch_size();
+    // a preview is only worth it while the image converts on the other core
+    if (batch > 1 || (JPEG_DECODE_JPEGDEC && THUMB_PREVIEW && button_wake)) {
+        convert_task_start();
+    }
+    // image i downloads into one while image i-1 is converted from the other
+    const char *temp_files[2] = {filename_temp_image, filename_temp_image_next};
+    source_cache cache = {0};
+    bool cached = source_cache_load(IMG_URL, &cache) == ESP_OK;
+    bool linked = false;
+    int queued = 0, converted = 0;
+    bool convert_failed = false;
+    convert_job job;
+    // outputs of the queued jobs, collected in this order
+    char targets[PREFETCH_IMAGES][sizeof(job.to)];
+    ESP_LOGI(TAG, "Fetching up to %d images", batch);
+    for (int i = 0; i < batch; i++) {
+        // the temp file is reused, wait for its previous conversion
+        while (converted < queued &&
+               convert_collect(&job, &linked, queued - converted == 2 ? portMAX_DELAY : 0)) {
+            converted++;
+            convert_failed |= job.result != ESP_OK;
+        }
+        // the source serves what can't be shown, another download would be wasted too
+        if (convert_failed) {
+            ESP_LOGW(TAG, "%s failed to convert, stop prefetching", IMG_URL);
+            break;
+        }
+        memset(&job, 0, sizeof(job));
+        strlcpy(job.from, temp_files[i % 2], sizeof(job.from));
+        job.fetch_start = esp_timer_get_time();
+        bool not_modified = false;
+        esp_err_t r = download_to(job.from, cached ? &cache : NULL, &not_modified);
+        if (r != ESP_OK) {
+            ESP_LOGE(__func__, "http_post failed");
+            break;
+        }
+        if (not_modified) {
+            if (i == 0) {
+                ESP_LOGI(TAG, "%s not modified, saved %" PRIu32 " bytes and %" PRIu32 " ms", IMG_URL, cache.bytes,
+                         cache.fetch_ms);
+                linked = link_current_image_file(cache.image) == ESP_OK;
             } else {
-                ESP_LOGI(TAG, "Image converted, linking to %s", key_current_image);
-                int r;
-                r = link_current_image_file(filename_img);
-                if (r != 0) {
-                    ESP_LOGE(__func__, "Failed to link %s to %s, r=%d", filename_img, key_current_image, r);
-                    r = ESP_FAIL;
-                }
-                // r = unlink(filename_temp_image);
-                // if (r != 0) {
-                //     ESP_LOGE(__func__, "Failed to unlink %s, r=%d", filename_temp_image, r);
-                // }
+                ESP_LOGI(TAG, "%s unchanged, stop prefetching", IMG_URL);
             }
-            if (r == ESP_OK) {
+            break;
+        }
+        // conversions not collected yet may be writing their image, or have just
+        // written the one that becomes current; they count once and stay
+        const char *in_flight[PREFETCH_IMAGES];
+        int in_flight_count = 0;
+        for (int k = converted; k < queued; k++) {
+            in_flight[in_flight_count++] = targets[k];
+        }
+        while (count_image_except(in_flight, in_flight_count) + in_flight_count >= IMAGE_CATALOG_MAX) {
+            ESP_LOGI(TAG, "Too many images, randomly delete one");
+            esp_err_t ret = random_unlink_image(in_flight, in_flight_count);
+            if (ret != ESP_OK) {
                 break;
             }
         }
-    } while (r != ESP_OK && retry > 0);
-    if (r != ESP_OK) {
-        ESP_LOGE(__func__, "http_post failed");
+        // unix_timestamp as filename
+        time_t now;
+        time(&now);
+        if (i == 0) {
+            sprintf(job.to, "%s/img-%lld", storage_base_path, now);
+        } else {
+            sprintf(job.to, "%s/img-%lld-%d", storage_base_path, now, i);
+        }
+        strlcpy(job.validator, resume.validator, sizeof(job.validator));
+        job.bytes = data_len_total;
+        job.native = resume.native;
+#if JPEG_DECODE_JPEGDEC && THUMB_PREVIEW
+        // the thumbnail decodes in ms, the panel shows it while the image converts
+        if (i == 0 && button_wake && !job.native && draw_jpeg_thumbnail(job.from, hl.front_fb) == ESP_OK) {
+            job.preview = true;
+            preview_shown = true;
+        }
+#endif
+        strlcpy(targets[queued], job.to, sizeof(targets[queued]));
+        convert_submit(&job);
+        queued++;
+        if (job.preview) {
+            epd_poweron();
+            epd_hl_update_screen(&hl, MODE_GC16, TEMPERATURE);
+            epd_poweroff();
+        }
+        if (!convert_jobs) {
+            convert_collect(&job, &linked, portMAX_DELAY);
+            converted++;
+            convert_failed = job.result != ESP_OK;
+        }
+        // a fixed URL answers 304 to the next request of this session
+        if (job.validator[0]) {
+            cached = true;
+            strlcpy(cache.validator, job.validator, sizeof(cache.validator));
+            strlcpy(cache.image, job.to, sizeof(cache.image));
+            cache.bytes = job.bytes;
+            cache.fetch_ms = 0;
+        }
     }
+    download_resume_reset();
+    // the ring goes back to the conversions, and the writer task with it
+    flash_writer_deinit();
+#if TIME_SYNC_FROM_DATE
+    if (sync_deferred) {
+        // a `Date' that disagrees or is missing falls back to a time
+        // fetch, on this Wi-Fi session instead of a second one
+        date_check_apply();
+        do_sync_time();
+    }
+#endif
+    // radio off while the last images convert
     wifi_stop_sta();
-    return r;
+    while (converted < queued) {
+        convert_collect(&job, &linked, portMAX_DELAY);
+        converted++;
+    }
+    ESP_LOGI(TAG, "Fetched %d images", queued);
+    return linked ? ESP_OK : ESP_FAIL;
 }
 
 esp_err_t init_flash_storage() {
@@ -1052,21 +1267,161 @@ typedef struct display_time_info_t {
     char text[24];
 } display_time_info;
 
-void display_time() {
-    do_epd_init();
+void clock_init(clock_renderer *clock) {
     EpdFontProperties font_props = epd_font_properties_default();
     font_props.flags = EPD_DRAW_ALIGN_CENTER | EPD_INV_BACKGROUND_BIN;
-    if (bg_img) {
-        font_props.bg = bg_img;
-    } else {
-        font_props.bg = fb;
+    clock_render_init(clock, font, font_props, epd_rotated_display_width() / 2,
+                      epd_rotated_display_height() / 2 + 100);
+}
+
+void format_time_text(time_t t, char *text, size_t len) {
+    struct tm timeinfo;
+    localtime_r(&t, &timeinfo);
+    strftime(text, len, TIME_FMT, &timeinfo);
+}
+
+#if PRERENDER_NEXT_FRAME
+typedef struct prerender_info_t {
+    time_t at;               // wall-clock time the frame was rendered for
+    char image[32];          // image the frame was composited on
+    display_time_info time;  // saved to `key_last_time' when shown
+    int row_start;           // band of framebuffer rows that differ
+    int row_end;
+} prerender_info;
+
+// widen [*row_start, *row_end) to every framebuffer row where a and b differ
+static void fb_diff_rows(const uint8_t *a, const uint8_t *b, int *row_start, int *row_end) {
+    int pitch = epd_width() / 2;
+    for (int y = 0; y < epd_height(); y++) {
+        if (memcmp(a + y * pitch, b + y * pitch, pitch) != 0) {
+            if (y < *row_start) *row_start = y;
+            if (y + 1 > *row_end) *row_end = y + 1;
+        }
+    }
+}
+
+bool shuffle_due(time_t at);
+bool download_due(time_t at);
+
+// Called after the panel update: composite the frame for the next wake and
+// store only the rows that differ from what is on the panel now.
+void prerender_next_frame(void) {
+    int64_t time_start = esp_timer_get_time();
+    time_t next = wake_next_target();
+    if (shuffle_due(next) || download_due(next)) {
+        ESP_LOGI(TAG, "Image changes on next wake, skip pre-render");
+        return;
+    }
+    prerender_info info = {0};
+    size_t image_len = sizeof(info.image);
+    if (nvs_read_str(key_current_image, info.image, &image_len) != ESP_OK || image_len == 0) {
+        return;
+    }
+    uint32_t fb_size = epd_width() / 2 * epd_height();
+    uint8_t *next_fb = heap_caps_malloc(fb_size, MALLOC_CAP_SPIRAM);
+    if (!next_fb) {
+        ESP_LOGE(TAG, "Failed to allocate pre-render buffer");
+        return;
     }
-    // font_props.fg_color = 0xf;
+    if (draw_compressed_file(info.image, next_fb) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to load %s for pre-render", info.image);
+        goto cleanup;
+    }
+    // rows carrying the text on the panel now, then rows the new text touches
+    int row_start = epd_height(), row_end = 0;
+    fb_diff_rows(hl.front_fb, next_fb, &row_start, &row_end);
+
+    clock_renderer clock;
+    clock_init(&clock);
+    format_time_text(next, info.time.text, sizeof(info.time.text));
+    int64_t time_render_start = esp_timer_get_time();
+    clock_render_draw(&clock, info.time.text, next_fb, next_fb, NULL, 0);
+    time_render += esp_timer_get_time() - time_render_start;
+    fb_diff_rows(hl.front_fb, next_fb, &row_start, &row_end);
+    if (row_end <= row_start) {
+        row_start = row_end = 0;
+    } else if (fb_save_band(filename_prerender_band, hl.front_fb, next_fb, row_start, row_end) != ESP_OK) {
+        goto cleanup;
+    }
+    info.at = next;
+    info.row_start = row_start;
+    info.row_end = row_end;
+    info.time.x = clock.x;
+    info.time.y = clock.y;
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle) == ESP_OK) {
+        if (nvs_set_blob(nvs_handle, key_prerender, &info, sizeof(info)) == ESP_OK) {
+            nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "Pre-rendered %s on %s, rows %d-%d, in %lld ms", info.time.text, info.image,
+             row_start, row_end, (esp_timer_get_time() - time_start) / 1000);
+cleanup:
+    free(next_fb);
+}
+
+// Fast path of `display_time': reuse the frame stored by `prerender_next_frame'
+// when it was made for this image and about this time, instead of decoding
+// twice.
+esp_err_t display_prerendered_frame(void) {
+    int64_t time_start = esp_timer_get_time();
+    prerender_info info;
+    size_t len = sizeof(info);
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs_handle, key_prerender, &info, &len);
+    if (err != ESP_OK || len != sizeof(info)) {
+        nvs_close(nvs_handle);
+        return ESP_FAIL;
+    }
+    time_t now = wake_display_time();
+    char current[32] = "";
+    size_t current_len = sizeof(current);
+    nvs_read_str(key_current_image, current, &current_len);
+    if (llabs((long long)(info.at - now)) > PRERENDER_TOLERANCE_SEC || strcmp(info.image, current) != 0) {
+        ESP_LOGI(TAG, "Pre-rendered frame %s on %s is stale", info.time.text, info.image);
+        nvs_close(nvs_handle);
+        return ESP_FAIL;
+    }
+    err = draw_compressed_file(info.image, hl.back_fb);
+    if (err == ESP_OK) {
+        memcpy(hl.front_fb, hl.back_fb, epd_width() / 2 * epd_height());
+        if (info.row_end > info.row_start) {
+            err = fb_load_band(filename_prerender_band, hl.back_fb, hl.front_fb, info.row_start, info.row_end);
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs_handle, key_last_time, &info.time, sizeof(info.time));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs_handle);
+        }
+        update_last_image();
+        ESP_LOGI(TAG, "Display pre-rendered %s in %lld ms", info.time.text,
+                 (esp_timer_get_time() - time_start) / 1000);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+#endif
+
+void display_time() {
+    do_epd_init();
+#if PRERENDER_NEXT_FRAME
+    if (!preview_shown && display_prerendered_frame() == ESP_OK) {
+        return;
+    }
+#endif
+    clock_init(&time_clock);
     display_time_info info;
     display_time_info info_last;
 
-    info.x = epd_rotated_display_width() / 2;
-    info.y = epd_rotated_display_height() / 2 + 100;
+    info.x = time_clock.x;
+    info.y = time_clock.y;
 
     nvs_handle_t nvs_handle;
     esp_err_t err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle);
@@ -1076,38 +1431,72 @@ void display_time() {
     }
     // read last info
     size_t len = sizeof(info_last);
-    err = nvs_get_blob(nvs_handle, key_last_time, &info_last, &len);
-    if (err == ESP_OK) {
+    bool has_last = nvs_get_blob(nvs_handle, key_last_time, &info_last, &len) == ESP_OK;
+    char last_image[32] = "";
+    char current_image[32] = "";
+    size_t last_image_len = sizeof(last_image);
+    size_t current_image_len = sizeof(current_image);
+    nvs_read_str(key_last_image, last_image, &last_image_len);
+    nvs_read_str(key_current_image, current_image, &current_image_len);
+
+    // time the panel update is expected to finish at
+    time_t now = wake_display_time();
+    char time_text[24] = "";
+    format_time_text(now, time_text, sizeof(time_text));
+    // sprintf(info.text, "%s-%02d", time_text, esp_random() % 100);
+    sprintf(info.text, "%s", time_text);
+    ESP_LOGI(TAG, "Display %s at (%d, %d)", info.text, info.x, info.y);
+
+    int64_t time_render_start;
+    uint32_t fb_size = epd_width() / 2 * epd_height();
+    if (preview_shown) {
+        // hl.back_fb is the preview on the panel, the image replaces what differs
+        has_last = false;
+        preview_shown = false;
+    }
+    if (has_last && last_image_len > 0 && strcmp(last_image, current_image) == 0) {
+        if (!bg_img) {
+            bg_img = heap_caps_malloc(fb_size, MALLOC_CAP_SPIRAM);
+        }
+        if (!bg_img || do_display(key_current_image, bg_img) != ESP_OK) {
+            has_last = false;
+        } else {
+            strcpy(bg_img_name, current_image);
+        }
+    } else if (has_last) {
+        // image changed since the last frame, compose both from scratch
         err = do_display(key_last_image, hl.back_fb);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "do_display failed");
-            memset(hl.back_fb, 0xFF, epd_width() / 2 * epd_height());
+            memset(hl.back_fb, 0xFF, fb_size);
         } else {
             // draw last time on back
-            ESP_LOGI(TAG, "Display last frame %s at (%d, %d)", info_last.text, info_last.x, info_last.y);
-            epd_write_string(font, info_last.text, &info_last.x, &info_last.y, hl.back_fb, &font_props);
+            ESP_LOGI(TAG, "Display last frame %s", info_last.text);
+            time_render_start = esp_timer_get_time();
+            clock_render_draw(&time_clock, info_last.text, hl.back_fb, hl.back_fb, NULL, 0);
+            time_render += esp_timer_get_time() - time_render_start;
+            clock_render_reset(&time_clock);
         }
+        has_last = false;
+    }
+    if (has_last) {
+        // same image on both frames: decode it once and redraw changed glyphs only
+        memcpy(hl.back_fb, bg_img, fb_size);
+        time_render_start = esp_timer_get_time();
+        clock_render_draw(&time_clock, info_last.text, hl.back_fb, bg_img, NULL, 0);
+        memcpy(hl.front_fb, hl.back_fb, fb_size);
+        dirty_area_count = clock_render_draw(&time_clock, info.text, hl.front_fb, bg_img, dirty_areas, CLOCK_DIRTY_MAX);
+        time_render += esp_timer_get_time() - time_render_start;
+    } else {
+        bg_img_name[0] = 0;
+        err = do_display(key_current_image, hl.front_fb);
+        time_render_start = esp_timer_get_time();
+        clock_render_draw(&time_clock, info.text, hl.front_fb, hl.front_fb, NULL, 0);
+        time_render += esp_timer_get_time() - time_render_start;
     }
-    err = do_display(key_current_image, hl.front_fb);
     update_last_image();
-
-    time_t now;
-    struct tm timeinfo;
-    time(&now);
-    // display time cost TIME_DISPLAY_OFFSET_SEC seconds
-    now += TIME_DISPLAY_OFFSET_SEC;
-    localtime_r(&now, &timeinfo);
-    char time_text[24] = "";
-    strftime(time_text, sizeof(info.text), TIME_FMT, &timeinfo);
-    // sprintf(info.text, "%s-%02d", time_text, esp_random() % 100);
-    sprintf(info.text, "%s", time_text);
-    ESP_LOGI(TAG, "Display %s at (%d, %d)", info.text, info.x, info.y);
-
-    epd_write_string(font, info.text, &info.x, &info.y, fb, &font_props);
+    ESP_LOGI(TAG, "Text render %lld ms", time_render / 1000);
     // save to key_last_time
-    // reset pos
-    info.x = epd_rotated_display_width() / 2;
-    info.y = epd_rotated_display_height() / 2 + 150;
     err = nvs_set_blob(nvs_handle, key_last_time, &info, sizeof(info));
     if (err == ESP_OK) {
         err = nvs_commit(nvs_handle);
@@ -1135,13 +1524,28 @@ esp_err_t setup_wakeup_int(void) {
     return ESP_OK;
 }
 
-void finish_system(void) {
+void update_panel(void) {
     epd_poweron();
-    // finally update screen
-    epd_hl_update_screen(&hl, MODE_GC16, TEMPERATURE);
+    if (dirty_area_count > 0) {
+        for (int i = 0; i < dirty_area_count; i++) {
+            epd_hl_update_area(&hl, MODE_GC16, TEMPERATURE, dirty_areas[i]);
+        }
+    } else {
+        epd_hl_update_screen(&hl, MODE_GC16, TEMPERATURE);
+    }
+    wake_update_done();
     // epd_hl_update_screen(&hl, MODE_GL16, 25);
     epd_poweroff();
+    dirty_area_count = 0;
+}
+
+void finish_system(void) {
+    // finally update screen
+    update_panel();
     // fb_save_compressed();
+#if PRERENDER_NEXT_FRAME
+    prerender_next_frame();
+#endif
     epd_deinit();
     esp_vfs_spiffs_unregister(storage_partition_label);
     setup_wakeup_int();
@@ -1169,6 +1573,8 @@ void do_clean_screen(void) {
     }
     if (will_clean) {
         ESP_LOGI(TAG, "Clean screen");
+        // panel and framebuffers are white now
+        bg_img_name[0] = 0;
         epd_poweron();
         epd_fullclear(&hl, TEMPERATURE);
         epd_poweroff();
@@ -1182,25 +1588,21 @@ void do_clean_screen(void) {
 #endif
 }
 
+bool shuffle_due(time_t at) {
+    time_t last_shuffle_time;
+    esp_err_t err = nvs_read_u64(key_last_shuffle_images, (uint64_t*)&last_shuffle_time);
+    return err != ESP_OK || at - last_shuffle_time > TIME_SHUFFLE_MINUTE * 60;
+}
+
 void do_shuffle_images(void) {
     // suffle images every `TIME_SHUFFLE_MINUTE'
-    bool will_shuffle = false;
     time_t now;
     time(&now);
-    time_t last_shuffle_time;
-    esp_err_t err = nvs_read_u64(key_last_shuffle_images, (uint64_t*)&last_shuffle_time);
-    if (err == ESP_OK) {
-        if (now - last_shuffle_time > TIME_SHUFFLE_MINUTE * 60) {
-            will_shuffle = true;
-        }
-    } else {
-        will_shuffle = true;
-    }
-    if (will_shuffle) {
+    if (shuffle_due(now)) {
         ESP_LOGI(TAG, "Shuffle images");
         shuffle_images();
         // save current time to `key_last_shuffle_images'
-        err = nvs_write_u64(key_last_shuffle_images, now);
+        esp_err_t err = nvs_write_u64(key_last_shuffle_images, now);
         if (err != ESP_OK) {
             ESP_LOGE(__func__, "nvs_write_u64 failed");
         }
@@ -1223,26 +1625,54 @@ void do_shuffle_images(void) {
     }
 }
 
+bool download_due(time_t at) {
+    if (count_image() == 0) {
+        return true;
+    }
+    // get last time from `key_last_download'
+    time_t last_download_time = 0;
+    esp_err_t err = nvs_read_u64(key_last_download, (uint64_t*)&last_download_time);
+    if (err == ESP_OK && at - last_download_time <= TIME_DOWNLOAD_MINUTE * 60) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Last download time: %lld, at: %lld, download due", last_download_time, at);
+    return true;
+}
+
+// A `Date' header agreeing with the clock counts as a time sync until a
+// minute past the next download, whose `Date' can confirm it again. Never
+// for longer than a sync would, nor shorter than it already does
+static void date_check_apply(void) {
+    if (!date_sync.valid) {
+        return;
+    }
+    if (llabs(date_sync.offset_us) > TIME_DATE_TOLERANCE_MS * 1000LL) {
+        ESP_LOGW(TAG, "Clock off by %lld ms from the image server's Date, time sync still due",
+                 date_sync.offset_us / 1000);
+        return;
+    }
+    time_t now;
+    time(&now);
+    time_t last_sync_time = 0;
+    nvs_read_u64(key_last_sync_time, (uint64_t*)&last_sync_time);
+    // the sync is due when now - last_sync_time exceeds the interval
+    int interval = wake_sync_interval_minutes();
+    int hold = MIN(interval, MAX(TIME_SYNC_MINUTE, TIME_DOWNLOAD_MINUTE + 1));
+    time_t postponed = now - (interval - hold) * 60;
+    if (postponed <= last_sync_time) {
+        return;
+    }
+    ESP_LOGI(TAG, "Clock within %lld ms of the image server's Date (RTT %lld ms), counts as time sync for %d min",
+             date_sync.offset_us / 1000, date_sync.rtt_us / 1000, hold);
+    nvs_write_u64(key_last_sync_time, postponed);
+}
+
 bool do_download_display(void) {
     // download image ever TIME_DOWNLOAD_MINUTE
     time_t now;
-    time_t last_download_time;
-    bool will_download = false;
-    will_download = esp_reset_reason() != ESP_RST_DEEPSLEEP || count_image() == 0;
+    time(&now);
+    bool will_download = first_run || (BUTTON_NEXT_IMAGE && button_wake) || download_due(now);
     bool download_done = false;
-    if (!will_download) {
-        time(&now);
-        // get last time from `key_last_download'
-        esp_err_t err = nvs_read_u64(key_last_download, (uint64_t*)&last_download_time);
-        if (err == ESP_OK) {
-            if (now - last_download_time > TIME_DOWNLOAD_MINUTE * 60) {
-                ESP_LOGI(TAG, "Last download time: %lld, now: %lld, will download", last_download_time, now);
-                will_download = true;
-            }
-        } else {
-            will_download = true;
-        }
-    }
     if (will_download) {
         ESP_LOGI(TAG, "start downloading image");
         esp_err_t r = download_image();
@@ -1270,9 +1700,9 @@ bool do_download_display(void) {
 }
 
 void do_sync_time(void) {
-    // sync time every TIME_SYNC_MINUTE
+    // sync time every TIME_SYNC_MINUTE, or longer once the drift is learned
     bool will_sync = false;
-    if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+    if (first_run) {
         ESP_LOGI(TAG, "Wakeup not from deepsleep, force time update");
         will_sync = true;
     }
@@ -1283,7 +1713,7 @@ void do_sync_time(void) {
         // get last time from `key_last_sync_time'
         esp_err_t err = nvs_read_u64(key_last_sync_time, (uint64_t*)&last_sync_time);
         if (err == ESP_OK) {
-            if (now - last_sync_time > TIME_SYNC_MINUTE * 60) {
+            if (now - last_sync_time > wake_sync_interval_minutes() * 60) {
                 ESP_LOGI(TAG, "Last sync time: %lld, now: %lld, delta: %lld s, will sync", last_sync_time, now, now - last_sync_time);
                 will_sync = true;
             }
@@ -1291,9 +1721,22 @@ void do_sync_time(void) {
             will_sync = true;
         }
     }
+#if TIME_SYNC_FROM_DATE
+    // once per tick, the image response's Date header may confirm the clock;
+    // download_image() calls back before it stops Wi-Fi
+    if (will_sync && !first_run && !sync_deferred && download_due(now)) {
+        ESP_LOGI(TAG, "Time sync deferred until the image download");
+        sync_deferred = true;
+        return;
+    }
+    sync_deferred = false;
+#endif
     if (will_sync) {
         ESP_LOGI(TAG, "Sync time");
-        wifi_start_sta();
+        if (wifi_start_sta() != ESP_OK) {
+            ESP_LOGE(__func__, "No network, time not synced");
+            return;
+        }
         fetch_and_store_time_in_nvs(NULL);
         update_time_from_nvs();
         // save current time to `key_last_sync_time'
@@ -1361,10 +1804,69 @@ void do_display_img_time(bool download_done) {
     display_time();
 }
 
+#if (RUN_MODE == RUN_MODE_RESIDENT)
+// Resident tick: hl.front_fb still holds what the panel shows and bg_img the
+// clean image under it, so only the changed glyphs are drawn.
+void display_time_tick(void) {
+    char current_image[32] = "";
+    size_t current_image_len = sizeof(current_image);
+    nvs_read_str(key_current_image, current_image, &current_image_len);
+    if (bg_img_name[0] == 0 || strcmp(bg_img_name, current_image) != 0 || time_clock.count < 0) {
+        display_time();
+        return;
+    }
+    display_time_info info = {.x = time_clock.x, .y = time_clock.y};
+    format_time_text(wake_display_time(), info.text, sizeof(info.text));
+    int64_t time_render_start = esp_timer_get_time();
+    dirty_area_count = clock_render_draw(&time_clock, info.text, hl.front_fb, bg_img, dirty_areas, CLOCK_DIRTY_MAX);
+    ESP_LOGI(TAG, "Display %s, render %lld ms", info.text, (esp_timer_get_time() - time_render_start) / 1000);
+    if (dirty_area_count == 0) {
+        return;
+    }
+    // keep the deep sleep path consistent if the mode is switched back
+    nvs_handle_t nvs_handle;
+    if (nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle) == ESP_OK) {
+        if (nvs_set_blob(nvs_handle, key_last_time, &info, sizeof(info)) == ESP_OK) {
+            nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+}
+
+// Mains powered loop: light sleep between ticks keeps the display, storage
+// and framebuffers initialized, the timer or the button wakes it up.
+void resident_loop(void) {
+    setup_wakeup_int();
+    first_run = false;
+    while (true) {
+        esp_sleep_wakeup_cause_t cause = lightsleep();
+        int64_t tick_start = esp_timer_get_time();
+        button_wake = cause == ESP_SLEEP_WAKEUP_EXT1;
+        if (button_wake) {
+            ESP_LOGI(TAG, "Woken up by button");
+        }
+        do_sync_time();
+        do_clean_screen();
+        do_shuffle_images();
+        do_download_display();
+        do_sync_time();
+        if (wifi_is_started()) {
+            wifi_stop_sta();
+        }
+        display_time_tick();
+        update_panel();
+        ESP_LOGI(TAG, "Tick awake %lld ms", (esp_timer_get_time() - tick_start) / 1000);
+    }
+}
+#endif
+
 void app_main(void) {
     esp_err_t ret;
     ESP_LOGI(TAG, "START!");
     print_reset_reason();
+    first_run = esp_reset_reason() != ESP_RST_DEEPSLEEP;
+    button_wake = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT1;
+    wake_correct_clock();
 
     do_epd_init();
 
@@ -1375,6 +1877,9 @@ void app_main(void) {
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    if (first_run) {
+        wake_load_drift();
+    }
 
     // launch task_joysticks task
     xTaskCreate(task_joysticks, "task_joysticks", 1024 * 2, NULL, 5, NULL);
@@ -1395,8 +1900,15 @@ void app_main(void) {
     do_shuffle_images();
 
     bool download_done = do_download_display();
+    // if deferred and the download never got as far as the Date check
+    do_sync_time();
 
     do_display_img_time(download_done);
 
+#if (RUN_MODE == RUN_MODE_RESIDENT)
+    update_panel();
+    resident_loop();
+#else
     finish_system();
+#endif
 }
@@ -127,3 +127,65 @@ esp_err_t fb_load_compressed_file(const char *filename, uint8_t *dest) {
   }
   return ESP_OK;
 }
+
+esp_err_t fb_save_band(const char *filename, const uint8_t *first,
+                       const uint8_t *second, int row_start, int row_end) {
+  // save rows [row_start, row_end) of two framebuffers, one after the other
+  int pitch = epd_width() / 2;
+  size_t band_size = (row_end - row_start) * pitch;
+  uint8_t *band = heap_caps_malloc(band_size * 2, MALLOC_CAP_SPIRAM);
+  if (!band) {
+    ESP_LOGE(TAG, "Failed to allocate %d bytes for band", band_size * 2);
+    return ESP_ERR_NO_MEM;
+  }
+  memcpy(band, first + row_start * pitch, band_size);
+  memcpy(band + band_size, second + row_start * pitch, band_size);
+  esp_err_t r = compress_mem_to_file(filename, band, band_size * 2,
+                                     FRAME_COMPRESS_LEVEL);
+  if (r != ESP_OK) {
+    ESP_LOGE(TAG, "compress_mem_to_file %s failed!", filename);
+  }
+  free(band);
+  return r;
+}
+
+esp_err_t fb_load_band(const char *filename, uint8_t *first, uint8_t *second,
+                       int row_start, int row_end) {
+  // load a band saved by fb_save_band into the same rows of two framebuffers
+  int pitch = epd_width() / 2;
+  size_t band_size = (row_end - row_start) * pitch;
+  uint8_t *band = heap_caps_malloc(band_size * 2, MALLOC_CAP_SPIRAM);
+  if (!band) {
+    ESP_LOGE(TAG, "Failed to allocate %d bytes for band", band_size * 2);
+    return ESP_ERR_NO_MEM;
+  }
+  esp_err_t r = decompress_file_to_mem(filename, band, band_size * 2);
+  if (r != ESP_OK) {
+    ESP_LOGE(TAG, "decompress_file_to_mem %s failed!", filename);
+  } else {
+    memcpy(first + row_start * pitch, band, band_size);
+    memcpy(second + row_start * pitch, band + band_size, band_size);
+  }
+  free(band);
+  return r;
+}
+
+esp_err_t fb_frame_header_check(const fb_frame_header *header) {
+  if (memcmp(header->magic, FB_FRAME_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != FB_FRAME_VERSION) {
+    ESP_LOGE(TAG, "Not a frame, or unknown version %d", header->version);
+    return ESP_ERR_INVALID_VERSION;
+  }
+  if (header->bpp != 4 || header->compression != 1 ||
+      header->rotation != epd_get_rotation() ||
+      header->width != epd_rotated_display_width() ||
+      header->height != epd_rotated_display_height() ||
+      header->length != epd_width() / 2 * epd_height()) {
+    ESP_LOGE(TAG, "Frame is %dx%d %dbpp rotation %d, display is %dx%d rotation %d",
+             header->width, header->height, header->bpp, header->rotation,
+             epd_rotated_display_width(), epd_rotated_display_height(),
+             epd_get_rotation());
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,217 @@
+#include "flash_writer.h"
+#include "common.h"
+#include <string.h>
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "flash_writer";
+
+// queued after the last buffer of a file
+#define FLUSH_MARK (-1)
+// queued to end the writer task
+#define STOP_MARK (-2)
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} ring_buffer;
+
+static ring_buffer ring[FLASH_WRITER_BUFFERS];
+static QueueHandle_t free_buffers = NULL;  // indices ready to be filled
+static QueueHandle_t full_buffers = NULL;  // indices to write, or FLUSH_MARK
+static SemaphoreHandle_t flushed = NULL;  // given for FLUSH_MARK and STOP_MARK
+static FILE *fp = NULL;
+static int filling = -1;                   // buffer the network side copies into
+static volatile bool write_failed = false;
+
+// stats of the open file
+static uint64_t bytes_queued;
+static int high_water;
+static uint32_t stalls;
+static int64_t stall_us;
+
+static void writer_task(void *arg) {
+    int i;
+    while (xQueueReceive(full_buffers, &i, portMAX_DELAY) == pdTRUE) {
+        if (i == FLUSH_MARK) {
+            xSemaphoreGive(flushed);
+            continue;
+        }
+        if (i == STOP_MARK) {
+            xSemaphoreGive(flushed);
+            vTaskDelete(NULL);
+        }
+        if (!write_failed && fwrite(ring[i].data, 1, ring[i].len, fp) != ring[i].len) {
+            ESP_LOGE(TAG, "fwrite of %d bytes failed", ring[i].len);
+            write_failed = true;
+        }
+        xQueueSend(free_buffers, &i, portMAX_DELAY);
+    }
+}
+
+static void flash_writer_free(void) {
+    for (int i = 0; i < FLASH_WRITER_BUFFERS; i++) {
+        free(ring[i].data);
+        ring[i].data = NULL;
+    }
+    if (free_buffers) {
+        vQueueDelete(free_buffers);
+        free_buffers = NULL;
+    }
+    if (full_buffers) {
+        vQueueDelete(full_buffers);
+        full_buffers = NULL;
+    }
+    if (flushed) {
+        vSemaphoreDelete(flushed);
+        flushed = NULL;
+    }
+}
+
+// Buffers and task are kept until `flash_writer_deinit', without them writes
+// are synchronous
+static esp_err_t flash_writer_init(void) {
+    if (free_buffers) {
+        return ESP_OK;
+    }
+    for (int i = 0; i < FLASH_WRITER_BUFFERS; i++) {
+        ring[i].data = heap_caps_malloc(FLASH_WRITER_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
+        if (!ring[i].data) {
+            ESP_LOGE(TAG, "Failed to allocate ring buffer %d", i);
+            goto cleanup;
+        }
+    }
+    free_buffers = xQueueCreate(FLASH_WRITER_BUFFERS, sizeof(int));
+    full_buffers = xQueueCreate(FLASH_WRITER_BUFFERS + 1, sizeof(int));
+    flushed = xSemaphoreCreateBinary();
+    if (!free_buffers || !full_buffers || !flushed) {
+        ESP_LOGE(TAG, "Failed to create queues");
+        goto cleanup;
+    }
+    for (int i = 0; i < FLASH_WRITER_BUFFERS; i++) {
+        xQueueSend(free_buffers, &i, 0);
+    }
+    if (xTaskCreate(writer_task, "flash_writer", 1024 * 4, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start writer task");
+        goto cleanup;
+    }
+    return ESP_OK;
+
+cleanup:
+    flash_writer_free();
+    return ESP_ERR_NO_MEM;
+}
+
+bool flash_writer_is_open(void) {
+    return fp != NULL;
+}
+
+esp_err_t flash_writer_open(const char *filename, const char *mode) {
+    if (fp) {
+        ESP_LOGW(TAG, "Closing the previous file");
+        flash_writer_close();
+    }
+    if (flash_writer_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Writing synchronously");
+    }
+    fp = fopen(filename, mode);
+    if (!fp) {
+        ESP_LOGE(TAG, "Failed to open %s", filename);
+        return ESP_FAIL;
+    }
+    filling = -1;
+    write_failed = false;
+    bytes_queued = 0;
+    high_water = 0;
+    stalls = 0;
+    stall_us = 0;
+    return ESP_OK;
+}
+
+esp_err_t flash_writer_write(const void *data, size_t len) {
+    if (!fp) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (write_failed) {
+        return ESP_FAIL;
+    }
+    bytes_queued += len;
+    if (!free_buffers) {
+        if (fwrite(data, 1, len, fp) != len) {
+            ESP_LOGE(TAG, "fwrite of %d bytes failed", len);
+            write_failed = true;
+        }
+        return write_failed ? ESP_FAIL : ESP_OK;
+    }
+    const uint8_t *src = data;
+    while (len) {
+        if (filling < 0) {
+            if (xQueueReceive(free_buffers, &filling, 0) != pdTRUE) {
+                // ring full, flash is slower than the network
+                int64_t stall_start = esp_timer_get_time();
+                xQueueReceive(free_buffers, &filling, portMAX_DELAY);
+                stall_us += esp_timer_get_time() - stall_start;
+                stalls++;
+            }
+            ring[filling].len = 0;
+            int in_use = FLASH_WRITER_BUFFERS - uxQueueMessagesWaiting(free_buffers);
+            if (in_use > high_water) {
+                high_water = in_use;
+            }
+        }
+        ring_buffer *buf = &ring[filling];
+        size_t n = FLASH_WRITER_BUFFER_SIZE - buf->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf->data + buf->len, src, n);
+        buf->len += n;
+        src += n;
+        len -= n;
+        if (buf->len == FLASH_WRITER_BUFFER_SIZE) {
+            xQueueSend(full_buffers, &filling, portMAX_DELAY);
+            filling = -1;
+        }
+    }
+    return write_failed ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t flash_writer_close(void) {
+    if (!fp) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (free_buffers) {
+        int64_t flush_start = esp_timer_get_time();
+        if (filling >= 0) {
+            xQueueSend(full_buffers, &filling, portMAX_DELAY);
+            filling = -1;
+        }
+        int mark = FLUSH_MARK;
+        xQueueSend(full_buffers, &mark, portMAX_DELAY);
+        xSemaphoreTake(flushed, portMAX_DELAY);
+        ESP_LOGI(TAG, "%llu bytes, ring high-water %d/%d buffers, %" PRIu32 " stalls for %lld ms, flush %lld ms",
+                 bytes_queued, high_water, FLASH_WRITER_BUFFERS, stalls, stall_us / 1000,
+                 (esp_timer_get_time() - flush_start) / 1000);
+    }
+    esp_err_t err = write_failed ? ESP_FAIL : ESP_OK;
+    if (fclose(fp) != 0) {
+        ESP_LOGE(TAG, "fclose failed");
+        err = ESP_FAIL;
+    }
+    fp = NULL;
+    return err;
+}
+
+void flash_writer_deinit(void) {
+    if (fp) {
+        ESP_LOGW(TAG, "Closing the open file");
+        flash_writer_close();
+    }
+    if (free_buffers) {
+        // the task holds no buffer once it has taken the mark
+        int mark = STOP_MARK;
+        xQueueSend(full_buffers, &mark, portMAX_DELAY);
+        xSemaphoreTake(flushed, portMAX_DELAY);
+    }
+    flash_writer_free();
+}
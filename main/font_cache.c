@@ -0,0 +1,107 @@
+#include "font_cache.h"
+#include "common.h"
+
+const static char *TAG = "font_cache";
+
+static const EpdFont *cached_src = NULL;
+static EpdFont cached_font;
+static EpdGlyph *cached_glyphs = NULL;
+static uint8_t *cached_bitmap = NULL;
+static bool *glyph_ready = NULL;
+
+static size_t glyph_size(const EpdGlyph *glyph) {
+  // 4bpp, rows padded to whole bytes
+  return (glyph->width / 2 + glyph->width % 2) * glyph->height;
+}
+
+static int glyph_count(const EpdFont *font) {
+  int count = 0;
+  for (int i = 0; i < font->interval_count; i++) {
+    const EpdUnicodeInterval *interval = &font->intervals[i];
+    int end = interval->offset + interval->last - interval->first + 1;
+    if (end > count) {
+      count = end;
+    }
+  }
+  return count;
+}
+
+static esp_err_t font_cache_init(const EpdFont *src) {
+  int count = glyph_count(src);
+  size_t bitmap_size = 0;
+  for (int i = 0; i < count; i++) {
+    bitmap_size += glyph_size(&src->glyph[i]);
+  }
+  cached_glyphs = heap_caps_malloc(sizeof(EpdGlyph) * count, MALLOC_CAP_SPIRAM);
+  cached_bitmap = heap_caps_malloc(bitmap_size, MALLOC_CAP_SPIRAM);
+  glyph_ready = calloc(count, sizeof(bool));
+  if (!cached_glyphs || !cached_bitmap || !glyph_ready) {
+    ESP_LOGE(TAG, "Failed to allocate %d bytes for %d glyphs", bitmap_size,
+             count);
+    free(cached_glyphs);
+    free(cached_bitmap);
+    free(glyph_ready);
+    cached_glyphs = NULL;
+    cached_bitmap = NULL;
+    glyph_ready = NULL;
+    return ESP_ERR_NO_MEM;
+  }
+  size_t offset = 0;
+  for (int i = 0; i < count; i++) {
+    cached_glyphs[i] = src->glyph[i];
+    cached_glyphs[i].data_offset = offset;
+    offset += glyph_size(&src->glyph[i]);
+  }
+  cached_font = *src;
+  cached_font.bitmap = cached_bitmap;
+  cached_font.glyph = cached_glyphs;
+  cached_font.compressed = false;
+  cached_src = src;
+  ESP_LOGI(TAG, "Glyph cache for %d glyphs, %d KiB", count, bitmap_size / 1024);
+  return ESP_OK;
+}
+
+static esp_err_t inflate_glyph(const EpdFont *src, int index) {
+  const EpdGlyph *glyph = &src->glyph[index];
+  uLongf dest_len = glyph_size(glyph);
+  if (dest_len == 0) {
+    glyph_ready[index] = true;
+    return ESP_OK;
+  }
+  int ret = uncompress(cached_bitmap + cached_glyphs[index].data_offset,
+                       &dest_len, src->bitmap + glyph->data_offset,
+                       glyph->compressed_size);
+  if (ret != Z_OK || dest_len != glyph_size(glyph)) {
+    ESP_LOGE(TAG, "Failed to inflate glyph %d: %d", index, ret);
+    return ESP_FAIL;
+  }
+  glyph_ready[index] = true;
+  return ESP_OK;
+}
+
+const EpdFont *font_cache_get(const EpdFont *src, const char *text) {
+  if (!src->compressed) {
+    return src;
+  }
+  if (cached_src != src) {
+    if (cached_src != NULL || font_cache_init(src) != ESP_OK) {
+      // only one font is cached
+      return src;
+    }
+  }
+  for (const char *c = text; *c; c++) {
+    if (*c == '\n') {
+      continue;
+    }
+    const EpdGlyph *glyph = epd_get_glyph(src, (uint8_t)*c);
+    if (!glyph) {
+      // let the renderer handle missing glyphs its own way
+      return src;
+    }
+    int index = glyph - src->glyph;
+    if (!glyph_ready[index] && inflate_glyph(src, index) != ESP_OK) {
+      return src;
+    }
+  }
+  return &cached_font;
+}
@@ -0,0 +1,226 @@
+#include "http_stream.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+
+static const char *TAG = "http_stream";
+
+void http_stream_init(http_stream *s, http_stream_header_cb on_header,
+                      http_stream_body_cb on_body, void *ctx) {
+  memset(s, 0, sizeof(*s));
+  s->on_header = on_header;
+  s->on_body = on_body;
+  s->ctx = ctx;
+  s->content_length = -1;
+  s->state = HTTP_STREAM_STATUS;
+}
+
+bool http_stream_done(const http_stream *s) {
+  return s->state == HTTP_STREAM_DONE;
+}
+
+static esp_err_t deliver(http_stream *s, const uint8_t *data, size_t len) {
+  s->received += len;
+  return s->on_body ? s->on_body(s->ctx, data, len) : ESP_OK;
+}
+
+// Body framing once the headers are done, RFC 9112 6.3
+static void begin_body(http_stream *s) {
+  if (s->status < 200 || s->status == 204 || s->status == 304) {
+    // no body, skip interim responses such as 100 Continue
+    s->state = s->status < 200 ? HTTP_STREAM_STATUS : HTTP_STREAM_DONE;
+    s->content_length = -1;
+    s->chunked = false;
+  } else if (s->chunked) {
+    s->state = HTTP_STREAM_CHUNK_SIZE;
+  } else if (s->content_length >= 0) {
+    s->remaining = s->content_length;
+    s->state = s->remaining ? HTTP_STREAM_BODY : HTTP_STREAM_DONE;
+  } else {
+    s->state = HTTP_STREAM_BODY_CLOSE;
+  }
+}
+
+static esp_err_t parse_status(http_stream *s, char *line) {
+  // HTTP/1.x 200 OK
+  if (strncmp(line, "HTTP/1.", 7) != 0 || !line[7] || line[8] != ' ') {
+    ESP_LOGE(TAG, "Bad status line: %s", line);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  char *end;
+  long status = strtol(line + 9, &end, 10);
+  if (end != line + 12 || status < 100 || status > 999) {
+    ESP_LOGE(TAG, "Bad status line: %s", line);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  s->status = status;
+  s->state = HTTP_STREAM_HEADER;
+  return ESP_OK;
+}
+
+static esp_err_t parse_header(http_stream *s, char *line) {
+  if (!line[0]) {
+    begin_body(s);
+    return ESP_OK;
+  }
+  char *value = strchr(line, ':');
+  if (!value) {
+    ESP_LOGE(TAG, "Bad header: %s", line);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  *value++ = 0;
+  value += strspn(value, " \t");
+  size_t n = strlen(value);
+  while (n && (value[n - 1] == ' ' || value[n - 1] == '\t')) {
+    value[--n] = 0;
+  }
+  if (strcasecmp(line, "Content-Length") == 0) {
+    char *end;
+    long long length = strtoll(value, &end, 10);
+    if (end == value || *end || length < 0) {
+      ESP_LOGE(TAG, "Bad Content-Length: %s", value);
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    s->content_length = length;
+  } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+    // chunked is always the last coding, and overrides Content-Length
+    n = strlen(value);
+    s->chunked = n >= 7 && strcasecmp(value + n - 7, "chunked") == 0;
+  }
+  return s->on_header ? s->on_header(s->ctx, line, value) : ESP_OK;
+}
+
+static esp_err_t parse_chunk_size(http_stream *s, char *line) {
+  // hex size, optionally followed by `;extensions'
+  char *end;
+  unsigned long long size = strtoull(line, &end, 16);
+  if (end == line || (*end && *end != ';' && *end != ' ' && *end != '\t')) {
+    ESP_LOGE(TAG, "Bad chunk size: %s", line);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  s->remaining = size;
+  s->state = size ? HTTP_STREAM_CHUNK_DATA : HTTP_STREAM_TRAILER;
+  return ESP_OK;
+}
+
+static esp_err_t parse_line(http_stream *s, char *line) {
+  switch (s->state) {
+  case HTTP_STREAM_STATUS:
+    return parse_status(s, line);
+  case HTTP_STREAM_HEADER:
+    return parse_header(s, line);
+  case HTTP_STREAM_CHUNK_SIZE:
+    return parse_chunk_size(s, line);
+  case HTTP_STREAM_CHUNK_END:
+    if (line[0]) {
+      ESP_LOGE(TAG, "Missing CRLF after chunk");
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    s->state = HTTP_STREAM_CHUNK_SIZE;
+    return ESP_OK;
+  case HTTP_STREAM_TRAILER:
+    // trailer fields are ignored
+    if (!line[0]) {
+      s->state = HTTP_STREAM_DONE;
+    }
+    return ESP_OK;
+  default:
+    return ESP_ERR_INVALID_STATE;
+  }
+}
+
+esp_err_t http_stream_feed(http_stream *s, const uint8_t *data, size_t len) {
+  size_t i = 0;
+  while (i < len && s->state != HTTP_STREAM_DONE) {
+    size_t n = len - i;
+    esp_err_t err = ESP_OK;
+    switch (s->state) {
+    case HTTP_STREAM_BODY_CLOSE:
+      err = deliver(s, data + i, n);
+      i += n;
+      break;
+    case HTTP_STREAM_BODY:
+    case HTTP_STREAM_CHUNK_DATA:
+      if (n > s->remaining) {
+        n = s->remaining;
+      }
+      err = deliver(s, data + i, n);
+      i += n;
+      s->remaining -= n;
+      if (!s->remaining) {
+        s->state = s->state == HTTP_STREAM_BODY ? HTTP_STREAM_DONE
+                                                : HTTP_STREAM_CHUNK_END;
+      }
+      break;
+    default: {
+      // collect a line, without CR LF
+      const uint8_t *lf = memchr(data + i, '\n', n);
+      size_t take = lf ? (size_t)(lf - (data + i)) : n;
+      size_t room = sizeof(s->line) - 1 - s->line_len;
+      memcpy(s->line + s->line_len, data + i, take < room ? take : room);
+      s->line_len += take < room ? take : room;
+      i += take;
+      if (lf) {
+        i++;
+        if (s->line_len && s->line[s->line_len - 1] == '\r') {
+          s->line_len--;
+        }
+        s->line[s->line_len] = 0;
+        s->line_len = 0;
+        err = parse_line(s, s->line);
+      }
+      break;
+    }
+    }
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t http_stream_finish(http_stream *s) {
+  if (s->state == HTTP_STREAM_BODY_CLOSE) {
+    s->state = HTTP_STREAM_DONE;
+  }
+  if (s->state != HTTP_STREAM_DONE) {
+    ESP_LOGE(TAG, "Connection closed early, status %d, %llu bytes of body",
+             s->status, (unsigned long long)s->received);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
+
+bool http_url_host(const char *url, char *host, size_t host_len, char *port,
+                   size_t port_len) {
+  bool https = strncasecmp(url, "https://", 8) == 0;
+  const char *start = strstr(url, "://");
+  start = start ? start + 3 : url;
+  size_t n = strcspn(start, ":/?#");
+  if (n >= host_len) {
+    n = host_len - 1;
+  }
+  memcpy(host, start, n);
+  host[n] = 0;
+  const char *colon = start + strcspn(start, ":/?#");
+  if (*colon == ':') {
+    n = strcspn(colon + 1, "/?#");
+    if (n >= port_len) {
+      n = port_len - 1;
+    }
+    memcpy(port, colon + 1, n);
+    port[n] = 0;
+  } else {
+    strncpy(port, https ? "443" : "80", port_len - 1);
+    port[port_len - 1] = 0;
+  }
+  return https;
+}
+
+const char *http_url_path(const char *url) {
+  const char *start = strstr(url, "://");
+  start = start ? start + 3 : url;
+  start += strcspn(start, "/?#");
+  return *start && *start != '#' ? start : "/";
+}
@@ -0,0 +1,304 @@
+#include "image_draw.h"
+#include <stdlib.h>
+#include "epdiy.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if defined(ESP_PLATFORM) || defined(HAVE_TJPGD)
+uint32_t tjd_output(
+    JDEC* jd,     /* Decompressor object of current session */
+    void* bitmap, /* Bitmap data to be output */
+    JRECT* rect   /* Rectangular region to output */
+) {
+    vTaskDelay(0);
+
+    uint32_t w = rect->right - rect->left + 1;
+    uint32_t h = rect->bottom - rect->top + 1;
+    uint32_t image_width = jd->width;
+    uint32_t image_height = jd->height;
+    uint8_t* bitmap_ptr = (uint8_t*)bitmap;
+
+    // Write to display
+    int padding_x = (epd_rotated_display_width() - image_width) / 2;
+    int padding_y = (epd_rotated_display_height() - image_height) / 2;
+    
+    for (uint32_t i = 0; i < w * h; i++) {
+        uint8_t r = *(bitmap_ptr++);
+        uint8_t g = *(bitmap_ptr++);
+        uint8_t b = *(bitmap_ptr++);
+
+        // Calculate weighted grayscale
+        // uint32_t val = ((r * 30 + g * 59 + b * 11) / 100); // original formula
+        uint32_t val = (r * 38 + g * 75 + b * 15) >> 7;  // @vroland recommended formula
+
+        int xx = rect->left + i % w;
+        if (xx < 0 || xx >= image_width) {
+            continue;
+        }
+        int yy = rect->top + i / w;
+        if (yy < 0 || yy >= image_height) {
+            continue;
+        }
+
+        /* Optimization note: If we manage to apply here the epd_draw_pixel directly
+           then it will be no need to keep a huge raw buffer (But will loose dither) */
+        // decoded_image[yy * image_width + xx] = gamme_curve[val];
+        epd_draw_pixel(xx + padding_x, yy + padding_y, gamme_curve[val], jd->device);
+    }
+
+    return 1;
+}
+#endif
+
+#if JPEG_DECODE_JPEGDEC
+int jpegdec_scale_option(int scale) {
+    return (scale == 1) ? JPEG_SCALE_HALF : (scale == 2) ? JPEG_SCALE_QUARTER : (scale == 3) ? JPEG_SCALE_EIGHTH : 0;
+}
+
+int jpegdec_scale(JPEGIMAGE *jpeg, int *width, int *height) {
+    *width = JPEG_getWidth(jpeg);
+    *height = JPEG_getHeight(jpeg);
+    if (JPEG_DECODE_EXIF_ROTATE && JPEG_getOrientation(jpeg) >= 5) {
+        *width = JPEG_getHeight(jpeg);
+        *height = JPEG_getWidth(jpeg);
+    }
+    int scale = 0;
+    // shrink like render_pixel_skip, the scaled modes use the reduced size IDCTs
+    while (JPEG_DECODE_SCALE && scale < 3 && ((*width >> scale) > epd_rotated_display_width() * 2 ||
+                                              (*height >> scale) > epd_rotated_display_height() * 2)) {
+        scale++;
+    }
+    int dw = epd_rotated_display_width();
+    int dh = epd_rotated_display_height();
+    // a portrait photo on a landscape display (or the other way round) fills
+    // it one step larger, cropped by jpegdec_crop() instead of letterboxed
+    if (JPEG_DECODE_SMART_CROP && scale > 0 && (*width > *height) != (dw > dh) &&
+        ((*width >> scale) < dw || (*height >> scale) < dh) &&
+        (*width >> (scale - 1)) >= dw && (*height >> (scale - 1)) >= dh) {
+        scale--;
+    }
+    if (JPEG_getJPEGType(jpeg) == JPEG_MODE_PROGRESSIVE) {
+        // every scan refines the whole image, the coefficients are kept until the last one
+        while (scale < 3 && JPEG_getProgressiveSize(jpeg, jpegdec_scale_option(scale)) > JPEG_DECODE_PROGRESSIVE_BUF) {
+            scale++;
+        }
+        if (JPEG_getProgressiveSize(jpeg, jpegdec_scale_option(scale)) > JPEG_DECODE_PROGRESSIVE_BUF) {
+            ESP_LOGW(__func__, "progressive JPEG needs %d bytes of coefficients",
+                     JPEG_getProgressiveSize(jpeg, jpegdec_scale_option(scale)));
+            return -1;
+        }
+    }
+    return scale;
+}
+
+#if THUMB_PREVIEW || JPEG_DECODE_SMART_CROP
+void exif_stored_pixel(int orientation, int u, int v, int w, int h, int *x, int *y) {
+    switch (orientation) {
+        case 2:
+            *x = w - 1 - u;
+            *y = v;
+            break;
+        case 3:
+            *x = w - 1 - u;
+            *y = h - 1 - v;
+            break;
+        case 4:
+            *x = u;
+            *y = h - 1 - v;
+            break;
+        case 5:
+            *x = v;
+            *y = u;
+            break;
+        case 6:
+            *x = v;
+            *y = h - 1 - u;
+            break;
+        case 7:
+            *x = w - 1 - v;
+            *y = h - 1 - u;
+            break;
+        case 8:
+            *x = w - 1 - v;
+            *y = u;
+            break;
+        default:
+            *x = u;
+            *y = v;
+            break;
+    }
+}
+#endif
+
+#if JPEG_DECODE_SMART_CROP
+// the block grid is summed into at most this many cells a side for the search
+#define CROP_CELLS 128
+
+// sum of the `w' x `h' cells at (u, v) from a summed area table
+static uint32_t sat_sum(const uint32_t *sat, int stride, int u, int v, int w, int h) {
+    return sat[(v + h) * stride + u + w] - sat[v * stride + u + w] - sat[(v + h) * stride + u] + sat[v * stride + u];
+}
+
+esp_err_t jpegdec_crop(JPEGIMAGE *jpeg, int width, int height, int scale, int *x, int *y) {
+    if (JPEG_getJPEGType(jpeg) == JPEG_MODE_PROGRESSIVE &&
+        JPEG_getProgressiveSize(jpeg, JPEG_SCALE_QUARTER) > JPEG_DECODE_PROGRESSIVE_BUF) {
+        // the saliency of progressive images comes from their 1/4 scale coefficients
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = ESP_FAIL;
+    uint32_t *sat = NULL;
+    int bw = (JPEG_getWidth(jpeg) + 7) / 8; // stored 8x8 luma blocks
+    int bh = (JPEG_getHeight(jpeg) + 7) / 8;
+    int orientation = JPEG_DECODE_EXIF_ROTATE ? JPEG_getOrientation(jpeg) : 1;
+    int uw = orientation >= 5 ? bh : bw;
+    int uh = orientation >= 5 ? bw : bh;
+    uint8_t *map = heap_caps_malloc(bw * bh, MALLOC_CAP_SPIRAM);
+    if (!map) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (!JPEG_getSaliency(jpeg, map)) {
+        ESP_LOGW(__func__, "JPEGDEC saliency failed: %d", JPEG_getLastError(jpeg));
+        goto cleanup;
+    }
+    int shift = 0; // cells of 1 << shift blocks a side
+    while ((uw >> shift) > CROP_CELLS || (uh >> shift) > CROP_CELLS) {
+        shift++;
+    }
+    int cw = ((uw - 1) >> shift) + 1;
+    int ch = ((uh - 1) >> shift) + 1;
+    // summed area table of the upright cells, row and column 0 stay 0
+    sat = heap_caps_calloc((cw + 1) * (ch + 1), sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+    if (!sat) {
+        ret = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    for (int v = 0; v < uh; v++) {
+        for (int u = 0; u < uw; u++) {
+            int sx, sy;
+            exif_stored_pixel(orientation, u, v, bw, bh, &sx, &sy);
+            sat[((v >> shift) + 1) * (cw + 1) + (u >> shift) + 1] += map[sy * bw + sx];
+        }
+    }
+    for (int v = 1; v <= ch; v++) {
+        for (int u = 1; u <= cw; u++) {
+            sat[v * (cw + 1) + u] += sat[(v - 1) * (cw + 1) + u] + sat[v * (cw + 1) + u - 1] - sat[(v - 1) * (cw + 1) + u - 1];
+        }
+    }
+    // the display in cells, at full size
+    int cell = 8 << shift;
+    int dw = epd_rotated_display_width();
+    int dh = epd_rotated_display_height();
+    int ww = cw, wh = ch;
+    if ((width >> scale) > dw) {
+        ww = ((dw << scale) + cell / 2) / cell;
+        ww = ww < 1 ? 1 : ww > cw ? cw : ww;
+    }
+    if ((height >> scale) > dh) {
+        wh = ((dh << scale) + cell / 2) / cell;
+        wh = wh < 1 ? 1 : wh > ch ? ch : wh;
+    }
+    // of equally salient windows the one closest to the centre wins, so a
+    // subject with plain surroundings isn't pushed against an edge
+    int centre_u = (cw - ww) / 2, centre_v = (ch - wh) / 2;
+    int best_u = centre_u, best_v = centre_v;
+    uint32_t best = sat_sum(sat, cw + 1, best_u, best_v, ww, wh);
+    for (int v = 0; v <= ch - wh; v++) {
+        for (int u = 0; u <= cw - ww; u++) {
+            uint32_t sum = sat_sum(sat, cw + 1, u, v, ww, wh);
+            if (sum > best || (sum == best && abs(u - centre_u) + abs(v - centre_v) <
+                                                  abs(best_u - centre_u) + abs(best_v - centre_v))) {
+                best = sum;
+                best_u = u;
+                best_v = v;
+            }
+        }
+    }
+    if ((width >> scale) > dw) {
+        *x = -((best_u * cell) >> scale);
+        *x = *x < dw - (width >> scale) ? dw - (width >> scale) : *x;
+    }
+    if ((height >> scale) > dh) {
+        *y = -((best_v * cell) >> scale);
+        *y = *y < dh - (height >> scale) ? dh - (height >> scale) : *y;
+    }
+    ESP_LOGI(__func__, "crop at %d,%d of %dx%d", -*x, -*y, width >> scale, height >> scale);
+    ret = ESP_OK;
+cleanup:
+    free(sat);
+    free(map);
+    return ret;
+}
+#endif
+#endif
+
+#if defined(ESP_PLATFORM) || defined(HAVE_PNGLE)
+void on_draw_png(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint8_t rgba[4]) {
+    uint32_t r = rgba[0]; // 0 - 255
+    uint32_t g = rgba[1]; // 0 - 255
+    uint32_t b = rgba[2]; // 0 - 255
+    uint32_t a = rgba[3]; // 0: fully transparent, 255: fully opaque
+
+    uint32_t image_width = pngle_get_width(pngle);
+    uint32_t image_height = pngle_get_height(pngle);
+    int epd_width = epd_rotated_display_width();
+    int epd_height = epd_rotated_display_height();
+
+    if (render_pixel_skip == 0xff) {
+        render_pixel_skip = 0;
+        if (image_width > epd_width * 2 || image_height > epd_height * 2) {
+            render_pixel_skip = 2;
+        }
+        return;
+    }
+    if (render_pixel_skip) {
+        image_width = image_width / render_pixel_skip;
+        image_height = image_height / render_pixel_skip;
+    }
+
+    int padding_x = (epd_width - image_width) / 2;
+    int padding_y = (epd_height - image_height) / 2;
+
+    // if (a == 0) {
+    //     // skip transparent pixels
+    //     return;
+    // }
+
+    uint32_t val = (r * 38 + g * 75 + b * 15) >> 7;  // @vroland recommended formula
+    // use alpha in white background
+    val = (a == 0) ? 255 : val;
+    // val = (val * 256 / (256 - a)) & 0xff;
+    uint8_t color = gamme_curve[val];
+
+    // print info
+    // static int cnt = 0;
+    // if (cnt % 100 == 0)
+    //     ESP_LOGI("PNG", "x: %d y: %d w: %d h: %d r: %d g: %d b: %d a: %d val: %d px: %d py: %d color: %x", 
+    //     x, y, w, h, r, g, b, a, val, padding_x, padding_y, color);
+    // cnt++;
+
+    if (render_pixel_skip == 0) {
+        for (uint32_t yy = 0; yy < h; yy++) {
+            for (uint32_t xx = 0; xx < w; xx++) {
+                epd_draw_pixel(xx + x + padding_x, 
+                    yy + y + padding_y, 
+                    color, pngle_get_user_data(pngle));
+            }
+        }
+    } else {
+        for (uint32_t yy = 0; yy < h; yy++) {
+            for (uint32_t xx = 0; xx < w; xx++) {
+                int xxx = xx + x;
+                int yyy = yy + y;
+                if (xxx % render_pixel_skip != 0 || yyy % render_pixel_skip != 0) {
+                    continue;
+                }
+                epd_draw_pixel(xxx / render_pixel_skip + padding_x, 
+                    yyy / render_pixel_skip + padding_y, 
+                    color, pngle_get_user_data(pngle));
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef __CLOCK_RENDER_H__
+#define __CLOCK_RENDER_H__
+
+#include "common.h"
+
+#define CLOCK_TEXT_MAX 24
+#define CLOCK_DIRTY_MAX 8
+
+typedef struct {
+    char c;
+    int pen_x;
+    EpdRect rect;  // glyph bounding box, rotated coordinates
+} clock_cell;
+
+typedef struct {
+    const EpdFont *font;
+    EpdFontProperties props;
+    int x;          // horizontal center of the string
+    int y;          // baseline
+    int digit_advance;
+    int count;      // cells on the framebuffer, -1 when nothing is drawn yet
+    clock_cell cells[CLOCK_TEXT_MAX];
+} clock_renderer;
+
+void clock_render_init(clock_renderer *r, const EpdFont *font, EpdFontProperties props, int x, int y);
+// forget what was drawn, next draw assumes a clean background
+void clock_render_reset(clock_renderer *r);
+// Draw `text' centered at the renderer origin. Only glyph cells that differ
+// from the previous draw are restored from `bg' and redrawn. Fills up to
+// `max_dirty' changed rectangles and returns their count.
+int clock_render_draw(clock_renderer *r, const char *text, uint8_t *fb, uint8_t *bg, EpdRect *dirty, int max_dirty);
+
+#endif
@@ -52,8 +52,9 @@
 #include "rom/tjpgd.h"
 #endif
 #include "pngle.h"
+#include "JPEGDEC.h"
 
-void deepsleep();
+#include "sleep.h"
 
 extern EpdiyHighlevelState hl;
 
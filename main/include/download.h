@@ -0,0 +1,80 @@
+#ifndef __DOWNLOAD_H__
+#define __DOWNLOAD_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "fb_save_load.h"
+#include "http_stream.h"
+
+// Partial body of the image being downloaded, kept between retries
+typedef struct download_resume_t {
+    char url[512];        // final URL after redirects
+    char validator[64];   // ETag, or Last-Modified without an ETag
+    char range_validator[64]; // strong ETag, else Last-Modified, for `If-Range'
+    char pending[64];     // validators of the response being received
+    char pending_range[64];
+    uint32_t received;    // body bytes in the file
+    uint32_t total;       // full body length, 0 when unknown
+    uint32_t range_start; // first byte of a 206 response
+    bool pending_native;  // Content-Type of the response being received
+    bool native;          // body is a pre-rendered frame
+    uint8_t header_len;   // bytes of `header' received
+    fb_frame_header header;
+} download_resume;
+
+extern download_resume resume;
+
+void download_resume_reset(void);
+// Whether the next request continues `resume' from `resume.url'
+bool download_resuming(void);
+
+// Clock checked against the `Date' header of image responses
+typedef struct date_check_t {
+    bool valid;
+    int64_t offset_us;  // server time - local time
+    int64_t rtt_us;
+} date_check;
+
+extern date_check date_sync;
+
+// One response to an image request, the context of the callbacks below
+typedef struct download_response_t {
+    http_stream stream;
+    const char *url;       // requested URL
+    const char *file;      // where a 200 body, or a 206 continuing `resume', goes
+    char location[512];    // `Location' of a redirect
+    bool opened;           // the body is written to `file'
+    bool skip_body;        // redirect and error bodies are not the image
+    bool failed;
+    uint32_t on_data_cnt;
+    int64_t time_start;
+} download_response;
+
+// GET request for `url' into `buf'. Continues `resume' when resuming, else is
+// conditional on `revalidate' unless NULL. `headers' are added as they are.
+esp_err_t download_request_format(char *buf, size_t len, const char *url, bool resuming,
+                                  const char *revalidate, const char *headers);
+void download_response_init(download_response *r, const char *url, const char *file);
+// http_stream callbacks, `ctx' is the download_response
+esp_err_t download_on_header(void *ctx, const char *key, const char *value);
+esp_err_t download_on_body(void *ctx, const uint8_t *data, size_t len);
+// Wait for the file to reach flash and close it, after the transport
+// returned `err'. A failed or incomplete body is deleted. ESP_OK for a
+// complete image, or for a 304 which writes nothing.
+esp_err_t download_response_finish(download_response *r, esp_err_t err);
+// `location' of a redirect from `url', resolved into `out'.
+esp_err_t download_redirect_url(const char *url, const char *location, char *out, size_t len);
+
+// Sends `request' to `url' and parses the response into `stream',
+// https_request_stream in the firmware.
+typedef esp_err_t (*download_transport)(const char *url, const char *request, http_stream *stream);
+
+// Request `url' through `transport', following redirects, and write the
+// image to `file', continuing `resume' when it can. `url' ends up as the
+// final URL. `status' is that of the last response, with ESP_OK a 304 or an
+// image in `file'.
+esp_err_t download_fetch(download_transport transport, char *url, size_t url_len, const char *file,
+                         const char *revalidate, const char *headers, int *status);
+
+#endif
@@ -1,12 +1,37 @@
 #ifndef __FB_SAVE_LOAD_H__
 #define __FB_SAVE_LOAD_H__
 
-#include "common.h"
+#include <stdint.h>
+#include "esp_err.h"
 
 esp_err_t fb_save_raw();
 esp_err_t fb_save_compressed();
 esp_err_t fb_load();
 esp_err_t fb_load_compressed();
 esp_err_t fb_load_compressed_file(const char *filename, uint8_t *dest);
+esp_err_t fb_save_band(const char *filename, const uint8_t *first,
+                       const uint8_t *second, int row_start, int row_end);
+esp_err_t fb_load_band(const char *filename, uint8_t *first, uint8_t *second,
+                       int row_start, int row_end);
+
+// Header of a pre-rendered frame served by a conversion proxy, followed by
+// the zlib stream of the framebuffer as `fb_load_compressed_file' reads it.
+// Little endian, see scripts/frame_proxy.py.
+typedef struct __attribute__((packed)) {
+  char magic[4];         // FB_FRAME_MAGIC
+  uint8_t version;       // FB_FRAME_VERSION
+  uint8_t bpp;           // 4
+  uint8_t rotation;      // EpdRotation the frame was laid out for
+  uint8_t compression;   // 1 for zlib
+  uint16_t width;        // epd_rotated_display_width()
+  uint16_t height;       // epd_rotated_display_height()
+  uint32_t length;       // uncompressed framebuffer size
+} fb_frame_header;
+
+#define FB_FRAME_MAGIC "EPDF"
+#define FB_FRAME_VERSION 1
+
+// Whether a frame with `header' can be stored and displayed as is.
+esp_err_t fb_frame_header_check(const fb_frame_header *header);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,20 @@
+#ifndef __FLASH_WRITER_H__
+#define __FLASH_WRITER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Open `filename' with fopen `mode' for writing through the writer task.
+// Only one file is written at a time, an open one is closed first.
+esp_err_t flash_writer_open(const char *filename, const char *mode);
+// Copy `data' into the PSRAM ring and return, blocks only while the ring is
+// full. Fails once an earlier write to flash failed.
+esp_err_t flash_writer_write(const void *data, size_t len);
+// Wait for queued data to reach flash and close the file.
+esp_err_t flash_writer_close(void);
+bool flash_writer_is_open(void);
+// Stop the writer task and free the ring, the next open sets them up again.
+void flash_writer_deinit(void);
+
+#endif
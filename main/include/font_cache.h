@@ -0,0 +1,10 @@
+#ifndef __FONT_CACHE_H__
+#define __FONT_CACHE_H__
+
+#include "common.h"
+
+// Uncompressed copy of `src' with every glyph used by `text' inflated into
+// PSRAM. Glyphs are inflated once per boot; falls back to `src' on failure.
+const EpdFont *font_cache_get(const EpdFont *src, const char *text);
+
+#endif
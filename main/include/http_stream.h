@@ -0,0 +1,62 @@
+#ifndef __HTTP_STREAM_H__
+#define __HTTP_STREAM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// longest status, header or chunk size line kept, longer ones are truncated
+#define HTTP_STREAM_LINE_MAX 512
+
+// Called for each response header, `key' and `value' are only valid during the call.
+typedef esp_err_t (*http_stream_header_cb)(void *ctx, const char *key, const char *value);
+// Called with body bytes, pointing into the buffer passed to `http_stream_feed'.
+typedef esp_err_t (*http_stream_body_cb)(void *ctx, const uint8_t *data, size_t len);
+
+typedef enum {
+  HTTP_STREAM_STATUS,
+  HTTP_STREAM_HEADER,
+  HTTP_STREAM_BODY,        // Content-Length bytes left in `remaining'
+  HTTP_STREAM_BODY_CLOSE,  // until the connection closes
+  HTTP_STREAM_CHUNK_SIZE,
+  HTTP_STREAM_CHUNK_DATA,
+  HTTP_STREAM_CHUNK_END,   // CRLF after chunk data
+  HTTP_STREAM_TRAILER,
+  HTTP_STREAM_DONE,
+} http_stream_state;
+
+// Incremental HTTP/1.1 response parser
+typedef struct http_stream_t {
+  http_stream_header_cb on_header;
+  http_stream_body_cb on_body;
+  void *ctx;
+  int status;              // status code, 0 before the status line
+  int64_t content_length;  // -1 when not sent
+  bool chunked;
+  uint64_t received;       // body bytes delivered
+  int64_t sent_us;         // esp_timer when the request was sent, 0 before
+  http_stream_state state;
+  uint64_t remaining;
+  size_t line_len;
+  char line[HTTP_STREAM_LINE_MAX];
+} http_stream;
+
+void http_stream_init(http_stream *s, http_stream_header_cb on_header,
+                      http_stream_body_cb on_body, void *ctx);
+// Parse `len' bytes of the response. Fails on malformed input or when a
+// callback fails; bytes after the end of the response are ignored.
+esp_err_t http_stream_feed(http_stream *s, const uint8_t *data, size_t len);
+// Whole response received
+bool http_stream_done(const http_stream *s);
+// Connection closed, fails if the response was cut short.
+esp_err_t http_stream_finish(http_stream *s);
+
+// Host and port of an http:// or https:// `url', true for https. The port
+// defaults to the scheme's.
+bool http_url_host(const char *url, char *host, size_t host_len, char *port,
+                   size_t port_len);
+// Path and query of `url', "/" when it has none.
+const char *http_url_path(const char *url);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __IMAGE_DRAW_H__
+#define __IMAGE_DRAW_H__
+
+// Decoder output into the framebuffer and the JPEGDEC scale and crop
+// choice. bench/decode_bench builds this file as it is, on the host and
+// without tjpgd or pngle when it can't find them.
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "settings.h"
+#include "JPEGDEC.h"
+
+// gray levels after gamma correction, generate_gamme()
+extern uint8_t gamme_curve[256];
+
+#if defined(ESP_PLATFORM) || defined(HAVE_TJPGD)
+#ifdef ESP_PLATFORM
+// JPG decoder is on ESP32 rom for this version
+#include "esp32/rom/tjpgd.h"
+#else
+#include "tjpgd.h"
+#endif
+// jd_decomp() output, centred in the framebuffer `jd->device'
+uint32_t tjd_output(JDEC *jd, void *bitmap, JRECT *rect);
+#endif
+
+#if JPEG_DECODE_JPEGDEC
+int jpegdec_scale_option(int scale);
+// Upright `width' x `height' of the opened image and the 1/2^n scale it is
+// decoded at, -1 when a progressive image doesn't fit its coefficient buffer
+int jpegdec_scale(JPEGIMAGE *jpeg, int *width, int *height);
+#if THUMB_PREVIEW || JPEG_DECODE_SMART_CROP
+// Stored position of upright pixel (u, v) of a `w' x `h' image with EXIF `orientation'
+void exif_stored_pixel(int orientation, int u, int v, int w, int h, int *x, int *y);
+#endif
+#if JPEG_DECODE_SMART_CROP
+// Slide the display window over the upright `width' x `height' image at
+// 1/2^scale to where JPEG_getSaliency() finds the most detail. `x' and `y'
+// come in centred and only change where the image overhangs the display.
+// Uses up the opened handle
+esp_err_t jpegdec_crop(JPEGIMAGE *jpeg, int width, int height, int scale, int *x, int *y);
+#endif
+#endif
+
+#if defined(ESP_PLATFORM) || defined(HAVE_PNGLE)
+#include "pngle.h"
+// 0xff until the first pixel picks 0 or 2 for the image being drawn
+extern uint8_t render_pixel_skip;
+// pngle draw callback, centred in the framebuffer of the user data,
+// every 2nd pixel of images over twice the display size
+void on_draw_png(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint8_t rgba[4]);
+#endif
+
+#endif
@@ -2,9 +2,17 @@
 #define __REQUEST_H__
 
 #include "common.h"
+#include "http_stream.h"
 
+// Send `REQUEST' to an https:// or http:// `url' and parse the response into
+// `stream', body bytes go to its sink as they arrive. TLS sessions are saved
+// per host in RTC memory and offered again on the next connection.
+esp_err_t https_request_stream(esp_tls_cfg_t cfg, const char *url,
+                               const char *REQUEST, http_stream *stream);
+// Body of a 2xx response in `*res_buf', NUL terminated. A buffer already in
+// `*res_buf' is reallocated to fit; the caller frees it.
 esp_err_t https_get_request(esp_tls_cfg_t cfg, const char *url,
                                    const char *REQUEST, char **res_buf,
                                    uint32_t *ret_len);
 
-#endif
\ No newline at end of file
+#endif
@@ -36,6 +36,13 @@
 /// Deepsleep configuration
 #define DEEPSLEEP_MINUTES_AFTER_RENDER 1
 
+/// run mode
+// deep sleep between ticks, everything is rebuilt on each wake
+#define RUN_MODE_DEEPSLEEP 0
+// light sleep between ticks with framebuffers kept in PSRAM, for mains power
+#define RUN_MODE_RESIDENT 1
+#define RUN_MODE RUN_MODE_DEEPSLEEP
+
 /// ssl
 // #define VALIDATE_SSL_CERTIFICATE 1
 #define VALIDATE_SSL_CERTIFICATE 0
@@ -65,17 +72,32 @@
 /// wifi
 #define ESP_WIFI_SSID "504B"
 #define ESP_WIFI_PASSWORD "2001106504B"
+#define WIFI_CONNECT_RETRY 5
+// scan, association and DHCP
+#define WIFI_CONNECT_TIMEOUT_MS (15 * 1000)
+// connect to the AP of the last wake, on its channel and with its lease
+#define WIFI_FAST_CONNECT_TIMEOUT_MS (3 * 1000)
+// reuse the DHCP lease this long, or for the lease time if shorter, then
+// ask DHCP again
+#define WIFI_STATIC_IP_MAX_SEC (12 * 60 * 60)
 
 /// network
 // #define HTTP_RECEIVE_BUFFER_SIZE 1986
 #define HTTP_RECEIVE_BUFFER_SIZE (1024 * 4)
 // plz set CONFIG_LWIP_SNTP_MAX_SERVERS=3
-// #define NTP_SERVER_CONFIG ESP_NETIF_SNTP_DEFAULT_CONFIG_MULTIPLE(3,
-//                           ESP_SNTP_SERVER_LIST("ntp.chiro.work", "cn.pool.ntp.org", "time.windows.com") )
-#define NTP_SERVER_CONFIG ESP_NETIF_SNTP_DEFAULT_CONFIG_MULTIPLE(1, \
-                          ESP_SNTP_SERVER_LIST("ntp.chiro.work") )
+// #define NTP_SERVER_CONFIG ESP_NETIF_SNTP_DEFAULT_CONFIG_MULTIPLE(1, \
+//                           ESP_SNTP_SERVER_LIST("ntp.chiro.work") )
+#define NTP_SERVER_CONFIG ESP_NETIF_SNTP_DEFAULT_CONFIG_MULTIPLE(3, \
+                          ESP_SNTP_SERVER_LIST("ntp.chiro.work", "cn.pool.ntp.org", "time.windows.com") )
 #define HTTP_RECEIVE_TIMEOUT_MS (6 * 1000)
 #define HTTP_RECEIVE_RETRY 5
+#define HTTP_MAX_REDIRECTS 5
+// pre-rendered frames from scripts/frame_proxy.py, stored without decoding
+#define NATIVE_FRAME_CONTENT_TYPE "application/x-epdiy-frame"
+// TLS sessions kept in RTC memory across deep sleep, one per host
+#define TLS_SESSION_SLOTS 2
+#define TLS_SESSION_HOST_MAX 32
+#define TLS_SESSION_SIZE_MAX 512
 // #define TIME_SERVER_URL "https://currentmillis.com/time/minutes-since-unix-epoch.php"
 // #define TIME_SERVER_HOST "currentmillis.com"
 #define TIME_SERVER_URL "http://worldtimeapi.org/api/timezone/Asia/Shanghai"
@@ -90,8 +112,35 @@
 // 0 for shuffle every minute
 #define TIME_SHUFFLE_MINUTE 0
 #define TIME_DOWNLOAD_MINUTE 60
+// a button wake fetches the next image right away, instead of only
+// redrawing; the image is fetched alone, without prefetching
+#define BUTTON_NEXT_IMAGE 0
+// shortest interval, grows up to TIME_SYNC_MAX_MINUTE while the learned
+// drift keeps the clock within TIME_SYNC_MAX_ERROR_MS
 #define TIME_SYNC_MINUTE 20
-#define TIME_DISPLAY_OFFSET_SEC 10
+#define TIME_SYNC_MAX_MINUTE (24 * 60)
+#define TIME_SYNC_MAX_ERROR_MS 500
+// single-packet SNTP to the NTP_SERVER_CONFIG servers, HTTP as fallback
+#define TIME_SYNC_SNTP 1
+#define TIME_SNTP_TIMEOUT_MS 2000
+// the Date header of image downloads counts as a sync until after the
+// next download when it agrees with the clock within TIME_DATE_TOLERANCE_MS
+// (it has 1 s resolution); a due sync waits for it on download wakes
+#define TIME_SYNC_FROM_DATE 1
+#define TIME_DATE_TOLERANCE_MS 1500
+#define TIME_DATE_MAX_RTT_MS 1000
+
+/// wake alignment
+// first guess of wake-to-panel-update latency, learned on timer wakes
+#define WAKE_LATENCY_DEFAULT_MS 10000
+// first guess of time from drawing the clock to the update being done
+#define WAKE_FINISH_DEFAULT_MS 3000
+// moving average weight 1/N of new latency samples
+#define WAKE_LATENCY_SMOOTHING 4
+#define WAKE_MIN_SLEEP_MS 5000
+// learn RTC drift only after sleeping this long since the last sync
+#define WAKE_DRIFT_MIN_SLEPT_SEC 600
+#define WAKE_DRIFT_MAX_PPM 50000
 
 /// storage
 static const char *nvs_namespace = "storage";
@@ -99,6 +148,15 @@ static const char *nvs_namespace = "storage";
 static const char *storage_base_path = "/spiflash";
 static const char *storage_partition_label = "storage";
 static const char *filename_temp_image = "/spiflash/temp";
+static const char *filename_temp_image_next = "/spiflash/temp1";
+// images kept for shuffling
+#define IMAGE_CATALOG_MAX 10
+// images fetched per Wi-Fi session while the catalog has room,
+// converted on the second core during the next download
+#define PREFETCH_IMAGES 4
+// PSRAM ring between the HTTP receive path and the flash writer task
+#define FLASH_WRITER_BUFFERS 8
+#define FLASH_WRITER_BUFFER_SIZE (16 * 1024)
 
 static const char *key_current_image = "i_current";
 static const char *key_last_image = "i_last";
@@ -107,12 +165,47 @@ static const char *key_last_clean_screen = "t_cl_screen";
 static const char *key_last_shuffle_images = "t_sh_images";
 static const char *key_last_download = "t_download";
 static const char *key_last_sync_time = "t_synctime";
+static const char *key_drift = "t_drift";
+// followed by a hash of the source URL
+static const char *key_source_cache_prefix = "h_";
 
 static const char *filename_fb = "/spiflash/fb.raw";
 static const char *filename_fb_compressed_front = "/spiflash/fb_front.miniz";
 static const char *filename_fb_compressed_back = "/spiflash/fb_back.miniz";
 static const char *filename_fb_compressed_diff = "/spiflash/fb_diff.miniz";
 
+/// pre-render
+// composite the next minute's frame after the panel update, 0 to disable
+#define PRERENDER_NEXT_FRAME 1
+// the frame is still shown, with its own time, when the wake lands within
+// this many seconds of it; the fast path finishes earlier than the learned
+// wake latency expects until the average catches up
+#define PRERENDER_TOLERANCE_SEC 3
+static const char *key_prerender = "f_prerender";
+static const char *filename_prerender_band = "/spiflash/prerender.band";
+
+/// image decoding
+// JPEGDEC straight into the 4bpp framebuffer, tjpgd for what it rejects
+#define JPEG_DECODE_JPEGDEC 1
+// split images with restart markers between both cores
+#define JPEG_DECODE_PARALLEL 1
+// decode images over twice the display size at 1/2, 1/4 or 1/8 scale, like
+// the PNG renderer's pixel skipping
+#define JPEG_DECODE_SCALE 1
+// turn phone photos upright by their EXIF orientation (JPEGDEC only)
+#define JPEG_DECODE_EXIF_ROTATE 1
+// PSRAM for the luma coefficients of progressive images, which tjpgd
+// rejects; the scale drops further until they fit, 0 to disable. A full
+// 1448x1072 panel takes 3.2 MiB at 1/1
+#define JPEG_DECODE_PROGRESSIVE_BUF (4 * 1024 * 1024)
+// fill the display with photos of the other orientation one scale step up,
+// cropped where the JPEG coefficients show the most detail instead of at the
+// centre (JPEGDEC only)
+#define JPEG_DECODE_SMART_CROP 1
+// on a button wake, show the next image's EXIF thumbnail scaled up while the
+// full image converts (JPEGDEC only)
+#define THUMB_PREVIEW 1
+
 #define FRAME_COMPRESS_LEVEL Z_BEST_SPEED
 // #define FRAME_COMPRESS_LEVEL Z_NO_COMPRESSION
 
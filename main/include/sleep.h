@@ -0,0 +1,27 @@
+#ifndef __SLEEP_H__
+#define __SLEEP_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "esp_sleep.h"
+
+// Apply the learned RTC drift to the clock after a timer wake.
+void wake_correct_clock(void);
+// Time to draw: now plus the expected time until the panel update is done.
+time_t wake_display_time(void);
+// Minute boundary the next panel update is aimed at.
+time_t wake_next_target(void);
+// Call right after the panel update to refine the latency estimates.
+void wake_update_done(void);
+// Call on a time sync with `offset_us' = server time - local time.
+void wake_clock_synced(int64_t offset_us);
+// Restore the drift estimate from NVS after power on.
+void wake_load_drift(void);
+// Minutes until the next time sync, longer while the drift is well corrected.
+int wake_sync_interval_minutes(void);
+
+void deepsleep();
+// Sleep until the next tick with RAM and PSRAM kept, returns the wake cause.
+esp_sleep_wakeup_cause_t lightsleep(void);
+
+#endif
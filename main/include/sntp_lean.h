@@ -0,0 +1,26 @@
+#ifndef __SNTP_LEAN_H__
+#define __SNTP_LEAN_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define SNTP_LEAN_PACKET_SIZE 48
+
+typedef struct {
+  int64_t offset_us;  // server time - local time
+  int64_t delay_us;   // round trip, without server processing
+  int server;         // index of the server that answered
+} sntp_lean_result;
+
+// Send one SNTP request to each of `servers' at once and take the first
+// valid reply within `timeout_ms'.
+esp_err_t sntp_lean_query(const char *const *servers, int count,
+                          uint32_t timeout_ms, sntp_lean_result *result);
+
+// Client request sent at local time `t1_us', packet helpers for the above.
+void sntp_lean_request(uint8_t *packet, int64_t t1_us);
+// Check a server reply to the request sent at `t1_us', received at `t4_us'.
+esp_err_t sntp_lean_reply(const uint8_t *packet, int len, int64_t t1_us,
+                          int64_t t4_us, sntp_lean_result *result);
+
+#endif
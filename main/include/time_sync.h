@@ -24,6 +24,12 @@ esp_err_t fetch_and_store_time_in_nvs(void*);
 
 void print_time();
 
+/**
+ * @brief Parse an HTTP `Date' header value (IMF-fixdate) into unix time.
+ *
+ */
+esp_err_t http_date_parse(const char *value, time_t *t);
+
 #ifdef __cplusplus
 }
 #endif
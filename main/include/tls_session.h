@@ -0,0 +1,15 @@
+#ifndef __TLS_SESSION_H__
+#define __TLS_SESSION_H__
+
+#include "common.h"
+#include "mbedtls/ssl.h"
+
+// Load the session saved for `host' in RTC memory into `session', which the
+// caller has initialised. Fails when there is none.
+esp_err_t tls_session_load(const char *host, mbedtls_ssl_session *session);
+// Save the session of an established connection to `host'.
+void tls_session_store(const char *host, const mbedtls_ssl_context *ssl);
+// Drop the session of `host', e.g. after the server refused it.
+void tls_session_forget(const char *host);
+
+#endif
@@ -3,7 +3,9 @@
 
 #include "common.h"
 
-void wifi_start_sta(void);
+// Connect and wait for an IP, bounded by WIFI_FAST_CONNECT_TIMEOUT_MS plus
+// WIFI_CONNECT_TIMEOUT_MS. Wi-Fi is stopped again on failure.
+esp_err_t wifi_start_sta(void);
 void wifi_stop_sta(void);
 bool wifi_is_started(void);
 
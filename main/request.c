@@ -1,106 +1,287 @@
 #include "common.h"
 #include "request.h"
+#include "tls_session.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
 
-const char *TAG = "request";
+static const char *TAG = "request";
 
-esp_err_t https_get_request(esp_tls_cfg_t cfg, const char *url,
-                                   const char *REQUEST, char **res_buf,
-                                   uint32_t *ret_len) {
-  char buf[512];
-  int ret, len;
-  size_t recv_len = 0;
-  esp_err_t err = ESP_OK;
+// One HTTP or HTTPS connection. esp-tls makes the TCP connection, TLS runs
+// on it through mbedtls directly: esp-tls only hands out its session as an
+// opaque pointer, which can't be saved to RTC memory across deep sleep,
+// and takes one back only in that form.
+typedef struct {
+  bool tls;
+  mbedtls_net_context net;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_x509_crt cacert;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context ctr_drbg;
+} connection;
 
-  assert(res_buf);
+static void connection_init(connection *c, bool tls) {
+  c->tls = tls;
+  mbedtls_net_init(&c->net);
+  mbedtls_ssl_init(&c->ssl);
+  mbedtls_ssl_config_init(&c->conf);
+  mbedtls_x509_crt_init(&c->cacert);
+  mbedtls_entropy_init(&c->entropy);
+  mbedtls_ctr_drbg_init(&c->ctr_drbg);
+}
+
+static void connection_free(connection *c) {
+  mbedtls_net_free(&c->net);
+  mbedtls_ssl_free(&c->ssl);
+  mbedtls_ssl_config_free(&c->conf);
+  mbedtls_x509_crt_free(&c->cacert);
+  mbedtls_ctr_drbg_free(&c->ctr_drbg);
+  mbedtls_entropy_free(&c->entropy);
+}
+
+// Connect and, for https, handshake offering `session' if not NULL. esp-tls
+// gives up on the connect after `cfg->timeout_ms', 10 s when 0. The CA comes
+// from `cfg' like esp-tls takes it, no CA skips verification.
+static esp_err_t connection_open(connection *c, const esp_tls_cfg_t *cfg,
+                                 const char *host, const char *port,
+                                 const mbedtls_ssl_session *session) {
+  esp_tls_last_error_t error = {0};
+  esp_err_t err = esp_tls_plain_tcp_connect(host, strlen(host), atoi(port),
+                                            cfg, &error, &c->net.fd);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to connect to %s:%s: %s, errno %d", host, port,
+             esp_err_to_name(err), error.esp_tls_error_code);
+    return ESP_FAIL;
+  }
+  if (!c->tls) {
+    return ESP_OK;
+  }
+  int ret = mbedtls_ctr_drbg_seed(&c->ctr_drbg, mbedtls_entropy_func,
+                                  &c->entropy, NULL, 0);
+  if (ret == 0) {
+    ret = mbedtls_ssl_config_defaults(&c->conf, MBEDTLS_SSL_IS_CLIENT,
+                                      MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+  }
+  if (ret != 0) {
+    ESP_LOGE(TAG, "TLS setup failed: -0x%x", -ret);
+    return ESP_FAIL;
+  }
+  if (cfg->cacert_buf) {
+    ret = mbedtls_x509_crt_parse(&c->cacert, cfg->cacert_buf, cfg->cacert_bytes);
+    if (ret < 0) {
+      ESP_LOGE(TAG, "Failed to parse CA certificate: -0x%x", -ret);
+      return ESP_FAIL;
+    }
+    mbedtls_ssl_conf_ca_chain(&c->conf, &c->cacert, NULL);
+    mbedtls_ssl_conf_authmode(&c->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  } else if (cfg->use_global_ca_store) {
+    mbedtls_x509_crt *store = esp_tls_get_global_ca_store();
+    if (!store) {
+      ESP_LOGE(TAG, "Global CA store not set");
+      return ESP_FAIL;
+    }
+    mbedtls_ssl_conf_ca_chain(&c->conf, store, NULL);
+    mbedtls_ssl_conf_authmode(&c->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  } else if (cfg->crt_bundle_attach) {
+    if (cfg->crt_bundle_attach(&c->conf) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to attach the certificate bundle");
+      return ESP_FAIL;
+    }
+    mbedtls_ssl_conf_authmode(&c->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  } else {
+    // VALIDATE_SSL_CERTIFICATE 0
+    mbedtls_ssl_conf_authmode(&c->conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+  mbedtls_ssl_conf_rng(&c->conf, mbedtls_ctr_drbg_random, &c->ctr_drbg);
+  mbedtls_ssl_conf_read_timeout(
+      &c->conf, cfg->timeout_ms ? cfg->timeout_ms : HTTP_RECEIVE_TIMEOUT_MS);
+  ret = mbedtls_ssl_setup(&c->ssl, &c->conf);
+  if (ret == 0) {
+    ret = mbedtls_ssl_set_hostname(&c->ssl, host);
+  }
+  if (ret == 0 && session) {
+    ret = mbedtls_ssl_set_session(&c->ssl, session);
+  }
+  if (ret != 0) {
+    ESP_LOGE(TAG, "TLS setup failed: -0x%x", -ret);
+    return ESP_FAIL;
+  }
+  mbedtls_ssl_set_bio(&c->ssl, &c->net, mbedtls_net_send, NULL,
+                      mbedtls_net_recv_timeout);
+  while ((ret = mbedtls_ssl_handshake(&c->ssl)) != 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      ESP_LOGE(TAG, "TLS handshake with %s failed: -0x%x", host, -ret);
+      return ESP_FAIL;
+    }
+  }
+  return ESP_OK;
+}
+
+static int connection_write(connection *c, const char *data, size_t len) {
+  return c->tls ? mbedtls_ssl_write(&c->ssl, (const uint8_t *)data, len)
+                : mbedtls_net_send(&c->net, (const uint8_t *)data, len);
+}
+
+// Bytes read, 0 once the peer closed, negative on errors and timeouts
+static int connection_read(connection *c, uint8_t *buf, size_t len,
+                           uint32_t timeout_ms) {
+  if (!c->tls) {
+    return mbedtls_net_recv_timeout(&c->net, buf, len, timeout_ms);
+  }
+  int ret = mbedtls_ssl_read(&c->ssl, buf, len);
+  return ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY ? 0 : ret;
+}
+
+// Response body collected in RAM by `https_get_request'
+typedef struct {
+  http_stream *stream;
+  char *buf;
+  size_t len;
+  size_t cap;
+} ram_sink;
 
-  esp_tls_t *tls = esp_tls_init();
-  if (!tls) {
-    ESP_LOGE(TAG, "Failed to allocate esp_tls handle!");
+static esp_err_t ram_sink_write(void *ctx, const uint8_t *data, size_t len) {
+  ram_sink *sink = ctx;
+  if (sink->len + len + 1 > sink->cap) {
+    // Content-Length up front, doubling otherwise
+    size_t cap = sink->cap ? sink->cap * 2 : 1024;
+    if (sink->stream->content_length > 0 &&
+        cap < sink->stream->content_length + 1) {
+      cap = sink->stream->content_length + 1;
+    }
+    if (cap < sink->len + len + 1) {
+      cap = sink->len + len + 1;
+    }
+    char *buf = heap_caps_realloc(sink->buf, cap, MALLOC_CAP_SPIRAM);
+    if (!buf) {
+      ESP_LOGE(TAG, "Failed to allocate %d bytes for the response", cap);
+      return ESP_ERR_NO_MEM;
+    }
+    sink->buf = buf;
+    sink->cap = cap;
+  }
+  memcpy(sink->buf + sink->len, data, len);
+  sink->len += len;
+  sink->buf[sink->len] = 0;
+  return ESP_OK;
+}
+
+esp_err_t https_get_request(esp_tls_cfg_t cfg, const char *url,
+                            const char *REQUEST, char **res_buf,
+                            uint32_t *ret_len) {
+  assert(res_buf);
+  http_stream stream;
+  // an existing buffer is reallocated to fit
+  ram_sink sink = {.stream = &stream, .buf = *res_buf};
+  http_stream_init(&stream, NULL, ram_sink_write, &sink);
+  esp_err_t err = https_request_stream(cfg, url, REQUEST, &stream);
+  if (err == ESP_OK && (stream.status < 200 || stream.status > 299)) {
+    ESP_LOGE(TAG, "HTTP status %d", stream.status);
     err = ESP_FAIL;
-    goto exit;
   }
+  *res_buf = sink.buf;
+  *ret_len = sink.len;
+  return err;
+}
 
-  if (esp_tls_conn_http_new_sync(url, &cfg, tls) == 1) {
-    ESP_LOGI(TAG, "Connection established...");
-  } else {
+esp_err_t https_request_stream(esp_tls_cfg_t cfg, const char *url,
+                               const char *REQUEST, http_stream *stream) {
+  int ret;
+  esp_err_t err = ESP_OK;
+  uint8_t *buf = NULL;
+  uint32_t timeout_ms = cfg.timeout_ms ? cfg.timeout_ms : HTTP_RECEIVE_TIMEOUT_MS;
+  char host[TLS_SESSION_HOST_MAX];
+  char port[8];
+  bool tls = http_url_host(url, host, sizeof(host), port, sizeof(port));
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  bool offered = tls && tls_session_load(host, &session) == ESP_OK;
+  connection conn;
+  connection_init(&conn, tls);
+  int64_t time_handshake = esp_timer_get_time();
+  err = connection_open(&conn, &cfg, host, port, offered ? &session : NULL);
+  if (err != ESP_OK && offered) {
+    // the saved session may be what the server refused, try a full handshake
+    ESP_LOGW(TAG, "Connection with saved session failed, retrying without");
+    tls_session_forget(host);
+    offered = false;
+    connection_free(&conn);
+    connection_init(&conn, tls);
+    time_handshake = esp_timer_get_time();
+    err = connection_open(&conn, &cfg, host, port, NULL);
+  }
+  mbedtls_ssl_session_free(&session);
+  if (err != ESP_OK) {
     ESP_LOGE(TAG, "Connection failed...");
-    err = ESP_FAIL;
     goto cleanup;
   }
+  // compare the two to see what resumption saves
+  ESP_LOGI(TAG, "Connection established in %lld ms%s",
+           (esp_timer_get_time() - time_handshake) / 1000,
+           !tls ? ", plain http" : offered ? ", session offered" : ", full handshake");
 
-#ifdef CONFIG_EXAMPLE_CLIENT_SESSION_TICKETS
-  /* The TLS session is successfully established, now saving the session ctx for
-   * reuse */
-  if (save_client_session) {
-    esp_tls_free_client_session(tls_client_session);
-    tls_client_session = esp_tls_get_client_session(tls);
+  if (tls) {
+    /* The TLS session is successfully established, now saving the session ctx for
+     * reuse after deep sleep */
+    tls_session_store(host, &conn.ssl);
   }
-#endif
 
   size_t written_bytes = 0;
   do {
-    ret = esp_tls_conn_write(tls, REQUEST + written_bytes,
-                             strlen(REQUEST) - written_bytes);
+    ret = connection_write(&conn, REQUEST + written_bytes,
+                           strlen(REQUEST) - written_bytes);
     if (ret >= 0) {
       ESP_LOGI(TAG, "%d bytes written", ret);
       written_bytes += ret;
-    } else if (ret != ESP_TLS_ERR_SSL_WANT_READ &&
-               ret != ESP_TLS_ERR_SSL_WANT_WRITE) {
-      ESP_LOGE(TAG, "esp_tls_conn_write  returned: [0x%02X](%s)", ret,
-               esp_err_to_name(ret));
+    } else if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+               ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      ESP_LOGE(TAG, "Writing the request returned -0x%x", -ret);
       err = ESP_FAIL;
       goto cleanup;
     }
   } while (written_bytes < strlen(REQUEST));
+  stream->sent_us = esp_timer_get_time();
 
   ESP_LOGI(TAG, "Reading HTTP response...");
-  ssize_t bytes_to_read;
-  if ((bytes_to_read = esp_tls_get_bytes_avail(tls)) <= 0) {
-    ESP_LOGE(TAG, "esp_tls_get_bytes_avail  returned: [0x%02X]", bytes_to_read);
-    // err = ESP_FAIL;
-    // goto cleanup;
-  }
-  if (!*res_buf && bytes_to_read) {
-    ESP_LOGI(TAG, "Allocating %d bytes of memory...", bytes_to_read);
-    *res_buf = (char *)heap_caps_malloc(bytes_to_read, MALLOC_CAP_SPIRAM);
-    if (!*res_buf) {
-      ESP_LOGE(TAG, "Failed to allocate memory for res_buf");
-      err = ESP_FAIL;
-      goto cleanup;
-    }
+  buf = malloc(HTTP_RECEIVE_BUFFER_SIZE);
+  if (!buf) {
+    ESP_LOGE(TAG, "Failed to allocate receive buffer");
+    err = ESP_ERR_NO_MEM;
+    goto cleanup;
   }
-  do {
-    len = sizeof(buf) - 1;
-    memset(buf, 0x00, len);
-    ret = esp_tls_conn_read(tls, (char *)buf, len);
-
-    if (ret == ESP_TLS_ERR_SSL_WANT_WRITE || ret == ESP_TLS_ERR_SSL_WANT_READ) {
+  // stop at the end of the response, keep-alive servers won't close
+  while (!http_stream_done(stream)) {
+    ret = connection_read(&conn, buf, HTTP_RECEIVE_BUFFER_SIZE, timeout_ms);
+    if (ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ) {
       continue;
     } else if (ret < 0) {
-      ESP_LOGE(TAG, "esp_tls_conn_read  returned [-0x%02X](%s)", -ret,
-               esp_err_to_name(ret));
+      ESP_LOGE(TAG, "Reading the response returned -0x%x%s", -ret,
+               ret == MBEDTLS_ERR_SSL_TIMEOUT ? " (timeout)" : "");
+      err = ESP_FAIL;
       break;
     } else if (ret == 0) {
       ESP_LOGI(TAG, "connection closed");
+      err = http_stream_finish(stream);
       break;
     }
-
-    len = ret;
-    ESP_LOGD(TAG, "%d bytes read", len);
-    if (*res_buf) {
-      memcpy((*res_buf) + recv_len, buf, len);
-    } else {
-      for (int i = 0; i < len; i++) {
-        putchar(buf[i]);
-      }
-      putchar('\n'); // JSON output doesn't have a newline at end
+    ESP_LOGD(TAG, "%d bytes read", ret);
+    err = http_stream_feed(stream, buf, ret);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Bad response: %s", esp_err_to_name(err));
+      break;
     }
-    recv_len += len;
-  } while (1);
+  }
+  ESP_LOGI(TAG, "HTTP status %d, %llu bytes of body", stream->status,
+           stream->received);
+  if (tls) {
+    mbedtls_ssl_close_notify(&conn.ssl);
+  }
 
 cleanup:
-  esp_tls_conn_destroy(tls);
-  *ret_len = recv_len;
-exit:
+  free(buf);
+  connection_free(&conn);
   return err;
-}
\ No newline at end of file
+}
@@ -1,7 +1,199 @@
 #include "common.h"
 #include "esp_sleep.h"
+#include "sleep.h"
+#include "nvs.h"
+#include <sys/param.h>
+#include <sys/time.h>
+
+static const char *TAG = "sleep";
+
+// survive deep sleep, reset on power on
+static RTC_DATA_ATTR int64_t wake_at_us = 0;      // planned wall-clock wake
+static RTC_DATA_ATTR int64_t sleep_start_us = 0;  // wall clock when going to sleep
+static RTC_DATA_ATTR int64_t latency_us = WAKE_LATENCY_DEFAULT_MS * 1000LL;
+static RTC_DATA_ATTR int64_t finish_us = WAKE_FINISH_DEFAULT_MS * 1000LL;
+static RTC_DATA_ATTR int32_t drift_ppm = 0;       // RTC slow clock, + when it lags
+// drift left after correction at the last sync, sets the sync interval
+static RTC_DATA_ATTR int32_t residual_ppm = WAKE_DRIFT_MAX_PPM;
+static RTC_DATA_ATTR int64_t slept_since_sync_us = 0;
+
+// per wake
+static int64_t target_us = 0;
+static int64_t display_at_us = 0;
+
+static int64_t now_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static bool woke_by_timer(void) {
+  return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER &&
+         wake_at_us != 0;
+}
+
+// moving average, samples far above the estimate (network wakes) count only
+// up to a bound, so a single one moves it little but a latency that really
+// is higher still pulls it up over a few wakes
+static void ema_update(int64_t *avg, int64_t sample, const char *name) {
+  int64_t limit = *avg * 3 / 2 + 2000000LL;
+  if (sample < 0) {
+    ESP_LOGI(TAG, "%s sample %lld ms ignored", name, sample / 1000);
+    return;
+  }
+  if (sample > limit) {
+    ESP_LOGI(TAG, "%s sample %lld ms clamped to %lld ms", name, sample / 1000,
+             limit / 1000);
+    sample = limit;
+  }
+  *avg += (sample - *avg) / WAKE_LATENCY_SMOOTHING;
+  ESP_LOGI(TAG, "%s %lld ms, average %lld ms", name, sample / 1000,
+           *avg / 1000);
+}
+
+void wake_correct_clock(void) {
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED ||
+      sleep_start_us == 0) {
+    return;
+  }
+  int64_t now = now_us();
+  int64_t slept = now - sleep_start_us;
+  slept_since_sync_us += slept;
+  int64_t correction = slept * drift_ppm / 1000000LL;
+  if (correction != 0) {
+    struct timeval tv = {
+        .tv_sec = (now + correction) / 1000000LL,
+        .tv_usec = (now + correction) % 1000000LL,
+    };
+    settimeofday(&tv, NULL);
+  }
+  ESP_LOGI(TAG, "Slept %lld ms, drift %ld ppm, corrected %lld ms",
+           slept / 1000, drift_ppm, correction / 1000);
+}
+
+time_t wake_display_time(void) {
+  display_at_us = now_us();
+  return (display_at_us + finish_us + 500000LL) / 1000000LL;
+}
+
+time_t wake_next_target(void) {
+  if (target_us == 0) {
+    int64_t now = now_us();
+    int64_t period = DEEPSLEEP_MINUTES_AFTER_RENDER * 60 * 1000000LL;
+    int64_t minute = 60 * 1000000LL;
+    target_us = (now / minute) * minute + period;
+    // too close to wake up in time, aim at the following one
+    while (target_us - latency_us - now < WAKE_MIN_SLEEP_MS * 1000LL) {
+      target_us += minute;
+    }
+  }
+  return target_us / 1000000LL;
+}
+
+void wake_update_done(void) {
+  int64_t now = now_us();
+  if (display_at_us != 0) {
+    ema_update(&finish_us, now - display_at_us, "finish");
+  }
+  if (woke_by_timer()) {
+    ema_update(&latency_us, now - wake_at_us, "latency");
+  }
+}
+
+// drift estimate in NVS, RTC memory is lost on power off
+typedef struct {
+  int32_t drift_ppm;
+  int32_t residual_ppm;
+} drift_record;
+
+void wake_load_drift(void) {
+  nvs_handle_t nvs_handle;
+  if (nvs_open(nvs_namespace, NVS_READONLY, &nvs_handle) != ESP_OK) {
+    return;
+  }
+  drift_record record;
+  size_t len = sizeof(record);
+  if (nvs_get_blob(nvs_handle, key_drift, &record, &len) == ESP_OK &&
+      len == sizeof(record)) {
+    drift_ppm = record.drift_ppm;
+    residual_ppm = record.residual_ppm;
+    ESP_LOGI(TAG, "Drift %ld ppm, residual %ld ppm from NVS", drift_ppm,
+             residual_ppm);
+  }
+  nvs_close(nvs_handle);
+}
+
+static void save_drift(void) {
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) opening NVS handle!", esp_err_to_name(err));
+    return;
+  }
+  drift_record record = {.drift_ppm = drift_ppm, .residual_ppm = residual_ppm};
+  err = nvs_set_blob(nvs_handle, key_drift, &record, sizeof(record));
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs_handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write %s to NVS: 0x%x", key_drift, err);
+  }
+  nvs_close(nvs_handle);
+}
+
+void wake_clock_synced(int64_t offset_us) {
+  if (slept_since_sync_us > WAKE_DRIFT_MIN_SLEPT_SEC * 1000000LL) {
+    int64_t error_ppm = offset_us * 1000000LL / slept_since_sync_us;
+    int64_t ppm = drift_ppm + error_ppm;
+    drift_ppm = MAX(-WAKE_DRIFT_MAX_PPM, MIN(WAKE_DRIFT_MAX_PPM, ppm));
+    residual_ppm = MIN(WAKE_DRIFT_MAX_PPM, llabs(error_ppm));
+    ESP_LOGI(TAG, "Clock off by %lld ms over %lld s asleep, drift %ld ppm",
+             offset_us / 1000, slept_since_sync_us / 1000000LL, drift_ppm);
+    save_drift();
+  }
+  slept_since_sync_us = 0;
+}
+
+int wake_sync_interval_minutes(void) {
+  // sync before the uncorrected drift adds up to TIME_SYNC_MAX_ERROR_MS
+  int64_t minutes = TIME_SYNC_MAX_MINUTE;
+  if (residual_ppm > 0) {
+    minutes = TIME_SYNC_MAX_ERROR_MS * 1000LL / residual_ppm / 60;
+  }
+  return MAX(TIME_SYNC_MINUTE, MIN(TIME_SYNC_MAX_MINUTE, minutes));
+}
+
+// plan the wake for the next target, returns how long to sleep
+static int64_t schedule_wake(const char *kind) {
+  wake_next_target();
+  int64_t now = now_us();
+  wake_at_us = target_us - latency_us;
+  int64_t sleep_us = (wake_at_us - now) * 1000000LL / (1000000LL + drift_ppm);
+  if (sleep_us < WAKE_MIN_SLEEP_MS * 1000LL) {
+    sleep_us = WAKE_MIN_SLEEP_MS * 1000LL;
+  }
+  sleep_start_us = now;
+  time_t target = target_us / 1000000LL;
+  struct tm timeinfo;
+  char target_text[16];
+  localtime_r(&target, &timeinfo);
+  strftime(target_text, sizeof(target_text), "%H:%M:%S", &timeinfo);
+  printf("Go to %s %lld ms, next update at %s\n", kind, sleep_us / 1000,
+         target_text);
+  return sleep_us;
+}
 
 void deepsleep() {
-  printf("Go to sleep %d minutes\n", DEEPSLEEP_MINUTES_AFTER_RENDER);
-  esp_deep_sleep(1000000LL * 60 * DEEPSLEEP_MINUTES_AFTER_RENDER);
-}
\ No newline at end of file
+  esp_deep_sleep(schedule_wake("deep sleep"));
+}
+
+esp_sleep_wakeup_cause_t lightsleep(void) {
+  esp_sleep_enable_timer_wakeup(schedule_wake("light sleep"));
+  esp_light_sleep_start();
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+  wake_correct_clock();
+  // a new tick, plan it from scratch
+  target_us = 0;
+  display_at_us = 0;
+  return cause;
+}
@@ -0,0 +1,182 @@
+#include "sntp_lean.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "esp_log.h"
+
+static const char *TAG = "sntp_lean";
+
+#define SNTP_LEAN_MAX_SERVERS 4
+// seconds from 1900 to 1970
+#define NTP_UNIX_OFFSET 2208988800LL
+
+static int64_t now_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static uint64_t to_ntp(int64_t unix_us) {
+  uint64_t sec = (uint64_t)(unix_us / 1000000LL + NTP_UNIX_OFFSET);
+  uint64_t frac = ((uint64_t)(unix_us % 1000000LL) << 32) / 1000000ULL;
+  return (sec << 32) | frac;
+}
+
+static int64_t from_ntp(uint64_t ntp) {
+  int64_t sec = ntp >> 32;
+  // era 1 starts in 2036, seconds wrap around
+  if (sec < 0x80000000LL) {
+    sec += 0x100000000LL;
+  }
+  int64_t us = ((ntp & 0xffffffffULL) * 1000000ULL) >> 32;
+  return (sec - NTP_UNIX_OFFSET) * 1000000LL + us;
+}
+
+static void put_ts(uint8_t *p, uint64_t ts) {
+  for (int i = 7; i >= 0; i--) {
+    p[i] = ts & 0xff;
+    ts >>= 8;
+  }
+}
+
+static uint64_t get_ts(const uint8_t *p) {
+  uint64_t ts = 0;
+  for (int i = 0; i < 8; i++) {
+    ts = (ts << 8) | p[i];
+  }
+  return ts;
+}
+
+void sntp_lean_request(uint8_t *packet, int64_t t1_us) {
+  memset(packet, 0, SNTP_LEAN_PACKET_SIZE);
+  // LI 0, version 4, mode 3 (client)
+  packet[0] = 0x23;
+  // echoed back as the originate timestamp
+  put_ts(packet + 40, to_ntp(t1_us));
+}
+
+esp_err_t sntp_lean_reply(const uint8_t *packet, int len, int64_t t1_us,
+                          int64_t t4_us, sntp_lean_result *result) {
+  if (len < SNTP_LEAN_PACKET_SIZE) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  int leap = packet[0] >> 6, mode = packet[0] & 0x7, stratum = packet[1];
+  uint64_t originate = get_ts(packet + 24);
+  uint64_t receive = get_ts(packet + 32);
+  uint64_t transmit = get_ts(packet + 40);
+  // unsynchronized, kiss-o'-death, or not an answer to our request
+  if (mode != 4 || leap == 3 || stratum == 0 || stratum > 15 ||
+      originate != to_ntp(t1_us) || !receive || !transmit) {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  int64_t t2_us = from_ntp(receive), t3_us = from_ntp(transmit);
+  result->offset_us = ((t2_us - t1_us) + (t3_us - t4_us)) / 2;
+  result->delay_us = (t4_us - t1_us) - (t3_us - t2_us);
+  return ESP_OK;
+}
+
+esp_err_t sntp_lean_query(const char *const *servers, int count,
+                          uint32_t timeout_ms, sntp_lean_result *result) {
+  struct sockaddr_in addrs[SNTP_LEAN_MAX_SERVERS];
+  int64_t sent_us[SNTP_LEAN_MAX_SERVERS];
+  bool sent[SNTP_LEAN_MAX_SERVERS] = {0};
+  uint8_t packet[SNTP_LEAN_PACKET_SIZE];
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  int64_t start_us = now_us();
+
+  if (count > SNTP_LEAN_MAX_SERVERS) {
+    count = SNTP_LEAN_MAX_SERVERS;
+  }
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+    return ESP_FAIL;
+  }
+  int requests = 0;
+  for (int i = 0; i < count; i++) {
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *res = NULL;
+    const char *host = servers[i];
+    const char *port = "123";
+    // host:port, for a local stand-in
+    char name[64];
+    const char *colon = strchr(host, ':');
+    if (colon && colon - host < sizeof(name)) {
+      memcpy(name, host, colon - host);
+      name[colon - host] = 0;
+      host = name;
+      port = colon + 1;
+    }
+    if (getaddrinfo(host, port, &hints, &res) != 0 || !res) {
+      ESP_LOGW(TAG, "Failed to resolve %s", servers[i]);
+      continue;
+    }
+    memcpy(&addrs[i], res->ai_addr, sizeof(addrs[i]));
+    freeaddrinfo(res);
+    sent_us[i] = now_us();
+    sntp_lean_request(packet, sent_us[i]);
+    if (sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)&addrs[i],
+               sizeof(addrs[i])) != sizeof(packet)) {
+      ESP_LOGW(TAG, "Failed to send to %s: errno %d", servers[i], errno);
+      continue;
+    }
+    sent[i] = true;
+    requests++;
+  }
+  if (!requests) {
+    close(sock);
+    return ESP_FAIL;
+  }
+
+  int64_t deadline_us = start_us + timeout_ms * 1000LL;
+  int64_t left_us;
+  while ((left_us = deadline_us - now_us()) > 0) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval tv = {.tv_sec = left_us / 1000000LL,
+                         .tv_usec = left_us % 1000000LL};
+    if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0) {
+      break;
+    }
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int len = recvfrom(sock, packet, sizeof(packet), 0,
+                       (struct sockaddr *)&from, &from_len);
+    int64_t received_us = now_us();
+    for (int i = 0; len > 0 && i < count; i++) {
+      if (!sent[i] || from.sin_addr.s_addr != addrs[i].sin_addr.s_addr ||
+          from.sin_port != addrs[i].sin_port) {
+        continue;
+      }
+      if (sntp_lean_reply(packet, len, sent_us[i], received_us, result) ==
+          ESP_OK) {
+        result->server = i;
+        ESP_LOGI(TAG, "%s answered in %lld ms, offset %lld ms", servers[i],
+                 (received_us - sent_us[i]) / 1000, result->offset_us / 1000);
+        err = ESP_OK;
+      } else {
+        ESP_LOGW(TAG, "Invalid reply from %s", servers[i]);
+        // the others may still answer
+        sent[i] = false;
+        requests--;
+      }
+      break;
+    }
+    if (err == ESP_OK || !requests) {
+      break;
+    }
+  }
+  close(sock);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "No valid reply from %d servers in %lld ms", count,
+             (now_us() - start_us) / 1000);
+    return requests ? ESP_ERR_TIMEOUT : ESP_ERR_INVALID_RESPONSE;
+  }
+  return ESP_OK;
+}
@@ -31,8 +31,12 @@
 #include "request.h"
 #include "settings.h"
 #include "json_parser.h"
+#include "sleep.h"
+#include "sntp_lean.h"
 
 static const char *TAG = "time_sync";
+// when the time server response arrived, esp_timer clock
+static int64_t time_response_us = 0;
 
 extern const uint8_t
     time_server_cert_pem_start[] asm("_binary_time_server_cert_pem_start");
@@ -53,6 +57,44 @@ void set_timestamp(uint64_t timestamp) {
   settimeofday(&set_time, &tz);
 }
 
+// set the clock with sub-second precision and feed the offset to drift learning
+void set_timestamp_us(int64_t timestamp_us) {
+  struct timeval set_time;
+  set_time_zone();
+  gettimeofday(&set_time, NULL);
+  int64_t local_us = (int64_t)set_time.tv_sec * 1000000LL + set_time.tv_usec;
+  wake_clock_synced(timestamp_us - local_us);
+  set_time.tv_sec = timestamp_us / 1000000LL;
+  set_time.tv_usec = timestamp_us % 1000000LL;
+  settimeofday(&set_time, NULL);
+  ESP_LOGI(TAG, "Clock adjusted by %lld ms", (timestamp_us - local_us) / 1000);
+}
+
+esp_err_t http_date_parse(const char *value, time_t *t) {
+  // IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT"
+  static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, hour, minute, second;
+  if (sscanf(value, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month, &year, &hour,
+             &minute, &second) != 6) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  const char *m = strstr(months, month);
+  if (!m || (m - months) % 3 || strlen(month) != 3) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  // days since 1970-01-01 of a proleptic Gregorian date, no timegm in newlib
+  int mon = (m - months) / 3 + 1;
+  int y = year - (mon <= 2);
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days = (int64_t)era * 146097 + doe - 719468;
+  *t = days * 86400 + hour * 3600 + minute * 60 + second;
+  return ESP_OK;
+}
+
 void print_time() {
   set_time_zone();
   time_t now;
@@ -91,102 +133,74 @@ static esp_err_t obtain_time(void) {
   return ESP_OK;
 }
 
-static esp_err_t obtain_time_https(void) {
-  esp_tls_cfg_t cfg = {
-      .cacert_buf = (const unsigned char *)time_server_cert_pem_start,
-      .cacert_bytes = time_server_cert_pem_end - time_server_cert_pem_start,
-  };
-  const char *request = "GET / HTTP/1.1\r\n"
-                        "Host: " TIME_SERVER_HOST "\r\n"
-                        "User-Agent: esp-idf/1.0 esp32\r\n"
-                        "\r\n";
-  char *request_buf = NULL;
-  request_buf = malloc(1024);
-  if (request_buf == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate memory for request buffer");
-    return ESP_FAIL;
-  }
-  uint32_t request_len = 0;
-  esp_err_t r = https_get_request(cfg, TIME_SERVER_URL, request,
-                                  (char **)&request_buf, &request_len);
-  if (r != ESP_OK) {
-    ESP_LOGE(TAG, "Error fetching time from server");
-    free(request_buf);
-    return r;
-  }
-  ESP_LOGI(TAG, "r=%d, request_len=%d, message: %s", r, request_len,
-           request_buf);
-  uint64_t unix_time = 0;
-  sscanf(request_buf, "%lld", &unix_time);
-  ESP_LOGI(TAG, "unix_time=%lld", unix_time);
-  if (unix_time == 0) {
-    ESP_LOGE(TAG, "Error parsing time from server");
-  } else {
-    struct timeval set_time;
-    set_time.tv_sec = unix_time;
-    settimeofday(&set_time, NULL);
-    print_time();
+// One request to each NTP_SERVER_CONFIG server, the first reply wins
+static esp_err_t obtain_time_sntp_lean(void) {
+  esp_sntp_config_t config = NTP_SERVER_CONFIG;
+  sntp_lean_result result;
+  esp_err_t err = sntp_lean_query(config.servers, config.num_of_servers,
+                                  TIME_SNTP_TIMEOUT_MS, &result);
+  if (err != ESP_OK) {
+    return err;
   }
-  free(request_buf);
-  return r;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  set_timestamp_us((int64_t)now.tv_sec * 1000000LL + now.tv_usec +
+                   result.offset_us);
+  print_time();
+  return ESP_OK;
 }
 
-esp_err_t _time_http_event_handler(esp_http_client_event_t *evt) {
-  switch (evt->event_id) {
-  case HTTP_EVENT_ERROR:
-    ESP_LOGE(TAG, "HTTP_EVENT_ERROR");
-    break;
-  case HTTP_EVENT_ON_CONNECTED:
-    ESP_LOGI(TAG, "HTTP_EVENT_ON_CONNECTED");
-    break;
-  case HTTP_EVENT_HEADER_SENT:
-    ESP_LOGI(TAG, "HTTP_EVENT_HEADER_SENT");
-    break;
-  case HTTP_EVENT_ON_HEADER:
-    ESP_LOGI(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key,
-             evt->header_value);
-    break;
-  case HTTP_EVENT_ON_DATA:
-    ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-    // write to user_data, simply short string
-    uint8_t **data = (uint8_t **)evt->user_data;
-    memcpy(*data, evt->data, evt->data_len);
-    (*data) += evt->data_len;
-    break;
-  case HTTP_EVENT_ON_FINISH:
-    ESP_LOGI(TAG, "HTTP_EVENT_ON_FINISH");
-    break;
-  case HTTP_EVENT_DISCONNECTED:
-  case HTTP_EVENT_REDIRECT:
-    break;
+// Time server response body, short enough to keep whole
+typedef struct {
+  char buf[HTTP_RECEIVE_BUFFER_SIZE];
+  size_t len;
+} time_body;
+
+static esp_err_t time_body_write(void *ctx, const uint8_t *data, size_t len) {
+  time_body *body = ctx;
+  time_response_us = esp_timer_get_time();
+  if (body->len + len >= sizeof(body->buf)) {
+    ESP_LOGE(TAG, "Time server response over %d bytes", sizeof(body->buf));
+    return ESP_ERR_INVALID_SIZE;
   }
+  memcpy(body->buf + body->len, data, len);
+  body->len += len;
+  body->buf[body->len] = 0;
   return ESP_OK;
 }
 
 static esp_err_t obtain_time_http(void) {
-  esp_http_client_config_t config = {
-    .url = TIME_SERVER_URL,
-    .event_handler = _time_http_event_handler,
-    .buffer_size = HTTP_RECEIVE_BUFFER_SIZE,
-    .disable_auto_redirect = false,
+  esp_tls_cfg_t cfg = {
     .timeout_ms = HTTP_RECEIVE_TIMEOUT_MS,
 #if VALIDATE_SSL_CERTIFICATE
-    .cert_pem = (char *)time_server_cert_pem_start
+    .cacert_buf = time_server_cert_pem_start,
+    .cacert_bytes = time_server_cert_pem_end - time_server_cert_pem_start,
 #endif
   };
-  uint8_t *buf = malloc(HTTP_RECEIVE_BUFFER_SIZE);
-  if (buf == NULL) {
+  char request[256];
+  snprintf(request, sizeof(request),
+           "GET %s HTTP/1.1\r\n"
+           "Host: " TIME_SERVER_HOST "\r\n"
+           "User-Agent: esp-idf/1.0 esp32\r\n"
+           "Connection: close\r\n"
+           "\r\n",
+           http_url_path(TIME_SERVER_URL));
+  time_body *body = calloc(1, sizeof(time_body));
+  if (body == NULL) {
     ESP_LOGE(TAG, "Failed to allocate memory for request buffer");
     return ESP_FAIL;
   }
-  memset(buf, 0x00, HTTP_RECEIVE_BUFFER_SIZE);
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  uint8_t *p = buf;
-  esp_http_client_set_user_data(client, &p);
-  esp_err_t err = esp_http_client_perform(client);
+  uint8_t *buf = (uint8_t *)body->buf;
+  http_stream stream;
+  http_stream_init(&stream, NULL, time_body_write, body);
+  esp_err_t err = https_request_stream(cfg, TIME_SERVER_URL, request, &stream);
+  if (err == ESP_OK && stream.status != 200) {
+    ESP_LOGE(TAG, "HTTP status %d", stream.status);
+    err = ESP_FAIL;
+  }
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Error fetching time from server");
-    free(buf);
+    free(body);
     return err;
   }
   ESP_LOGI(TAG, "message: %s", buf);
@@ -230,11 +244,24 @@ static esp_err_t obtain_time_http(void) {
       ESP_LOGE(TAG, "Error parsing time from server");
       err = ESP_FAIL;
     } else {
-      set_timestamp(unix_time);
+      // "unixtime" is whole seconds, "datetime" carries the fraction
+      int64_t unix_time_us = unix_time * 1000000LL;
+      char datetime[48] = "";
+      if (json_obj_get_string(&jctx, "datetime", datetime, sizeof(datetime)) == 0) {
+        char *fraction = strchr(datetime, '.');
+        int scale = 100000;
+        for (char *c = fraction ? fraction + 1 : NULL; c && *c >= '0' && *c <= '9' && scale > 0; c++) {
+          unix_time_us += (*c - '0') * scale;
+          scale /= 10;
+        }
+      }
+      // account for the time spent since the response arrived
+      unix_time_us += esp_timer_get_time() - time_response_us;
+      set_timestamp_us(unix_time_us);
       print_time();
     }
   }
-  free(buf);
+  free(body);
   return err;
 }
 
@@ -245,8 +272,15 @@ esp_err_t fetch_and_store_time_in_nvs(void *args) {
   //     return ESP_FAIL;
   // }
 
+  esp_err_t r = ESP_FAIL;
+#if TIME_SYNC_SNTP
+  r = obtain_time_sntp_lean();
+  if (r != ESP_OK) {
+    ESP_LOGW(TAG, "SNTP failed, falling back to %s", TIME_SERVER_URL);
+  }
+#endif
   int retry = 3;
-  while (obtain_time_http() != ESP_OK && --retry > 0) {
+  while (r != ESP_OK && (r = obtain_time_http()) != ESP_OK && --retry > 0) {
     ESP_LOGE(TAG, "Failed to obtain time from server. Retrying %d...", retry);
   }
 
@@ -0,0 +1,72 @@
+#include "tls_session.h"
+
+static const char *TAG = "tls_session";
+
+typedef struct {
+  char host[TLS_SESSION_HOST_MAX];
+  uint16_t len;
+  uint8_t data[TLS_SESSION_SIZE_MAX];
+} tls_session_slot;
+
+// survives deep sleep, cleared on power on
+static RTC_DATA_ATTR tls_session_slot slots[TLS_SESSION_SLOTS];
+static RTC_DATA_ATTR uint8_t next_slot = 0;
+
+static tls_session_slot *find_slot(const char *host) {
+  for (int i = 0; i < TLS_SESSION_SLOTS; i++) {
+    if (slots[i].len > 0 && strcmp(slots[i].host, host) == 0) {
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+esp_err_t tls_session_load(const char *host, mbedtls_ssl_session *session) {
+  tls_session_slot *slot = find_slot(host);
+  if (!slot) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  int ret = mbedtls_ssl_session_load(session, slot->data, slot->len);
+  if (ret != 0) {
+    ESP_LOGW(TAG, "Saved session for %s unusable: -0x%x", host, -ret);
+    slot->len = 0;
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG, "Resuming session for %s, %d bytes", host, slot->len);
+  return ESP_OK;
+}
+
+void tls_session_store(const char *host, const mbedtls_ssl_context *ssl) {
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  int ret = mbedtls_ssl_get_session(ssl, &session);
+  if (ret != 0) {
+    ESP_LOGW(TAG, "No session for %s: -0x%x", host, -ret);
+    mbedtls_ssl_session_free(&session);
+    return;
+  }
+  tls_session_slot *slot = find_slot(host);
+  if (!slot) {
+    slot = &slots[next_slot];
+    next_slot = (next_slot + 1) % TLS_SESSION_SLOTS;
+  }
+  size_t len = 0;
+  ret = mbedtls_ssl_session_save(&session, slot->data, sizeof(slot->data), &len);
+  if (ret != 0) {
+    ESP_LOGW(TAG, "Session for %s not saved: -0x%x, %d bytes needed", host,
+             -ret, len);
+    slot->len = 0;
+  } else {
+    strlcpy(slot->host, host, sizeof(slot->host));
+    slot->len = len;
+    ESP_LOGI(TAG, "Saved session for %s, %d bytes", host, len);
+  }
+  mbedtls_ssl_session_free(&session);
+}
+
+void tls_session_forget(const char *host) {
+  tls_session_slot *slot = find_slot(host);
+  if (slot) {
+    slot->len = 0;
+  }
+}
@@ -1,4 +1,7 @@
 #include "common.h"
+#include "esp_netif_net_stack.h"
+#include "lwip/dhcp.h"
+#include <sys/param.h>
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
@@ -14,23 +17,73 @@ static const char *TAG = "wifi";
 
 // it's one-byte veriable, so it's safe to use it without mutex...maybe
 static bool has_inited = false;
+static bool has_started = false;
+static esp_netif_t *sta_netif = NULL;
+
+// AP and DHCP lease of the last connection, survives deep sleep
+typedef struct {
+    bool valid;
+    uint8_t bssid[6];
+    uint8_t channel;
+    time_t leased_at;  // 0 when the lease is not to be reused
+    uint32_t lease_sec; // lease time the DHCP server granted, 0 when unknown
+    esp_netif_ip_info_t ip;
+    esp_ip4_addr_t dns;
+} wifi_fast_cache;
+
+static RTC_DATA_ATTR wifi_fast_cache fast_cache = {0};
+// connecting with `fast_cache', a single failure falls back to a full connect
+static bool fast_connect = false;
+static bool static_ip = false;
+
+// Whether the cached lease is still the server's to honour, and young
+// enough to skip DHCP
+static bool lease_usable(void) {
+    if (!fast_cache.leased_at || !fast_cache.lease_sec) {
+        return false;
+    }
+    time_t age = time(NULL) - fast_cache.leased_at;
+    return age >= 0 && age < MIN((time_t)fast_cache.lease_sec, WIFI_STATIC_IP_MAX_SEC);
+}
+
+// Lease time of the running DHCP client, 0 when it has none
+static uint32_t dhcp_lease_sec(void) {
+    struct netif *netif = esp_netif_get_netif_impl(sta_netif);
+    struct dhcp *dhcp = netif ? netif_dhcp_data(netif) : NULL;
+    return dhcp && dhcp->state == DHCP_STATE_BOUND ? dhcp->offered_t0_lease : 0;
+}
+
+static void use_static_ip(void) {
+    esp_netif_dhcpc_stop(sta_netif);
+    if (esp_netif_set_ip_info(sta_netif, &fast_cache.ip) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to set static IP");
+        return;
+    }
+    esp_netif_dns_info_t dns = {0};
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    dns.ip.u_addr.ip4 = fast_cache.dns;
+    esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+}
 
 static void
 event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        // the lease is applied once associated, IP_EVENT_STA_GOT_IP follows
+        if (static_ip) {
+            use_static_ip();
+        }
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < 5) {
+        if (!has_started) {
+            // stopped on purpose
+        } else if (!fast_connect && s_retry_num < WIFI_CONNECT_RETRY) {
             esp_wifi_connect();
             s_retry_num++;
             ESP_LOGI(TAG, "Retry to connect to the AP");
         } else {
             xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-            ESP_LOGI(
-                TAG, "Connect to the AP failed %d times. Going to deepsleep %d minutes", 5,
-                DEEPSLEEP_MINUTES_AFTER_RENDER
-            );
-            deepsleep();
+            ESP_LOGI(TAG, "Connect to the AP failed after %d retries", s_retry_num);
         }
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         s_retry_num = 0;
@@ -38,23 +91,27 @@ event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* ev
     }
 }
 
-void wifi_stop_sta(void) {
-    ESP_ERROR_CHECK(esp_wifi_stop());
+bool wifi_is_started(void) {
+    return has_started;
 }
 
-// Initializes WiFi the ESP-IDF way
-void wifi_start_sta(void) {
-    if (has_inited) {
-        ESP_ERROR_CHECK(esp_wifi_start());
+void wifi_stop_sta(void) {
+    if (!has_started) {
         return;
     }
+    // clear first so the disconnect event is not taken for a failure
+    has_started = false;
+    ESP_ERROR_CHECK(esp_wifi_stop());
+}
+
+static void wifi_init(void) {
     has_inited = true;
     s_wifi_event_group = xEventGroupCreate();
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -67,7 +124,11 @@ void wifi_start_sta(void) {
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &instance_got_ip
     ));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+}
 
+// Start the station and wait for an IP, `fast' pins the cached AP and lease
+static esp_err_t wifi_connect(bool fast, uint32_t timeout_ms) {
     wifi_config_t wifi_config = {
         .sta =
             {
@@ -81,35 +142,90 @@ void wifi_start_sta(void) {
                 .pmf_cfg = {.capable = true, .required = false},
             },
     };
+    fast_connect = fast;
+    static_ip = fast && lease_usable();
+    if (fast) {
+        // directed connect on the known channel, no full scan
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, fast_cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = fast_cache.channel;
+    }
+    if (static_ip) {
+        // keep the default handlers from starting DHCP on connect
+        esp_netif_dhcpc_stop(sta_netif);
+    } else {
+        esp_netif_dhcpc_start(sta_netif);
+    }
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
 
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config((wifi_interface_t)ESP_IF_WIFI_STA, &wifi_config));
+    s_retry_num = 0;
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+    has_started = true;
     ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
 
     /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed
      * for the maximum number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see
      * above) */
     EventBits_t bits = xEventGroupWaitBits(
-        s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, portMAX_DELAY
+        s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE,
+        pdMS_TO_TICKS(timeout_ms)
     );
-
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which
-     * event actually happened. */
     if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "Connected to ap SSID:%s", ESP_WIFI_SSID);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s", ESP_WIFI_SSID);
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
+        return ESP_OK;
     }
+    wifi_stop_sta();
+    return (bits & WIFI_FAIL_BIT) ? ESP_FAIL : ESP_ERR_TIMEOUT;
+}
 
-    /* The event will not be processed after unregister */
-    ESP_ERROR_CHECK(
-        esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip)
-    );
-    ESP_ERROR_CHECK(
-        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id)
-    );
-    vEventGroupDelete(s_wifi_event_group);
+// Remember the AP and lease for the next wake
+static void save_fast_cache(void) {
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    memcpy(fast_cache.bssid, ap.bssid, sizeof(fast_cache.bssid));
+    fast_cache.channel = ap.primary;
+    if (!static_ip) {
+        esp_netif_dns_info_t dns;
+        esp_netif_get_ip_info(sta_netif, &fast_cache.ip);
+        esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+        fast_cache.dns = dns.ip.u_addr.ip4;
+        fast_cache.leased_at = time(NULL);
+        fast_cache.lease_sec = dhcp_lease_sec();
+    }
+    fast_cache.valid = true;
+}
+
+// Initializes WiFi the ESP-IDF way
+esp_err_t wifi_start_sta(void) {
+    if (has_started) {
+        return ESP_OK;
+    }
+    int64_t connect_start = esp_timer_get_time();
+    if (!has_inited) {
+        wifi_init();
+    }
+    esp_err_t err = ESP_FAIL;
+    bool fast = fast_cache.valid;
+    if (fast) {
+        err = wifi_connect(true, WIFI_FAST_CONNECT_TIMEOUT_MS);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Fast connect failed (%s), trying a full scan and DHCP", esp_err_to_name(err));
+            memset(&fast_cache, 0, sizeof(fast_cache));
+            fast = false;
+        }
+    }
+    if (!fast) {
+        err = wifi_connect(false, WIFI_CONNECT_TIMEOUT_MS);
+    }
+    int64_t connect_ms = (esp_timer_get_time() - connect_start) / 1000;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to connect to SSID:%s in %lld ms: %s", ESP_WIFI_SSID, connect_ms,
+                 esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Connected to ap SSID:%s, got IP in %lld ms (%s%s)", ESP_WIFI_SSID, connect_ms,
+             fast ? "cached AP" : "full scan", static_ip ? ", cached lease" : ", DHCP");
+    save_fast_cache();
+    return ESP_OK;
 }
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""Serve one image over HTTP and drop connections mid-body.
+
+Used to exercise the resumable downloader by hand: point IMG_URL at
+http://<host>:<port>/<name>. Supports `Range: bytes=N-` with `If-Range`
+against a strong ETag or Last-Modified, like a typical static server.
+test/test_download.c runs it on an ephemeral port (--port 0).
+
+    scripts/flaky_http_server.py image.jpg --port 8080 --drop-after 65536 --drops 3
+"""
+import argparse
+import email.utils
+import hashlib
+import os
+import re
+import socketserver
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+
+def make_handler(path, drop_after, drops, no_ranges, weak_etag, redirect):
+    data = open(path, "rb").read()
+    etag = '"%s"' % hashlib.sha1(data).hexdigest()[:16]
+    if weak_etag:
+        etag = "W/" + etag
+    last_modified = email.utils.formatdate(os.path.getmtime(path), usegmt=True)
+    state = {"drops": drops}
+
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def do_GET(self):
+            if redirect and self.path != "/image":
+                # with a body, which is not the image
+                body = b"moved to /image"
+                self.send_response(302)
+                self.send_header("Location", "/image")
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+                return
+            start = 0
+            match = re.match(r"bytes=(\d+)-$", self.headers.get("Range", ""))
+            if_range = self.headers.get("If-Range")
+            # a weak ETag never matches `If-Range'
+            strong = (etag,) if etag.startswith('"') else ()
+            if match and not no_ranges and (if_range is None or if_range in strong + (last_modified,)):
+                start = int(match.group(1))
+                if start >= len(data):
+                    self.send_response(416)
+                    self.send_header("Content-Range", "bytes */%d" % len(data))
+                    self.send_header("Content-Length", "0")
+                    self.end_headers()
+                    return
+            body = data[start:]
+            if start:
+                self.send_response(206)
+                self.send_header("Content-Range", "bytes %d-%d/%d" % (start, len(data) - 1, len(data)))
+            else:
+                self.send_response(200)
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Length", str(len(body)))
+            self.send_header("ETag", etag)
+            self.send_header("Last-Modified", last_modified)
+            if not no_ranges:
+                self.send_header("Accept-Ranges", "bytes")
+            self.end_headers()
+            if state["drops"] > 0 and len(body) > drop_after:
+                state["drops"] -= 1
+                self.wfile.write(body[:drop_after])
+                self.wfile.flush()
+                self.log_message("dropped after %d of %d bytes, %d drops left",
+                                 drop_after, len(body), state["drops"])
+                self.close_connection = True
+                self.connection.shutdown(2)
+                return
+            self.wfile.write(body)
+
+    return Handler
+
+
+class Server(socketserver.ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--drop-after", type=int, default=64 * 1024,
+                        help="bytes of body sent before dropping the connection")
+    parser.add_argument("--drops", type=int, default=3,
+                        help="number of requests to drop, then serve normally")
+    parser.add_argument("--no-ranges", action="store_true",
+                        help="ignore Range, always answer 200 with the full body")
+    parser.add_argument("--weak-etag", action="store_true",
+                        help="send a weak ETag, only Last-Modified can resume")
+    parser.add_argument("--redirect", action="store_true",
+                        help="serve the file at /image, redirect other paths there")
+    args = parser.parse_args()
+    handler = make_handler(args.file, args.drop_after, args.drops, args.no_ranges,
+                           args.weak_etag, args.redirect)
+    server = Server(("", args.port), handler)
+    print("Serving %s on port %d" % (args.file, server.server_address[1]), flush=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
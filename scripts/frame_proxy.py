@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+"""Pre-render images into the clock's native frame format.
+
+The clock stores every image as the zlib stream of its 4bpp framebuffer.
+Converting JPEG/PNG on the device means decoding, gamma and compressing
+after each download; this does it once on a Linux host instead. A frame is
+a 16 byte header (see fb_frame_header in main/include/fb_save_load.h)
+followed by that zlib stream, which the device stores as is.
+
+    # one file
+    frame_proxy.py convert photo.jpg photo.epdf --width 1448 --height 1072
+
+    # HTTP proxy, point IMG_URL at http://<host>:8090/
+    frame_proxy.py serve --source https://loremflickr.com/1448/1072 --port 8090
+    frame_proxy.py serve --source ~/Pictures/clock --port 8090
+
+    # host conversion cost and sizes; with device logs, download to
+    # displayable time of both paths
+    frame_proxy.py bench photo.jpg other.png --device-log monitor.log
+
+The server answers with application/x-epdiy-frame when the request accepts
+it, laid out for the X-EPD-Width/Height/Rotation headers the device sends,
+and passes the original image through otherwise.
+"""
+import argparse
+import hashlib
+import io
+import os
+import random
+import re
+import statistics
+import struct
+import sys
+import time
+import urllib.request
+import zlib
+from http.server import BaseHTTPRequestHandler, HTTPServer
+from socketserver import ThreadingMixIn
+
+import numpy as np
+from PIL import Image, ImageOps
+
+CONTENT_TYPE = "application/x-epdiy-frame"
+MAGIC = b"EPDF"
+VERSION = 1
+HEADER = struct.Struct("<4sBBBBHHI")
+
+# EpdRotation
+ROT_LANDSCAPE, ROT_PORTRAIT, ROT_INVERTED_LANDSCAPE, ROT_INVERTED_PORTRAIT = range(4)
+
+# generate_gamme(0.7) in main/epdiy-clock.c
+GAMMA = np.array([round(255 * pow(v / 255.0, 1.0 / 0.7)) for v in range(256)], dtype=np.uint8)
+
+
+def render(image, width, height, fit="contain"):
+    """Grey levels of `image` centred on a white width x height canvas."""
+    image = ImageOps.exif_transpose(image).convert("RGBA")
+    if fit == "contain" and (image.width > width or image.height > height):
+        image.thumbnail((width, height), Image.LANCZOS)
+    elif fit == "cover":
+        image = ImageOps.fit(image, (width, height), Image.LANCZOS)
+    rgba = np.asarray(image, dtype=np.uint32)
+    # same weights as the device, transparent pixels are white
+    grey = (rgba[..., 0] * 38 + rgba[..., 1] * 75 + rgba[..., 2] * 15) >> 7
+    grey[rgba[..., 3] == 0] = 255
+    canvas = np.full((height, width), 255, dtype=np.uint8)
+    x = (width - image.width) // 2
+    y = (height - image.height) // 2
+    # crop like the device does when the image is larger than the display
+    sx, sy = max(0, -x), max(0, -y)
+    dx, dy = max(0, x), max(0, y)
+    w = min(image.width - sx, width - dx)
+    h = min(image.height - sy, height - dy)
+    canvas[dy:dy + h, dx:dx + w] = GAMMA[grey[sy:sy + h, sx:sx + w]]
+    return canvas
+
+
+def to_panel(logical, rotation):
+    """Framebuffer order for the rotation, as epd_draw_pixel maps it."""
+    if rotation == ROT_LANDSCAPE:
+        return logical
+    if rotation == ROT_INVERTED_LANDSCAPE:
+        return logical[::-1, ::-1]
+    if rotation == ROT_PORTRAIT:
+        return logical.T[:, ::-1]
+    if rotation == ROT_INVERTED_PORTRAIT:
+        return logical.T[::-1, :]
+    raise ValueError("rotation %d" % rotation)
+
+
+def pack_4bpp(panel):
+    """Two pixels per byte, even x in the low nibble."""
+    nibbles = panel >> 4
+    return (nibbles[:, 0::2] | (nibbles[:, 1::2] << 4)).astype(np.uint8).tobytes()
+
+
+def make_frame(data, width, height, rotation, fit="contain", level=9):
+    logical = render(Image.open(io.BytesIO(data)), width, height, fit)
+    fb = pack_4bpp(np.ascontiguousarray(to_panel(logical, rotation)))
+    header = HEADER.pack(MAGIC, VERSION, 4, rotation, 1, width, height, len(fb))
+    return header + zlib.compress(fb, level)
+
+
+def read_frame(frame):
+    """Header fields and framebuffer of a frame, for checking."""
+    magic, version, bpp, rotation, compression, width, height, length = HEADER.unpack_from(frame)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a frame")
+    fb = zlib.decompress(frame[HEADER.size:])
+    if len(fb) != length:
+        raise ValueError("framebuffer is %d bytes, header says %d" % (len(fb), length))
+    return dict(bpp=bpp, rotation=rotation, width=width, height=height), fb
+
+
+class Source:
+    """Images from a directory, or fetched from an upstream URL."""
+
+    def __init__(self, source):
+        self.source = os.path.expanduser(source)
+
+    def get(self, path):
+        if os.path.isdir(self.source):
+            names = sorted(n for n in os.listdir(self.source) if not n.startswith("."))
+            name = os.path.basename(path)
+            if name not in names:
+                name = random.choice(names)
+            with open(os.path.join(self.source, name), "rb") as f:
+                return f.read()
+        request = urllib.request.Request(self.source, headers={"User-Agent": "frame_proxy"})
+        with urllib.request.urlopen(request, timeout=30) as response:
+            return response.read()
+
+
+def make_handler(source, args):
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def do_GET(self):
+            try:
+                data = source.get(self.path)
+            except Exception as e:
+                self.send_error(502, str(e))
+                return
+            content_type = "application/octet-stream"
+            if CONTENT_TYPE in self.headers.get("Accept", ""):
+                width = int(self.headers.get("X-EPD-Width", args.width))
+                height = int(self.headers.get("X-EPD-Height", args.height))
+                rotation = int(self.headers.get("X-EPD-Rotation", args.rotation))
+                start = time.monotonic()
+                data = make_frame(data, width, height, rotation, args.fit, args.level)
+                self.log_message("frame %dx%d rotation %d, %d bytes in %.0f ms", width, height,
+                                 rotation, len(data), (time.monotonic() - start) * 1000)
+                content_type = CONTENT_TYPE
+            etag = '"%s"' % hashlib.sha1(data).hexdigest()[:16]
+            if self.headers.get("If-None-Match") == etag:
+                self.send_response(304)
+                self.send_header("ETag", etag)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            self.send_response(200)
+            self.send_header("Content-Type", content_type)
+            self.send_header("Content-Length", str(len(data)))
+            self.send_header("ETag", etag)
+            self.end_headers()
+            self.wfile.write(data)
+
+    return Handler
+
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+
+def cmd_convert(args):
+    with open(args.input, "rb") as f:
+        frame = make_frame(f.read(), args.width, args.height, args.rotation, args.fit, args.level)
+    with open(args.output, "wb") as f:
+        f.write(frame)
+    print("%s: %d bytes" % (args.output, len(frame)))
+
+
+def cmd_serve(args):
+    handler = make_handler(Source(args.source), args)
+    print("Serving frames from %s on port %d" % (args.source, args.port))
+    Server(("", args.port), handler).serve_forever()
+
+
+DEVICE_LOG = re.compile(r"displayable (\d+) ms after download start \((frame|converted)\)")
+
+
+def cmd_bench(args):
+    print("%-32s %10s %10s %10s" % ("image", "source B", "frame B", "proxy ms"))
+    for path in args.images:
+        with open(path, "rb") as f:
+            data = f.read()
+        times = []
+        for _ in range(args.repeat):
+            start = time.monotonic()
+            frame = make_frame(data, args.width, args.height, args.rotation, args.fit, args.level)
+            times.append((time.monotonic() - start) * 1000)
+        read_frame(frame)
+        print("%-32s %10d %10d %10.0f" % (os.path.basename(path)[:32], len(data), len(frame),
+                                          statistics.median(times)))
+    if args.device_log:
+        # download to displayable on the device, from its monitor output
+        samples = {"frame": [], "converted": []}
+        with open(args.device_log, errors="replace") as f:
+            for line in f:
+                m = DEVICE_LOG.search(line)
+                if m:
+                    samples[m.group(2)].append(int(m.group(1)))
+        print()
+        print("%-10s %6s %10s %10s %10s" % ("path", "count", "median ms", "min ms", "max ms"))
+        for path, values in samples.items():
+            if values:
+                print("%-10s %6d %10.0f %10d %10d" % (path, len(values), statistics.median(values),
+                                                      min(values), max(values)))
+            else:
+                print("%-10s %6d" % (path, 0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    def display_args(p):
+        p.add_argument("--width", type=int, default=1448, help="epd_rotated_display_width()")
+        p.add_argument("--height", type=int, default=1072, help="epd_rotated_display_height()")
+        p.add_argument("--rotation", type=int, default=ROT_LANDSCAPE, choices=range(4),
+                       help="EpdRotation, DISPLAY_ROTATION in settings.h")
+        p.add_argument("--fit", choices=("contain", "cover", "none"), default="contain",
+                       help="scale down to fit, fill and crop, or centre unscaled like the device")
+        p.add_argument("--level", type=int, default=9, help="zlib level")
+
+    p = sub.add_parser("convert", help="convert one image to a frame file")
+    p.add_argument("input")
+    p.add_argument("output")
+    display_args(p)
+    p.set_defaults(func=cmd_convert)
+
+    p = sub.add_parser("serve", help="serve frames converted from a URL or directory")
+    p.add_argument("--source", required=True, help="upstream image URL or directory of images")
+    p.add_argument("--port", type=int, default=8090)
+    display_args(p)
+    p.set_defaults(func=cmd_serve)
+
+    p = sub.add_parser("bench", help="frame sizes and conversion time")
+    p.add_argument("images", nargs="+")
+    p.add_argument("--repeat", type=int, default=3)
+    p.add_argument("--device-log", help="device monitor output to summarize")
+    display_args(p)
+    p.set_defaults(func=cmd_bench)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
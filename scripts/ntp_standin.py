@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Minimal NTP server for trying the clock's SNTP client on a LAN.
+
+Answers version 3/4 client requests with this host's clock shifted by
+--offset seconds, optionally late, never, or with a kiss-o'-death.
+Several instances on different ports stand in for a server list, e.g.
+ESP_SNTP_SERVER_LIST("192.168.1.2:1123", "192.168.1.2:1124").
+
+    scripts/ntp_standin.py --port 1123 --offset 3.5
+    scripts/ntp_standin.py --port 1124 --delay 0.8
+    scripts/ntp_standin.py --port 1125 --mode silent
+
+test/test_sntp_lean.c runs it on an ephemeral port (--port 0).
+"""
+import argparse
+import socket
+import struct
+import time
+
+NTP_UNIX_OFFSET = 2208988800
+
+
+def ntp_timestamp(t):
+    return (int(t) + NTP_UNIX_OFFSET) << 32 | int((t % 1) * (1 << 32))
+
+
+def reply(request, received, args):
+    transmit = time.time() + args.offset
+    stratum = 0 if args.mode == "kod" else 2
+    leap = 3 if args.mode == "unsynced" else 0
+    head = struct.pack("!BBbb", leap << 6 | 4 << 3 | 4, stratum, 6, -20)
+    root = struct.pack("!II4s", 0, 0, b"RATE" if args.mode == "kod" else b"LOCL")
+    # originate is the client's transmit timestamp, echoed back
+    originate = struct.unpack("!Q", request[40:48])[0]
+    if args.mode == "mismatch":
+        # an answer to some other request
+        originate ^= 1 << 32
+    stamps = struct.pack("!QQQQ", ntp_timestamp(received), originate,
+                         ntp_timestamp(received), ntp_timestamp(transmit))
+    return head + root + stamps
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", type=int, default=123)
+    parser.add_argument("--offset", type=float, default=0.0, help="seconds added to this host's clock")
+    parser.add_argument("--delay", type=float, default=0.0, help="seconds to wait before answering")
+    parser.add_argument("--mode", choices=("normal", "silent", "kod", "unsynced", "mismatch"), default="normal")
+    args = parser.parse_args()
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    print("NTP stand-in on port %d, offset %+.3f s, %s" % (sock.getsockname()[1], args.offset, args.mode),
+          flush=True)
+    while True:
+        request, peer = sock.recvfrom(512)
+        received = time.time() + args.offset
+        if len(request) < 48 or request[0] & 0x7 != 3 or args.mode == "silent":
+            continue
+        time.sleep(args.delay)
+        sock.sendto(reply(request, received, args), peer)
+        print("answered %s:%d" % peer, flush=True)
+
+
+if __name__ == "__main__":
+    main()
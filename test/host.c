@@ -0,0 +1,22 @@
+// ESP-IDF and newlib functions the firmware sources under test call
+#include <time.h>
+#include "esp_timer.h"
+#include "host_compat.h"
+
+int64_t esp_timer_get_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#ifdef HOST_NEEDS_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+  if (size) {
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return len;
+}
+#endif
@@ -0,0 +1,5 @@
+// Host stand-in for ESP-IDF's esp_timer.h, see host.c
+#pragma once
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,9 @@
+// Included first in every host test build: what newlib offers the firmware
+// and glibc before 2.38 lacks, see host.c
+#pragma once
+#include <string.h>
+
+#if defined(__GLIBC__) && __GLIBC__ == 2 && __GLIBC_MINOR__ < 38
+#define HOST_NEEDS_STRLCPY 1
+size_t strlcpy(char *dst, const char *src, size_t size);
+#endif
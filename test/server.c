@@ -0,0 +1,47 @@
+#include "server.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+bool server_start(server *s, char *const argv[]) {
+  int out[2];
+  memset(s, 0, sizeof(*s));
+  if (pipe(out) != 0) {
+    return false;
+  }
+  s->pid = fork();
+  if (s->pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(out[1]);
+  s->out = fdopen(out[0], "r");
+  char line[256];
+  char *at = NULL;
+  if (s->pid > 0 && s->out && fgets(line, sizeof(line), s->out)) {
+    at = strstr(line, "port ");
+  }
+  if (!at || (s->port = atoi(at + 5)) <= 0) {
+    fprintf(stderr, "%s did not start\n", argv[0]);
+    server_stop(s);
+    return false;
+  }
+  return true;
+}
+
+void server_stop(server *s) {
+  if (s->pid > 0) {
+    kill(s->pid, SIGTERM);
+    waitpid(s->pid, NULL, 0);
+  }
+  if (s->out) {
+    fclose(s->out);
+  }
+  memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,20 @@
+// Stand-in servers from scripts/, run on localhost for one test
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef struct {
+  pid_t pid;
+  FILE *out;  // its stdout, kept open so that it can go on printing
+  int port;
+} server;
+
+// Run `argv' (NULL terminated) and wait for the "... port N" line it prints
+// once listening.
+bool server_start(server *s, char *const argv[]);
+void server_stop(server *s);
+
+#endif
@@ -0,0 +1,48 @@
+// Minimal checks for the host tests, a failed check is reported and counted
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+#include <string.h>
+
+static int test_checks = 0;
+static int test_failures = 0;
+
+#define CHECK(cond)                                                        \
+  do {                                                                     \
+    test_checks++;                                                         \
+    if (!(cond)) {                                                         \
+      test_failures++;                                                     \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, \
+              __func__, #cond);                                            \
+    }                                                                      \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                          \
+  do {                                                                          \
+    long long a_ = (long long)(a), b_ = (long long)(b);                         \
+    test_checks++;                                                              \
+    if (a_ != b_) {                                                             \
+      test_failures++;                                                          \
+      fprintf(stderr, "%s:%d: %s: %s is %lld, expected %lld\n", __FILE__,       \
+              __LINE__, __func__, #a, a_, b_);                                  \
+    }                                                                           \
+  } while (0)
+
+#define CHECK_STR(a, b)                                                         \
+  do {                                                                          \
+    test_checks++;                                                              \
+    if (strcmp((a), (b)) != 0) {                                                \
+      test_failures++;                                                          \
+      fprintf(stderr, "%s:%d: %s: %s is \"%s\", expected \"%s\"\n", __FILE__,   \
+              __LINE__, __func__, #a, (a), (b));                                \
+    }                                                                           \
+  } while (0)
+
+// Exit status of the test program
+static inline int test_summary(const char *name) {
+  printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+  return test_failures ? 1 : 0;
+}
+
+#endif
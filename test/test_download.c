@@ -0,0 +1,197 @@
+// Host test of main/download.c against scripts/flaky_http_server.py, which
+// drops connections mid-body: retries have to resume where the body broke
+// off and end with the file the server has.
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "download.h"
+#include "flash_writer.h"
+#include "settings.h"
+#include "time_sync.h"
+#include "server.h"
+#include "test.h"
+
+#define BODY_SIZE 5000
+#define DROP_AFTER 1000
+
+// flash_writer on stdio, the ring and its task are not under test
+static FILE *writer = NULL;
+static bool close_fails = false;  // like a flush of the ring failing
+
+esp_err_t flash_writer_open(const char *filename, const char *mode) {
+  writer = fopen(filename, mode);
+  return writer ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t flash_writer_write(const void *data, size_t len) {
+  return fwrite(data, 1, len, writer) == len ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t flash_writer_close(void) {
+  esp_err_t err = fclose(writer) == 0 && !close_fails ? ESP_OK : ESP_FAIL;
+  writer = NULL;
+  return err;
+}
+
+bool flash_writer_is_open(void) {
+  return writer != NULL;
+}
+
+esp_err_t fb_frame_header_check(const fb_frame_header *header) {
+  return ESP_OK;
+}
+
+esp_err_t http_date_parse(const char *value, time_t *t) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+static char last_request[1024];
+
+// Plain TCP in place of https_request_stream
+static esp_err_t socket_transport(const char *url, const char *request,
+                                  http_stream *stream) {
+  char host[64], port[8];
+  http_url_host(url, host, sizeof(host), port, sizeof(port));
+  strncpy(last_request, request, sizeof(last_request) - 1);
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addr;
+  if (getaddrinfo(host, port, &hints, &addr) != 0) {
+    return ESP_FAIL;
+  }
+  int fd = socket(addr->ai_family, addr->ai_socktype, 0);
+  esp_err_t err = ESP_FAIL;
+  if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+      send(fd, request, strlen(request), 0) == strlen(request)) {
+    uint8_t buf[700];  // not a divisor of DROP_AFTER
+    err = ESP_OK;
+    while (err == ESP_OK && !http_stream_done(stream)) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n < 0) {
+        err = ESP_FAIL;
+      } else if (n == 0) {
+        err = http_stream_finish(stream);
+        break;
+      } else {
+        err = http_stream_feed(stream, buf, n);
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  freeaddrinfo(addr);
+  return err;
+}
+
+// download_to in epdiy-clock.c, returns the number of attempts or 0
+static int download(char *url, size_t url_len, const char *file) {
+  download_resume_reset();
+  for (int attempt = 1; attempt <= HTTP_RECEIVE_RETRY; attempt++) {
+    int status = 0;
+    if (download_fetch(socket_transport, url, url_len, file, NULL, "", &status) == ESP_OK) {
+      return attempt;
+    }
+  }
+  return 0;
+}
+
+static bool same_file(const char *a, const char *b) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "cmp -s %s %s", a, b);
+  return system(cmd) == 0;
+}
+
+typedef struct {
+  const char *name;
+  const char *option;      // for the server, NULL for none
+  const char *path;
+  int drops;
+  int attempts;            // expected
+  uint32_t range_start;    // of the last response, 0 for a full body
+  const char *if_range;    // prefix of the last `If-Range', NULL for none
+  const char *final_path;
+} scenario;
+
+static const scenario scenarios[] = {
+    {"strong ETag", NULL, "/file", 2, 3, 2 * DROP_AFTER, "If-Range: \"", "/file"},
+    // resumed with Last-Modified, the weak ETag would make the server ignore the range
+    {"weak ETag", "--weak-etag", "/file", 1, 2, DROP_AFTER, "If-Range: Thu", "/file"},
+    {"no ranges", "--no-ranges", "/file", 1, 2, 0, "If-Range: \"", "/file"},
+    // the 302 has a body that must not end up in the file
+    {"redirect", "--redirect", "/", 1, 2, DROP_AFTER, "If-Range: \"", "/image"},
+    {"no drops", "--redirect", "/", 0, 1, 0, NULL, "/image"},
+};
+
+int main(void) {
+  char source[] = "/tmp/test_download_srcXXXXXX";
+  char target[] = "/tmp/test_download_dstXXXXXX";
+  int fd = mkstemp(source);
+  close(mkstemp(target));
+  uint8_t body[BODY_SIZE];
+  srand(1);
+  for (int i = 0; i < BODY_SIZE; i++) {
+    body[i] = rand();
+  }
+  CHECK(write(fd, body, BODY_SIZE) == BODY_SIZE);
+  close(fd);
+  // a fixed Last-Modified, a Thursday
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "touch -d '2024-01-04 12:00:00 UTC' %s", source);
+  CHECK(system(cmd) == 0);
+
+  for (int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    const scenario *sc = &scenarios[i];
+    fprintf(stderr, "--- %s\n", sc->name);
+    char drops[8], drop_after[8];
+    snprintf(drops, sizeof(drops), "%d", sc->drops);
+    snprintf(drop_after, sizeof(drop_after), "%d", DROP_AFTER);
+    char *argv[] = {"python3", "../scripts/flaky_http_server.py", source, "--port", "0",
+                    "--drops", drops, "--drop-after", drop_after, (char *)sc->option, NULL};
+    server srv;
+    if (!server_start(&srv, argv)) {
+      CHECK(!"server started");
+      break;
+    }
+    char url[512];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", srv.port, sc->path);
+    memset(last_request, 0, sizeof(last_request));
+    CHECK_EQ(download(url, sizeof(url), target), sc->attempts);
+    CHECK(same_file(source, target));
+    CHECK_EQ(resume.received, BODY_SIZE);
+    CHECK_EQ(resume.range_start, sc->range_start);
+    char *if_range = strstr(last_request, "If-Range: ");
+    if (sc->if_range) {
+      CHECK(if_range && strncmp(if_range, sc->if_range, strlen(sc->if_range)) == 0);
+    } else {
+      CHECK(if_range == NULL);
+    }
+    // resumed at the URL the body came from
+    CHECK(strstr(url, sc->final_path) && strcmp(strstr(url, sc->final_path), sc->final_path) == 0);
+    CHECK(strcmp(resume.url, url) == 0);
+    server_stop(&srv);
+  }
+
+  // the last write fails on close: no success and no file left behind
+  char *argv[] = {"python3", "../scripts/flaky_http_server.py", source, "--port", "0",
+                  "--drops", "0", NULL};
+  server srv;
+  if (server_start(&srv, argv)) {
+    char url[512];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/file", srv.port);
+    close_fails = true;
+    CHECK_EQ(download(url, sizeof(url), target), 0);
+    CHECK(access(target, F_OK) != 0);
+    CHECK_EQ(resume.received, 0);
+    close_fails = false;
+    server_stop(&srv);
+  } else {
+    CHECK(!"server started");
+  }
+  unlink(source);
+  unlink(target);
+  return test_summary("download");
+}
@@ -0,0 +1,194 @@
+// Host test of main/http_stream.c: responses are fed whole, byte by byte
+// and cut short, the sink has to see the same headers and body each time.
+#include <stdio.h>
+#include <string.h>
+#include "http_stream.h"
+#include "test.h"
+
+typedef struct {
+  char headers[1024];  // "key=value;" in order
+  char body[1024];
+  size_t body_len;
+  int fail_after;      // body callbacks before one fails, 0 for never
+} sink;
+
+static esp_err_t on_header(void *ctx, const char *key, const char *value) {
+  sink *s = ctx;
+  size_t n = strlen(s->headers);
+  snprintf(s->headers + n, sizeof(s->headers) - n, "%s=%s;", key, value);
+  return ESP_OK;
+}
+
+static esp_err_t on_body(void *ctx, const uint8_t *data, size_t len) {
+  sink *s = ctx;
+  if (s->fail_after && --s->fail_after == 0) {
+    return ESP_FAIL;
+  }
+  CHECK(s->body_len + len <= sizeof(s->body));
+  memcpy(s->body + s->body_len, data, len);
+  s->body_len += len;
+  return ESP_OK;
+}
+
+// Feed `response' in pieces of `step' bytes, 0 for all at once, then close
+// the connection if it is not done. Returns the first error.
+static esp_err_t run(http_stream *st, sink *s, const char *response, size_t step) {
+  memset(s, 0, sizeof(*s));
+  http_stream_init(st, on_header, on_body, s);
+  size_t len = strlen(response);
+  if (!step) {
+    step = len;
+  }
+  for (size_t i = 0; i < len; i += step) {
+    esp_err_t err = http_stream_feed(st, (const uint8_t *)response + i,
+                                     len - i < step ? len - i : step);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  return http_stream_done(st) ? ESP_OK : http_stream_finish(st);
+}
+
+static const size_t steps[] = {0, 1, 2, 7};
+
+static void test_content_length(void) {
+  const char *response = "HTTP/1.1 200 OK\r\n"
+                         "Content-Length: 11\r\n"
+                         "ETag:  \"abc\" \r\n"
+                         "\r\n"
+                         "hello world"
+                         "HTTP/1.1 200 OK\r\n";  // next response, ignored
+  for (int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+    http_stream st;
+    sink s;
+    CHECK_EQ(run(&st, &s, response, steps[i]), ESP_OK);
+    CHECK_EQ(st.status, 200);
+    CHECK_EQ(st.content_length, 11);
+    CHECK_STR(s.headers, "Content-Length=11;ETag=\"abc\";");
+    CHECK_EQ(s.body_len, 11);
+    CHECK(memcmp(s.body, "hello world", 11) == 0);
+    CHECK_EQ(st.received, 11);
+  }
+}
+
+static void test_chunked(void) {
+  const char *response = "HTTP/1.1 200 OK\r\n"
+                         "Content-Length: 99\r\n"
+                         "Transfer-Encoding: gzip, chunked\r\n"
+                         "\r\n"
+                         "5;name=value\r\n"
+                         "hello\r\n"
+                         "1\r\n"
+                         " \r\n"
+                         "5\r\n"
+                         "world\r\n"
+                         "0\r\n"
+                         "Trailer: ignored\r\n"
+                         "\r\n";
+  for (int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+    http_stream st;
+    sink s;
+    CHECK_EQ(run(&st, &s, response, steps[i]), ESP_OK);
+    CHECK(st.chunked);
+    CHECK_EQ(s.body_len, 11);
+    CHECK(memcmp(s.body, "hello world", 11) == 0);
+    // trailer fields don't reach the header callback
+    CHECK(strstr(s.headers, "Trailer") == NULL);
+  }
+}
+
+static void test_split_header(void) {
+  // header lines split across feeds, LF only line ends, an interim response
+  const char *parts[] = {"HTTP/1.1 100 Continue\r\n\r\nHTTP/1.", "1 206 Partial",
+                         " Content\r\nContent-Ra", "nge: bytes 4-7/8\nContent-",
+                         "Length: 4\r", "\n\r", "\n12", "34"};
+  http_stream st;
+  sink s;
+  memset(&s, 0, sizeof(s));
+  http_stream_init(&st, on_header, on_body, &s);
+  for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    CHECK_EQ(http_stream_feed(&st, (const uint8_t *)parts[i], strlen(parts[i])), ESP_OK);
+  }
+  CHECK(http_stream_done(&st));
+  CHECK_EQ(st.status, 206);
+  CHECK_STR(s.headers, "Content-Range=bytes 4-7/8;Content-Length=4;");
+  CHECK_EQ(s.body_len, 4);
+  CHECK(memcmp(s.body, "1234", 4) == 0);
+}
+
+static void test_truncated(void) {
+  const char *cases[] = {
+      // in the body, in a chunk, in the chunk size line, in the headers
+      "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n01234",
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\na\r\n01234",
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\n01234\r\n",
+      "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n",
+  };
+  for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    for (int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+      http_stream st;
+      sink s;
+      CHECK_EQ(run(&st, &s, cases[c], steps[i]), ESP_ERR_INVALID_SIZE);
+      CHECK(!http_stream_done(&st));
+      // what did arrive was delivered
+      CHECK_EQ(s.body_len, c < 3 ? 5 : 0);
+    }
+  }
+}
+
+static void test_close_delimited(void) {
+  // no length, the body ends with the connection
+  http_stream st;
+  sink s;
+  CHECK_EQ(run(&st, &s, "HTTP/1.0 200 OK\r\n\r\nuntil close", 3), ESP_OK);
+  CHECK_EQ(st.content_length, -1);
+  CHECK_EQ(s.body_len, 11);
+}
+
+static void test_no_body(void) {
+  http_stream st;
+  sink s;
+  CHECK_EQ(run(&st, &s, "HTTP/1.1 304 Not Modified\r\nContent-Length: 5\r\n\r\n", 0), ESP_OK);
+  CHECK(http_stream_done(&st));
+  CHECK_EQ(s.body_len, 0);
+}
+
+static void test_bad_input(void) {
+  http_stream st;
+  sink s;
+  CHECK_EQ(run(&st, &s, "HTTP/2 200\r\n\r\n", 0), ESP_ERR_INVALID_RESPONSE);
+  CHECK_EQ(run(&st, &s, "HTTP/1.1 200 OK\r\nno colon\r\n\r\n", 0), ESP_ERR_INVALID_RESPONSE);
+  CHECK_EQ(run(&st, &s, "HTTP/1.1 200 OK\r\nContent-Length: x\r\n\r\n", 0),
+           ESP_ERR_INVALID_RESPONSE);
+  CHECK_EQ(run(&st, &s, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 0),
+           ESP_ERR_INVALID_RESPONSE);
+  CHECK_EQ(run(&st, &s, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nab\r\n", 0),
+           ESP_ERR_INVALID_RESPONSE);
+}
+
+static void test_sink_failure(void) {
+  http_stream st;
+  sink s;
+  memset(&s, 0, sizeof(s));
+  s.fail_after = 2;
+  http_stream_init(&st, on_header, on_body, &s);
+  const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nabcd";
+  esp_err_t err = ESP_OK;
+  for (size_t i = 0; i < strlen(response) && err == ESP_OK; i++) {
+    err = http_stream_feed(&st, (const uint8_t *)response + i, 1);
+  }
+  CHECK_EQ(err, ESP_FAIL);
+  CHECK_EQ(s.body_len, 1);
+}
+
+int main(void) {
+  test_content_length();
+  test_chunked();
+  test_split_header();
+  test_truncated();
+  test_close_delimited();
+  test_no_body();
+  test_bad_input();
+  test_sink_failure();
+  return test_summary("http_stream");
+}
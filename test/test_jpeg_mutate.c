@@ -0,0 +1,196 @@
+// Host test of components/jpegdec on damaged input: the bench/corpus JPEGs
+// are mutated in their headers, EXIF and entropy coded data, then opened,
+// scanned for saliency and decoded the way draw_jpeg_jpegdec() does it.
+// Built with ASan and UBSan, any bad access or overflow aborts the run; a
+// decode stuck for TIMEOUT_SEC counts as an endless loop. The mutation is
+// printed before each decode, so the last line names the culprit.
+//
+//   test_jpeg_mutate [mutants per file [seed [file ...]]]
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "JPEGDEC.h"
+#include "test.h"
+
+#define FB_WIDTH 1448
+#define FB_HEIGHT 1072
+#define MUTANTS 100
+#define TIMEOUT_SEC 10
+// JPEG_DECODE_PROGRESSIVE_BUF and a cap on the saliency map, as the firmware
+#define PROGRESSIVE_MAX (4 * 1024 * 1024)
+#define SALIENCY_MAX (1024 * 1024)
+
+static const char *default_files[] = {
+    "../bench/corpus/baseline_420.jpg", "../bench/corpus/baseline_444.jpg",
+    "../bench/corpus/baseline_gray.jpg", "../bench/corpus/large_420_exif6.jpg",
+    "../bench/corpus/progressive_420.jpg", "../bench/corpus/restart_420.jpg",
+};
+
+static uint8_t fb[FB_WIDTH / 2 * FB_HEIGHT];
+static char current[128];
+
+static void on_timeout(int sig) {
+  fprintf(stderr, "decode of %s did not finish in %d s\n", current, TIMEOUT_SEC);
+  abort();
+}
+
+static int thumb_draw(JPEGDRAW *draw) {
+  return 1;
+}
+
+// xorshift32, the same mutants of a file on every run with the same seed
+static uint32_t rng;
+static uint32_t next(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// Offset of the entropy coded data after the first SOS, or `size'
+static size_t scan_start(const uint8_t *data, size_t size) {
+  size_t i = 2;
+  while (i + 4 <= size && data[i] == 0xff) {
+    size_t len = data[i + 2] << 8 | data[i + 3];
+    if (data[i + 1] == 0xda) {
+      return i + 2 + len < size ? i + 2 + len : size;
+    }
+    i += 2 + len;
+  }
+  return size;
+}
+
+// Mutate `data' in place, returns the new size and describes it in `current'
+static size_t mutate(uint8_t *data, size_t size, const char *name) {
+  size_t header = scan_start(data, size);
+  uint32_t kind = next() % 6;
+  size_t at = 0;
+  switch (kind) {
+    case 0:  // any header byte
+    case 1:
+      at = next() % header;
+      data[at] = next();
+      break;
+    case 2:  // header byte at an edge value
+      at = next() % header;
+      data[at] = (const uint8_t[]){0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff}[next() % 6];
+      break;
+    case 3:  // a 16-bit field of the header, such as a length
+      at = next() % (header - 1);
+      data[at] = next();
+      data[at + 1] = next();
+      break;
+    case 4:  // entropy coded data
+      at = header + next() % (size - header);
+      data[at] ^= 1 << (next() % 8);
+      break;
+    case 5:  // cut short
+      at = next() % size;
+      size = at;
+      break;
+  }
+  snprintf(current, sizeof(current), "%s kind %u at %zu", name, kind, at);
+  return size;
+}
+
+// draw_jpeg_jpegdec() and draw_jpeg_thumbnail() on one input
+static void decode(uint8_t *data, size_t size, int variant) {
+  static JPEGIMAGE jpeg;
+  if (!JPEG_openRAM(&jpeg, data, size, thumb_draw)) {
+    return;
+  }
+  int scale = variant % 4;
+  int options = JPEG_AUTO_ROTATE | (scale == 1 ? JPEG_SCALE_HALF : scale == 2 ? JPEG_SCALE_QUARTER
+                                    : scale == 3 ? JPEG_SCALE_EIGHTH : 0);
+  if (variant & 4) {
+    options |= JPEG_PARALLEL_DECODE;
+  }
+  if (JPEG_getJPEGType(&jpeg) == JPEG_MODE_PROGRESSIVE &&
+      JPEG_getProgressiveSize(&jpeg, options) > PROGRESSIVE_MAX) {
+    return;
+  }
+  if (JPEG_hasThumb(&jpeg)) {
+    JPEG_setPixelType(&jpeg, EIGHT_BIT_GRAYSCALE);
+    JPEG_decode(&jpeg, 0, 0, JPEG_EXIF_THUMBNAIL);
+    if (!JPEG_openRAM(&jpeg, data, size, thumb_draw)) {
+      return;
+    }
+  }
+  size_t blocks = (size_t)((JPEG_getWidth(&jpeg) + 7) / 8) * ((JPEG_getHeight(&jpeg) + 7) / 8);
+  if (blocks <= SALIENCY_MAX && (JPEG_getJPEGType(&jpeg) != JPEG_MODE_PROGRESSIVE ||
+                                 JPEG_getProgressiveSize(&jpeg, JPEG_SCALE_QUARTER) <= PROGRESSIVE_MAX)) {
+    uint8_t *map = malloc(blocks ? blocks : 1);
+    JPEG_getSaliency(&jpeg, map);
+    free(map);
+    if (!JPEG_openRAM(&jpeg, data, size, thumb_draw)) {
+      return;
+    }
+  }
+  int x = (FB_WIDTH - (JPEG_getWidth(&jpeg) >> scale)) / 2;
+  int y = (FB_HEIGHT - (JPEG_getHeight(&jpeg) >> scale)) / 2;
+  JPEG_decodeEPD(&jpeg, fb, FB_WIDTH, FB_HEIGHT, variant % 3, NULL, x, y, options);
+}
+
+static uint8_t *read_file(const char *filename, size_t *size) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *data = malloc(*size);
+  if (data && fread(data, 1, *size, f) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+int main(int argc, char **argv) {
+  int mutants = argc > 1 ? atoi(argv[1]) : MUTANTS;
+  uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+  const char **files = argc > 3 ? (const char **)argv + 3 : default_files;
+  int count = argc > 3 ? argc - 3 : sizeof(default_files) / sizeof(default_files[0]);
+  signal(SIGALRM, on_timeout);
+  for (int f = 0; f < count; f++) {
+    size_t size;
+    uint8_t *original = read_file(files[f], &size);
+    CHECK(original != NULL);
+    if (!original) {
+      continue;
+    }
+    const char *name = strrchr(files[f], '/') ? strrchr(files[f], '/') + 1 : files[f];
+    uint8_t *data = malloc(size);
+    rng = seed ? seed : 1;
+    // the intact file decodes
+    static JPEGIMAGE jpeg;
+    memcpy(data, original, size);
+    CHECK(JPEG_openRAM(&jpeg, data, size, thumb_draw) &&
+          JPEG_decodeEPD(&jpeg, fb, FB_WIDTH, FB_HEIGHT, 0, NULL, 0, 0, 0));
+    for (int m = 0; m < mutants; m++) {
+      // a copy of just the mutated size, so that reads past it are caught
+      memcpy(data, original, size);
+      size_t mutated = mutate(data, size, name);
+      uint8_t *input = malloc(mutated ? mutated : 1);
+      memcpy(input, data, mutated);
+      fprintf(stderr, "%s\r", current);
+      alarm(TIMEOUT_SEC);
+      decode(input, mutated, m);
+      alarm(0);
+      free(input);
+      test_checks++;
+    }
+    free(data);
+    free(original);
+  }
+  fprintf(stderr, "\n");
+#ifdef JPEG_HUFF_PAIRS
+  return test_summary("jpeg_mutate_pairs");
+#else
+  return test_summary("jpeg_mutate");
+#endif
+}
@@ -0,0 +1,149 @@
+// Host test of main/sntp_lean.c: packet checks on hand-made replies, then
+// queries against scripts/ntp_standin.py on localhost.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "sntp_lean.h"
+#include "server.h"
+#include "test.h"
+
+#define NTP_UNIX_OFFSET 2208988800LL
+#define TIMEOUT_MS 1000
+
+static int64_t now_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void put_ts(uint8_t *p, int64_t unix_us) {
+  uint64_t ts = (uint64_t)(unix_us / 1000000LL + NTP_UNIX_OFFSET) << 32 |
+                ((uint64_t)(unix_us % 1000000LL) << 32) / 1000000ULL;
+  for (int i = 7; i >= 0; i--) {
+    p[i] = ts & 0xff;
+    ts >>= 8;
+  }
+}
+
+// Server reply to `request', received at `t2_us' and sent at `t3_us'
+static void make_reply(uint8_t *reply, const uint8_t *request, int64_t t2_us,
+                       int64_t t3_us) {
+  memset(reply, 0, SNTP_LEAN_PACKET_SIZE);
+  reply[0] = 0 << 6 | 4 << 3 | 4;  // LI 0, version 4, mode 4 (server)
+  reply[1] = 2;                    // stratum
+  memcpy(reply + 24, request + 40, 8);
+  put_ts(reply + 32, t2_us);
+  put_ts(reply + 40, t3_us);
+}
+
+static void test_packets(void) {
+  const int64_t t1 = 1704881800LL * 1000000LL + 250000;
+  uint8_t request[SNTP_LEAN_PACKET_SIZE], reply[SNTP_LEAN_PACKET_SIZE];
+  sntp_lean_request(request, t1);
+  CHECK_EQ(request[0], 0x23);
+  for (int i = 1; i < 40; i++) {
+    CHECK_EQ(request[i], 0);
+  }
+
+  // server 2 s ahead, 40 ms each way, 10 ms to answer
+  sntp_lean_result result;
+  make_reply(reply, request, t1 + 2040000, t1 + 2050000);
+  CHECK_EQ(sntp_lean_reply(reply, sizeof(reply), t1, t1 + 90000, &result), ESP_OK);
+  CHECK(llabs(result.offset_us - 2000000) <= 1);
+  CHECK(llabs(result.delay_us - 80000) <= 1);
+
+  CHECK_EQ(sntp_lean_reply(reply, sizeof(reply) - 1, t1, t1 + 90000, &result),
+           ESP_ERR_INVALID_SIZE);
+  // kiss-o'-death
+  make_reply(reply, request, t1, t1);
+  reply[1] = 0;
+  CHECK_EQ(sntp_lean_reply(reply, sizeof(reply), t1, t1, &result), ESP_ERR_INVALID_RESPONSE);
+  // unsynchronized
+  make_reply(reply, request, t1, t1);
+  reply[0] |= 3 << 6;
+  CHECK_EQ(sntp_lean_reply(reply, sizeof(reply), t1, t1, &result), ESP_ERR_INVALID_RESPONSE);
+  // an answer to another request
+  make_reply(reply, request, t1, t1);
+  CHECK_EQ(sntp_lean_reply(reply, sizeof(reply), t1 + 1, t1, &result), ESP_ERR_INVALID_RESPONSE);
+  // not a server reply
+  make_reply(reply, request, t1, t1);
+  reply[0] = 0x23;
+  CHECK_EQ(sntp_lean_reply(reply, sizeof(reply), t1, t1, &result), ESP_ERR_INVALID_RESPONSE);
+}
+
+typedef struct {
+  const char *mode;
+  const char *offset;
+} standin;
+
+// Start `count' stand-ins as `standins' describe and query them
+static esp_err_t query(const standin *standins, int count, sntp_lean_result *result,
+                       int64_t *elapsed_us) {
+  server srv[4];
+  char names[4][32];
+  const char *servers[4];
+  int started = 0;
+  for (; started < count; started++) {
+    char *argv[] = {"python3", "../scripts/ntp_standin.py", "--port", "0", "--mode",
+                    (char *)standins[started].mode, "--offset",
+                    (char *)standins[started].offset, NULL};
+    if (!server_start(&srv[started], argv)) {
+      break;
+    }
+    snprintf(names[started], sizeof(names[started]), "127.0.0.1:%d", srv[started].port);
+    servers[started] = names[started];
+  }
+  esp_err_t err = ESP_FAIL;
+  if (started == count) {
+    int64_t start = now_us();
+    err = sntp_lean_query(servers, count, TIMEOUT_MS, result);
+    *elapsed_us = now_us() - start;
+  } else {
+    CHECK(!"stand-in started");
+  }
+  while (started > 0) {
+    server_stop(&srv[--started]);
+  }
+  return err;
+}
+
+static void test_query(void) {
+  sntp_lean_result result;
+  int64_t elapsed;
+
+  const standin valid[] = {{"normal", "3.5"}};
+  CHECK_EQ(query(valid, 1, &result, &elapsed), ESP_OK);
+  CHECK(llabs(result.offset_us - 3500000) < 50000);
+  CHECK(result.delay_us >= 0 && result.delay_us < 50000);
+  CHECK_EQ(result.server, 0);
+
+  const standin kod[] = {{"kod", "0"}};
+  CHECK_EQ(query(kod, 1, &result, &elapsed), ESP_ERR_INVALID_RESPONSE);
+  // rejected on arrival, without waiting for the timeout
+  CHECK(elapsed < TIMEOUT_MS * 1000LL / 2);
+
+  const standin unsynced[] = {{"unsynced", "0"}};
+  CHECK_EQ(query(unsynced, 1, &result, &elapsed), ESP_ERR_INVALID_RESPONSE);
+
+  const standin mismatch[] = {{"mismatch", "0"}};
+  CHECK_EQ(query(mismatch, 1, &result, &elapsed), ESP_ERR_INVALID_RESPONSE);
+
+  const standin silent[] = {{"silent", "0"}};
+  CHECK_EQ(query(silent, 1, &result, &elapsed), ESP_ERR_TIMEOUT);
+  CHECK(elapsed >= TIMEOUT_MS * 1000LL);
+  CHECK(elapsed < TIMEOUT_MS * 1000LL * 3 / 2);
+
+  // a bad or missing answer from one server, the other one counts
+  const standin mixed[] = {{"kod", "0"}, {"silent", "0"}, {"normal", "-2"}};
+  memset(&result, 0, sizeof(result));
+  CHECK_EQ(query(mixed, 3, &result, &elapsed), ESP_OK);
+  CHECK_EQ(result.server, 2);
+  CHECK(llabs(result.offset_us + 2000000) < 50000);
+}
+
+int main(void) {
+  test_packets();
+  test_query();
+  return test_summary("sntp_lean");
+}